@@ -0,0 +1,164 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "record.h"
+#include "batch.h"
+
+void batch_init(Frame_Batch_t *b, uint32_t limit, batch_flush_t flush,
+	void *ctx) {
+    memset(b->sessions, 0, sizeof (b->sessions));
+
+    b->len = frame_start(b->buf, 0);
+    b->limit = (limit > RAW_BATCH_SZ) ? RAW_BATCH_SZ : limit;
+    b->batch_id = 1;
+    b->nb_records = 0;
+    b->tick = b->evictions = b->drops = 0;
+    b->flush = flush;
+    b->ctx = ctx;
+}
+
+void batch_flush(Frame_Batch_t *b) {
+
+    if (b->nb_records == 0)
+	return;
+
+    b->flush(b->buf, b->len, b->ctx);
+
+    b->len = frame_start(b->buf, 0);
+    b->nb_records = 0;
+    b->batch_id++;
+}
+
+/*
+ * Find the session slot for sid, of that uid when it is set. With create
+ * set, a missing session takes a free slot or evicts the least recently
+ * used one in its probe window, which depends on sid only.
+ */
+static Batch_Session_t *batch_session(Frame_Batch_t *b, uint32_t sid,
+	const uint32_t *uid, int create) {
+    Batch_Session_t *s = NULL, *victim = NULL;
+    uint32_t h = sid * 2654435761u;
+    int i = 0;
+
+    for (i = 0; i < BATCH_PROBE; i++) {
+	s = &b->sessions[(h + i) & (BATCH_SESSIONS - 1)];
+
+	if (s->used && s->open.sid == sid &&
+		(uid == NULL || s->open.uid == *uid))
+	    return s;
+
+	if (victim == NULL || !s->used ||
+		(victim->used && s->last_used < victim->last_used))
+	    victim = s;
+    }
+
+    if (!create)
+	return NULL;
+
+    if (victim->used)
+	b->evictions++;
+
+    memset(victim, 0, sizeof (*victim));
+    victim->open.sid = sid;
+    victim->open.uid = uid ? *uid : 0;
+    victim->used = 1;
+
+    return victim;
+}
+
+/* Whether another session with the sid of s is in the frame already */
+static int batch_sid_taken(const Frame_Batch_t *b, const Batch_Session_t *s) {
+    const Batch_Session_t *t = NULL;
+    uint32_t h = s->open.sid * 2654435761u;
+    int i = 0;
+
+    for (i = 0; i < BATCH_PROBE; i++) {
+	t = &b->sessions[(h + i) & (BATCH_SESSIONS - 1)];
+	if (t != s && t->used && t->open.sid == s->open.sid &&
+		t->batch_id == b->batch_id)
+	    return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Add the records of one client frame. owner binds sessions to a sending
+ * process (0 disables the check) and is then the pid open records get;
+ * uid, when set, overrides the uid they claim and sids are only looked
+ * up among the sessions of that uid. Returns the number of records
+ * dropped, -1 on a malformed frame.
+ */
+int batch_add_frame(Frame_Batch_t *b, const uint8_t *frame, uint32_t len,
+	uint32_t owner, const uint32_t *uid) {
+    Frame_Iter_t it;
+    Record_Open_t ro;
+    Record_Data_t rd;
+    Batch_Session_t *s = NULL;
+    uint32_t need = 0;
+    int kind = 0, ret = 0, drops = 0;
+
+    if (!frame_is_v2(frame, len) ||
+	    (FRAME_FLAGS(frame) & (FRAME_F_DEFLATE | FRAME_F_FRAG)))
+	return -1;
+
+    frame_iter_init(&it, &frame[FRAME_HDR_SZ], len - FRAME_HDR_SZ,
+	    FRAME_FLAGS(frame));
+
+    while ((ret = frame_next(&it, &kind, &ro, &rd)) > 0) {
+
+	if (kind == REC_OPEN) {
+	    s = batch_session(b, ro.sid, uid, 1);
+	    if (uid != NULL)
+		ro.uid = *uid;
+	    if (owner)
+		ro.pid = owner;
+	    s->open = ro;
+	    s->owner = owner;
+	    s->batch_id = 0;
+	    s->last_used = ++b->tick;
+	    continue;
+	}
+
+	s = batch_session(b, rd.sid, uid, 0);
+
+	if (owner && (s == NULL || s->owner != owner)) {
+	    b->drops++;
+	    drops++;
+	    continue;
+	}
+
+	need = record_data_sz(&rd);
+	if (s != NULL && s->batch_id != b->batch_id)
+	    need += REC_OPEN_MAX_SZ;
+
+	/* two sessions with one sid would mix up in a frame */
+
+	if (b->nb_records && (b->len + need > b->limit ||
+		(s != NULL && s->batch_id != b->batch_id &&
+		batch_sid_taken(b, s)))) {
+	    batch_flush(b);
+	}
+
+	if (s != NULL) {
+	    if (s->batch_id != b->batch_id) {
+		b->len += record_put_open(&b->buf[b->len], &s->open);
+		s->batch_id = b->batch_id;
+	    }
+	    s->last_used = ++b->tick;
+	}
+
+	if (b->nb_records == 0)
+	    b->sid = rd.sid;
+	else if (rd.sid != b->sid)
+	    FRAME_FLAGS(b->buf) |= FRAME_F_MERGED;
+
+	b->len += record_put_data(&b->buf[b->len], &rd);
+	b->nb_records++;
+    }
+
+    return (ret < 0) ? -1 : drops;
+}
@@ -0,0 +1,55 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stdint.h>
+
+/*
+ * Merges v2 frames from many sessions into larger frames. Open records
+ * are remembered per session and re-emitted in front of the first data
+ * record a session gets in each output frame, so every flushed frame
+ * decodes on its own. A frame that ends up with records of more than
+ * one session is flagged FRAME_F_MERGED. Include config.h first.
+ *
+ * The session table is a cache: a session may be evicted for another
+ * one in its probe window, and is only known again from its next open
+ * record. When sessions are bound to a sender, data records of an
+ * unknown session are dropped, so senders put the open record in every
+ * frame. Both are counted. Sessions of different uids may share a sid;
+ * they never go into the same frame.
+ */
+
+#define BATCH_SESSIONS 4096 /* power of two */
+#define BATCH_PROBE 8
+
+typedef struct {
+    Record_Open_t open;
+    uint32_t owner;    /* sender the session is bound to, 0 if unchecked */
+    uint32_t batch_id; /* last output frame the open record went into */
+    uint64_t last_used;
+    int used;
+} Batch_Session_t;
+
+typedef void (*batch_flush_t)(const uint8_t *frame, uint32_t len, void *ctx);
+
+typedef struct {
+    uint8_t buf[RAW_BATCH_SZ + FRAME_MAX_SZ];
+    uint32_t len;
+    uint32_t limit;
+    uint32_t batch_id;
+    uint32_t nb_records;
+    uint32_t sid;       /* of the first record in the frame */
+    uint64_t tick;
+    uint64_t evictions; /* sessions forgotten for another one */
+    uint64_t drops;     /* data records of unknown sessions */
+    batch_flush_t flush;
+    void *ctx;
+    Batch_Session_t sessions[BATCH_SESSIONS];
+} Frame_Batch_t;
+
+void batch_init(Frame_Batch_t *b, uint32_t limit, batch_flush_t flush,
+        void *ctx);
+int batch_add_frame(Frame_Batch_t *b, const uint8_t *frame, uint32_t len,
+        uint32_t owner, const uint32_t *uid);
+void batch_flush(Frame_Batch_t *b);
+
+#endif /* _BATCH_H */
@@ -0,0 +1,691 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "config.h"
+#include "packet.h"
+#include "codec.h"
+#include "logread.h"
+
+/*
+ * Fuzz harness for the log reader and the server receive path, with a
+ * generated corpus of valid packets to mutate and a throughput check of
+ * the same paths, so tighter bounds do not cost speed and a faster
+ * decoder does not bring memory bugs.
+ *
+ * The first byte of an input picks the target, the rest is its data:
+ *
+ *   FUZZ_LOG     a log file, read with log_read_packets() and decoded,
+ *                fragments and jumbo packets included
+ *   FUZZ_PLAIN   a plaintext, through log_decode() and log_peek()
+ *   FUZZ_SERVER  a plaintext sealed into a datagram and taken through
+ *                what the server does with it (verify, peek, decrypt,
+ *                decode), then stored and read back like the parser
+ *
+ * "make fuzz" builds the standalone driver under AddressSanitizer and
+ * UBSan. LLVMFuzzerTestOneInput() is the libFuzzer entry point, clang
+ * builds it with -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER and -c
+ * writes a seed corpus for it (run it with -close_fd_mask=1, decode
+ * errors go to stdout).
+ *
+ * The standalone driver first checks the literal runs regex_runs() finds
+ * in a few regexes: search and the rule engine skip whatever does not
+ * hold them, so a wrong run is a silent miss.
+ */
+
+#define FUZZ_LOG     0
+#define FUZZ_PLAIN   1
+#define FUZZ_SERVER  2
+#define FUZZ_TARGETS 3
+
+#define FUZZ_MAX_SZ   (1024 * 64)
+#define FUZZ_CORPUS   256
+#define FUZZ_RUNS     100000
+#define FUZZ_LOG_PKTS 8    /* stored packets in a generated log input */
+#define FUZZ_BULK_SZ  (3 * FRAG_SLICE_SZ)
+#define FUZZ_CRASH    "fuzz-crash.bin"
+
+#define BENCH_LOG_SZ  (1024 * 1024 * 16)
+#define BENCH_MIN_US  500000
+
+#define REGEX_RUNS_SZ 256
+
+#define fuzz_check(cond, what) do {                                     \
+	if (!(cond)) {                                                  \
+	    fprintf(stderr, "bench_fuzz: %s\n", what);                  \
+	    abort();                                                    \
+	}                                                               \
+    } while (0)
+
+typedef struct {
+    uint64_t records;
+    uint64_t bytes;
+    uint32_t sum;
+} Fuzz_Count_t;
+
+typedef struct {
+    uint8_t *data;
+    uint32_t len;
+} Fuzz_Input_t;
+
+static int log_fd = -1;
+static Frag_Table_t frags; /* kept from one input to the next */
+
+static void on_open(void *ctx, uint32_t ip, const Record_Open_t *ro) {
+    Fuzz_Count_t *cnt = ctx;
+
+    cnt->records++;
+    cnt->sum += ip ^ ro->sid ^ ro->uid ^ ro->pid ^ (uint32_t) ro->base_us;
+}
+
+/* Every byte is read, so data past the packet shows up under ASan */
+static void on_data(void *ctx, uint32_t ip, const Record_Data_t *rd) {
+    Fuzz_Count_t *cnt = ctx;
+    uint32_t i = 0;
+
+    (void) ip;
+
+    for (i = 0; i < rd->len; i++)
+	cnt->sum += rd->data[i];
+
+    cnt->sum += rd->sid ^ rd->dir ^ rd->seq ^ (uint32_t) rd->delta_us;
+    cnt->records++;
+    cnt->bytes += rd->len;
+}
+
+/* Make data the contents of the scratch log, positioned at its start */
+static void log_load(const uint8_t *data, size_t size) {
+    if (log_fd < 0 && (log_fd = memfd_create("bench_fuzz", 0)) < 0) {
+	perror("memfd_create");
+	exit(1);
+    }
+
+    if (ftruncate(log_fd, 0) < 0 ||
+	    pwrite(log_fd, data, size, 0) != (ssize_t) size) {
+	perror("log_load");
+	exit(1);
+    }
+
+    lseek(log_fd, 0, SEEK_SET);
+}
+
+static void fuzz_log(const uint8_t *data, size_t size) {
+    static Log_Packet_t pkts[LOG_BATCH];
+    Fuzz_Count_t cnt = { 0, 0, 0 };
+    Log_Handler_t h = { on_open, on_data, &cnt, &frags };
+    int i = 0, n = 0;
+
+    log_load(data, size);
+
+    while ((n = log_read_packets(log_fd, pkts, LOG_BATCH)) > 0) {
+	for (i = 0; i < n; i++) {
+	    if (pkts[i].len >= 0)
+		log_decode(pkts[i].plain, pkts[i].len, pkts[i].ip, &h);
+	}
+    }
+}
+
+static void fuzz_plain(const uint8_t *data, size_t size) {
+    Fuzz_Count_t cnt = { 0, 0, 0 };
+    Log_Handler_t h = { on_open, on_data, &cnt, &frags };
+    Record_Open_t ro;
+    int dir = 0;
+
+    log_decode(data, size, 0, &h);
+    log_peek(data, size, &ro, &dir);
+    log_peek(data, (size < LOG_PEEK_SZ) ? size : LOG_PEEK_SZ, &ro, &dir);
+}
+
+static void fuzz_server(const uint8_t *data, size_t size) {
+    static uint8_t logbuf[MAX_LOG_PKT_SZ];
+    static uint8_t readbuf[MAX_STORED_PKT_SZ];
+    static uint8_t plain[MAX_TRANSFER_PKT_SZ];
+    uint8_t peek[LOG_PEEK_SZ];
+    Fuzz_Count_t sent = { 0, 0, 0 }, logged = { 0, 0, 0 };
+    Log_Handler_t hs = { on_open, on_data, &sent, NULL };
+    Log_Handler_t hl = { on_open, on_data, &logged, NULL };
+    Record_Open_t ro;
+    uint8_t *pkt = STORED_PKT(logbuf), *read_plain = NULL;
+    uint32_t ip = htonl(INADDR_LOOPBACK), read_ip = 0;
+    int len = 0, n = 0, dir = 0, ret = 0;
+
+    /* the largest datagram the server takes */
+
+    if (size > MAX_TRANSFER_PKT_SZ - PKT_OVERHEAD)
+	size = MAX_TRANSFER_PKT_SZ - PKT_OVERHEAD;
+
+    len = packet_seal(data, size, pkt);
+    if (len < MIN_PKT_SZ)
+	return;
+
+    fuzz_check(packet_verify(pkt, len) == (int) size, "sealed packet rejected");
+
+    n = packet_decrypt_prefix(pkt, len, peek, sizeof (peek));
+    fuzz_check(n >= 0, "prefix decryption failed");
+    log_peek(peek, n, &ro, &dir);
+
+    n = packet_decrypt(pkt, len, plain);
+    fuzz_check(n == (int) size && memcmp(plain, data, size) == 0,
+	    "decryption does not give the plaintext back");
+    ret = log_decode(plain, n, ip, &hs);
+
+    /* stored and read back, it must decode to the same records */
+
+    stored_put_hdr(logbuf, ip, len);
+    log_load(logbuf, STORED_HDR_SZ + len);
+
+    n = log_read_packet(log_fd, readbuf, &read_ip, &read_plain);
+    fuzz_check(n == (int) size && read_ip == ip &&
+	    memcmp(read_plain, data, size) == 0, "stored packet read back wrong");
+    fuzz_check(log_decode(read_plain, n, read_ip, &hl) == ret &&
+	    sent.records == logged.records && sent.sum == logged.sum,
+	    "stored packet decodes differently");
+
+    pkt[PKT_DATA_OFF + rand() % (len - PKT_OVERHEAD)] ^= 1 << (rand() % 8);
+    fuzz_check(packet_verify(pkt, len) < 0, "tampered packet accepted");
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0)
+	return 0;
+
+    switch (data[0] % FUZZ_TARGETS) {
+    case FUZZ_LOG:
+	fuzz_log(data + 1, size - 1);
+	break;
+    case FUZZ_PLAIN:
+	fuzz_plain(data + 1, size - 1);
+	break;
+    case FUZZ_SERVER:
+	fuzz_server(data + 1, size - 1);
+	break;
+    }
+
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+static Fuzz_Input_t corpus[FUZZ_CORPUS];
+static Fuzz_Input_t current;
+
+/* Mostly keystrokes and short output, now and then a larger burst */
+static uint32_t gen_payload(uint8_t *buf, uint32_t max) {
+    uint32_t len = (rand() % 8) ? rand() % 64 : rand() % 1024;
+    uint32_t i = 0;
+
+    if (len > max)
+	len = max;
+
+    for (i = 0; i < len; i++)
+	buf[i] = (rand() % 4) ? 0x20 + rand() % 0x5F : rand();
+
+    return len;
+}
+
+/* Records of a v2 frame after its header, up to max bytes */
+static uint32_t gen_records(uint8_t *buf, uint32_t max) {
+    static uint8_t payload[BUF_SZ];
+    Record_Open_t ro;
+    Record_Data_t rd;
+    uint32_t n = 0;
+    int sessions = 1 + rand() % 3, records = 0, i = 0;
+
+    while (sessions--) {
+	ro.sid = rand() % 4096;
+	ro.uid = rand() % 2000;
+	ro.pid = ro.sid;
+	ro.base_us = 1700000000000000ULL + rand();
+
+	if (n + REC_OPEN_MAX_SZ > max)
+	    break;
+	n += record_put_open(&buf[n], &ro);
+
+	records = 1 + rand() % 8;
+	for (i = 0; i < records; i++) {
+	    rd.sid = ro.sid;
+	    rd.delta_us = (uint64_t) i * 100000 + rand() % 100000;
+	    rd.dir = rand() & 1;
+	    rd.seq = i + 1;
+	    rd.data = payload;
+	    rd.len = gen_payload(payload, SZARR(payload));
+
+	    if (n + record_data_sz(&rd) > max)
+		break;
+	    n += record_put_data(&buf[n], &rd);
+	}
+    }
+
+    return n;
+}
+
+/* A plaintext of any record format, at most FRAME_MAX_SZ bytes */
+static uint32_t gen_plain(uint8_t *buf) {
+    static uint8_t raw[FRAME_MAX_SZ];
+    Session_Data_t *sd = (Session_Data_t *) buf;
+    Session_Data_t *rec = NULL;
+    uint32_t n = 0, raw_len = 0;
+    uLongf zlen = 0;
+
+    switch (rand() % 6) {
+    case 0:
+	n = frame_start(buf, 0);
+	return n + gen_records(&buf[n], FRAME_MAX_SZ - n);
+    case 1:
+	raw_len = gen_records(raw, SZARR(raw));
+	n = frame_start(buf, FRAME_F_DEFLATE);
+	n += varint_put(&buf[n], raw_len);
+	zlen = FRAME_MAX_SZ - n;
+	compress(&buf[n], &zlen, raw, raw_len);
+	return n + zlen;
+    case 2:
+	return frame_put_slowdown(buf, rand() % 10000, rand());
+    case 3:
+	sd->time = 1700000000 + rand() % 1000;
+	sd->uid = rand() % 2000;
+	sd->pid = rand() % 4096;
+	sd->dir = rand() & 1;
+	sd->len = gen_payload(sd->buffer, FRAME_MAX_SZ - SESSION_SZ);
+	return SESSION_SZ + sd->len;
+    default:
+	/* v1 batch, deflated one time out of two */
+	while (raw_len + SESSION_SZ + 64 <= SZARR(raw) && rand() % 8) {
+	    rec = (Session_Data_t *) &raw[raw_len];
+	    rec->time = 1700000000 + rand() % 1000;
+	    rec->uid = rand() % 2000;
+	    rec->pid = rand() % 4096;
+	    rec->dir = rand() & 1;
+	    rec->len = gen_payload(rec->buffer, 64);
+	    raw_len += SESSION_SZ + rec->len;
+	}
+
+	sd->time = 1700000000;
+	sd->uid = sd->pid = 0;
+	sd->dir = rand() % 2 ? BATCH_Z_DIR : BATCH_DIR;
+	sd->len = raw_len;
+
+	if (sd->dir == BATCH_Z_DIR) {
+	    memcpy(sd->buffer, &raw_len, sizeof (uint32_t));
+	    zlen = FRAME_MAX_SZ - SESSION_SZ - sizeof (uint32_t);
+	    compress(sd->buffer + sizeof (uint32_t), &zlen, raw, raw_len);
+	    sd->len = sizeof (uint32_t) + zlen;
+	} else {
+	    memcpy(sd->buffer, raw, raw_len);
+	}
+
+	return SESSION_SZ + sd->len;
+    }
+}
+
+/* Seal and store one plaintext at the end of a generated log */
+static void gen_stored(const uint8_t *plain, uint32_t len, void *ctx) {
+    Fuzz_Input_t *log = ctx;
+    uint32_t n = 0;
+
+    n = packet_seal(plain, len, &log->data[log->len +
+	    stored_hdr_sz(PKT_OVERHEAD + len)]);
+    log->len += stored_put_hdr(&log->data[log->len], htonl(0x0A000001), n) + n;
+}
+
+static void gen_corpus(void) {
+    static uint8_t buf[FUZZ_MAX_SZ];
+    static uint8_t plain[FUZZ_BULK_SZ];
+    Fuzz_Input_t log = { buf, 0 };
+    uint32_t n = 0;
+    int i = 0, p = 0;
+
+    for (i = 0; i < FUZZ_CORPUS; i++) {
+	buf[0] = i % FUZZ_TARGETS;
+	log.len = 1;
+
+	/* bulk frames go in fragments or as a jumbo packet */
+
+	if (buf[0] == FUZZ_LOG) {
+	    for (p = 0; p < FUZZ_LOG_PKTS &&
+		    log.len + 4 * MAX_LOG_PKT_SZ <= FUZZ_MAX_SZ; p++) {
+		if (rand() % 4) {
+		    gen_stored(plain, gen_plain(plain), &log);
+		    continue;
+		}
+
+		n = frame_start(plain, 0);
+		n += gen_records(&plain[n], FUZZ_BULK_SZ - n);
+
+		if (rand() % 2)
+		    frag_split(plain, n, rand(), gen_stored, &log);
+		else
+		    gen_stored(plain, n, &log);
+	    }
+	} else {
+	    log.len += gen_plain(&buf[1]);
+	}
+
+	corpus[i].data = malloc(log.len);
+	corpus[i].len = log.len;
+	memcpy(corpus[i].data, buf, log.len);
+    }
+}
+
+static int write_corpus(const char *dir) {
+    char path[PATH_MAX];
+    FILE *fp = NULL;
+    int i = 0;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+	perror(dir);
+	return -1;
+    }
+
+    for (i = 0; i < FUZZ_CORPUS; i++) {
+	snprintf(path, sizeof (path), "%s/seed-%03d", dir, i);
+	if ((fp = fopen(path, "w")) == NULL ||
+		fwrite(corpus[i].data, corpus[i].len, 1, fp) != 1) {
+	    perror(path);
+	    return -1;
+	}
+	fclose(fp);
+    }
+
+    return 0;
+}
+
+/* Bit flips, interesting bytes, truncation, inserts and varint runs */
+static uint32_t mutate(uint8_t *buf, uint32_t len, uint32_t max) {
+    static const uint8_t interesting[] = { 0x00, 0x01, 0x7F, 0x80, 0xFF };
+    uint32_t pos = 0, n = 0, i = 0;
+    int ops = 1 + rand() % 4;
+
+    while (ops-- && len) {
+	pos = rand() % len;
+
+	switch (rand() % 6) {
+	case 0:
+	    buf[pos] ^= 1 << (rand() % 8);
+	    break;
+	case 1:
+	    buf[pos] = rand();
+	    break;
+	case 2:
+	    buf[pos] = interesting[rand() % SZARR(interesting)];
+	    break;
+	case 3:
+	    len = pos + 1;
+	    break;
+	case 4:
+	    n = 1 + rand() % 16;
+	    if (len + n > max)
+		break;
+	    memmove(&buf[pos + n], &buf[pos], len - pos);
+	    for (i = 0; i < n; i++)
+		buf[pos + i] = rand();
+	    len += n;
+	    break;
+	default:
+	    n = 1 + rand() % VARINT_MAX_SZ;
+	    for (i = 0; i < n && pos + i < len; i++)
+		buf[pos + i] |= 0x80;
+	}
+    }
+
+    return len;
+}
+
+/*
+ * Send stdout, where decode errors are printed, to /dev/null while
+ * inputs run. Returns the descriptor to give to unmute().
+ */
+static int mute(void) {
+    int saved = dup(STDOUT_FILENO);
+    int fd = open("/dev/null", O_WRONLY);
+
+    fflush(stdout);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+
+    return saved;
+}
+
+static void unmute(int saved) {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+/* Run one input from an allocation of its exact size */
+static void run_input(const uint8_t *data, uint32_t len) {
+    current.data = malloc(len ? len : 1);
+    current.len = len;
+    memcpy(current.data, data, len);
+
+    LLVMFuzzerTestOneInput(current.data, len);
+
+    free(current.data);
+    current.data = NULL;
+}
+
+/* Keep the input that brought the process down */
+static void save_crash(void) {
+    FILE *fp = NULL;
+
+    if (current.data == NULL || (fp = fopen(FUZZ_CRASH, "w")) == NULL)
+	return;
+
+    fwrite(current.data, current.len, 1, fp);
+    fclose(fp);
+    fprintf(stderr, "bench_fuzz: input saved to %s\n", FUZZ_CRASH);
+}
+
+static void on_signal(int sig) {
+    save_crash();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+extern void __sanitizer_set_death_callback(void (*cb)(void)) __attribute__((weak));
+
+static int run_file(const char *path) {
+    static uint8_t buf[FUZZ_MAX_SZ];
+    FILE *fp = NULL;
+    size_t len = 0;
+    int saved = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+	perror(path);
+	return -1;
+    }
+
+    len = fread(buf, 1, sizeof (buf), fp);
+    fclose(fp);
+
+    saved = mute();
+    run_input(buf, len);
+    unmute(saved);
+    printf("%s: ok\n", path);
+
+    return 0;
+}
+
+static void fuzz(uint64_t runs) {
+    static uint8_t buf[FUZZ_MAX_SZ];
+    const Fuzz_Input_t *in = NULL;
+    uint64_t start = clock_us(CLOCK_MONOTONIC), elapsed = 0, i = 0;
+    uint32_t len = 0;
+    int saved = mute();
+
+    for (i = 0; i < runs; i++) {
+	in = &corpus[rand() % FUZZ_CORPUS];
+	memcpy(buf, in->data, in->len);
+	len = (i % 8) ? mutate(buf, in->len, sizeof (buf)) : in->len;
+	run_input(buf, len);
+    }
+
+    elapsed = clock_us(CLOCK_MONOTONIC) - start;
+    unmute(saved);
+    printf("fuzz     %10llu inputs  %12.0f inputs/s\n",
+	    (unsigned long long) runs, elapsed ? 1e6 * runs / elapsed : 0);
+}
+
+/*
+ * Read path throughput over a log of the generated v2 frames, the way
+ * the parser reads it. Returns the MB/s of stored bytes.
+ */
+static double throughput(void) {
+    static uint8_t logbuf[MAX_LOG_PKT_SZ];
+    static uint8_t plain[FRAME_MAX_SZ];
+    static Log_Packet_t pkts[LOG_BATCH];
+    Fuzz_Count_t cnt = { 0, 0, 0 };
+    Log_Handler_t h = { on_open, on_data, &cnt, NULL };
+    uint8_t *log = malloc(BENCH_LOG_SZ);
+    uint64_t size = 0, start = 0, elapsed = 0, bytes = 0, nb_pkt = 0;
+    int i = 0, n = 0, len = 0;
+
+    while (size + MAX_LOG_PKT_SZ <= BENCH_LOG_SZ) {
+	n = frame_start(plain, 0);
+	n += gen_records(&plain[n], SZARR(plain) - n);
+	len = packet_seal(plain, n, STORED_PKT(logbuf));
+	stored_put_hdr(logbuf, htonl(0x0A000001), len);
+	memcpy(&log[size], logbuf, STORED_HDR_SZ + len);
+	size += STORED_HDR_SZ + len;
+	nb_pkt++;
+    }
+
+    log_load(log, size);
+    free(log);
+
+    start = clock_us(CLOCK_MONOTONIC);
+
+    do {
+	lseek(log_fd, 0, SEEK_SET);
+	while ((n = log_read_packets(log_fd, pkts, LOG_BATCH)) > 0) {
+	    for (i = 0; i < n; i++) {
+		fuzz_check(pkts[i].len >= 0, "generated packet rejected");
+		log_decode(pkts[i].plain, pkts[i].len, pkts[i].ip, &h);
+	    }
+	}
+	bytes += size;
+	elapsed = clock_us(CLOCK_MONOTONIC) - start;
+    } while (elapsed < BENCH_MIN_US);
+
+    printf("read     %10.1f ns/pkt  %12.0f records/s  %9.2f MB/s\n",
+	    1000.0 * elapsed / (nb_pkt * (bytes / size)),
+	    1e6 * cnt.records / elapsed, (double) bytes / elapsed);
+
+    return (double) bytes / elapsed;
+}
+
+static const struct {
+    const char *re;
+    const char *runs; /* each one followed by a '/' */
+} regex_cases[] = {
+    { "wget http", "wget http/" },
+    { "wget[[:space:]]http", "wget/http/" },
+    { "[[:space:]]sh$", "sh/" },
+    { "rm[^]]x", "rm/x/" },
+    { "a[[.].]]b[[=]=]]c", "a/b/c/" },
+    { "(sudo )?rm -rf", "rm -rf/" },
+    { "curl|sh", "" },
+};
+
+static void regex_run(void *ctx, const char *s, uint32_t len) {
+    char *runs = ctx;
+    size_t n = strlen(runs);
+
+    snprintf(&runs[n], REGEX_RUNS_SZ - n, "%.*s/", (int) len, s);
+}
+
+static void check_regex_runs(void) {
+    char runs[REGEX_RUNS_SZ];
+    uint32_t i = 0;
+
+    for (i = 0; i < SZARR(regex_cases); i++) {
+	runs[0] = '\0';
+	regex_runs(regex_cases[i].re, regex_run, runs);
+	fuzz_check(strcmp(runs, regex_cases[i].runs) == 0,
+		regex_cases[i].re);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-n runs] [-s seed] [-m MB/s] [-c dir] [input...]\n\n"
+	    "  -n  mutated inputs to run (default %d), 0 only measures\n"
+	    "  -s  random seed (default 1)\n"
+	    "  -m  fail when the read path is slower than that\n"
+	    "  -c  write the generated corpus to dir and exit\n\n"
+	    "Input files are run once each instead, to replay a crash.\n\n",
+	    name, FUZZ_RUNS);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t runs = FUZZ_RUNS;
+    const char *corpus_dir = NULL;
+    double min_mbps = 0, mbps = 0;
+    int opt = 0;
+
+    srand(1);
+
+    while ((opt = getopt(argc, argv, "n:s:m:c:")) != -1) {
+	switch (opt) {
+	case 'n':
+	    runs = strtoull(optarg, NULL, 10);
+	    break;
+	case 's':
+	    srand(atoi(optarg));
+	    break;
+	case 'm':
+	    min_mbps = atof(optarg);
+	    break;
+	case 'c':
+	    corpus_dir = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (__sanitizer_set_death_callback)
+	__sanitizer_set_death_callback(save_crash);
+    signal(SIGSEGV, on_signal);
+    signal(SIGBUS, on_signal);
+    signal(SIGABRT, on_signal);
+
+    check_regex_runs();
+
+    if (optind < argc) {
+	for (; optind < argc; optind++) {
+	    if (run_file(argv[optind]) < 0)
+		return 1;
+	}
+	return 0;
+    }
+
+    gen_corpus();
+
+    if (corpus_dir)
+	return write_corpus(corpus_dir) < 0;
+
+    fuzz(runs);
+
+    if ((mbps = throughput()) < min_mbps) {
+	fprintf(stderr, "read path at %.2f MB/s, below %.2f\n", mbps, min_mbps);
+	return 1;
+    }
+
+    return 0;
+}
+
+#endif /* FUZZ_LIBFUZZER */
@@ -0,0 +1,243 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "packet.h"
+#include "logread.h"
+
+/*
+ * End-to-end load generator: a number of simulated shells send v2 frames
+ * straight to the server over UDP while a second thread tails the log the
+ * server is writing. Latency is measured from the record timestamp to the
+ * moment the record is read back from the log, so both base and delta are
+ * taken from the realtime clock here.
+ */
+
+#define LOAD_MAX_SAMPLES (1 << 22)
+
+typedef struct {
+    Record_Open_t open;
+    uint32_t nb_sent;
+} Load_Session_t;
+
+typedef struct {
+    int fd_log;
+    volatile int done;
+    uint64_t nb_seen;
+    uint64_t nb_samples;
+    uint32_t *samples; /* latency in us */
+} Load_Tail_t;
+
+static void on_open(void *ctx, uint32_t ip, const Record_Open_t *ro) {
+    (void) ctx;
+    (void) ip;
+    (void) ro;
+}
+
+static void on_data(void *ctx, uint32_t ip, const Record_Data_t *rd) {
+    Load_Tail_t *t = ctx;
+    uint64_t now = clock_us(CLOCK_REALTIME);
+
+    (void) ip;
+
+    t->nb_seen++;
+    if (t->nb_samples < LOAD_MAX_SAMPLES)
+	t->samples[t->nb_samples++] = now > rd->delta_us ? now - rd->delta_us : 0;
+}
+
+static void *tail_log(void *arg) {
+    static uint8_t buffer[MAX_STORED_PKT_SZ];
+    Load_Tail_t *t = arg;
+    Log_Handler_t handler = { on_open, on_data, t, NULL };
+    uint8_t *plain = NULL;
+    uint32_t ip = 0;
+    off_t pos = lseek(t->fd_log, 0, SEEK_END);
+    int len = 0, idle = 0;
+
+    /* keep polling for a short while after the senders stop */
+
+    while (!t->done || idle < 200) {
+	len = log_read_packet(t->fd_log, buffer, &ip, &plain);
+
+	if (len == LOG_EOF || len == LOG_ERR) {
+	    /* half written packet at the tail, retry from its start */
+	    lseek(t->fd_log, pos, SEEK_SET);
+	    usleep(1000);
+	    if (t->done)
+		idle++;
+	    continue;
+	}
+
+	pos = lseek(t->fd_log, 0, SEEK_CUR);
+	idle = 0;
+
+	if (len > 0)
+	    log_decode(plain, len, ip, &handler);
+    }
+
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s sessions] [-r packets/s] [-d seconds] "
+	    "-l <server log>\n\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    static uint8_t frame[FRAME_MAX_SZ];
+    static uint8_t pkt[MAX_TRANSFER_PKT_SZ];
+    static uint8_t payload[BUF_SZ];
+    struct sockaddr_in addr;
+    Load_Session_t *sessions = NULL;
+    Load_Session_t *s = NULL;
+    Load_Tail_t tail;
+    Record_Data_t rd;
+    pthread_t tid;
+    uint64_t start = 0, now = 0, elapsed = 0;
+    uint64_t nb_sent = 0, bytes_sent = 0;
+    uint32_t nb_sessions = 64, rate = 10000, duration = 10;
+    const char *log_path = NULL;
+    int fd = -1, opt = 0, n = 0, len = 0;
+
+    while ((opt = getopt(argc, argv, "s:r:d:l:")) != -1) {
+	switch (opt) {
+	case 's':
+	    nb_sessions = strtoul(optarg, NULL, 0);
+	    break;
+	case 'r':
+	    rate = strtoul(optarg, NULL, 0);
+	    break;
+	case 'd':
+	    duration = strtoul(optarg, NULL, 0);
+	    break;
+	case 'l':
+	    log_path = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (log_path == NULL || nb_sessions == 0 || rate == 0)
+	usage(argv[0]);
+
+    memset(&tail, 0, sizeof(tail));
+    if ((tail.fd_log = open(log_path, O_RDONLY)) < 0) {
+	perror("open");
+	exit(1);
+    }
+    tail.samples = malloc(LOAD_MAX_SAMPLES * sizeof(uint32_t));
+    sessions = calloc(nb_sessions, sizeof(Load_Session_t));
+    if (tail.samples == NULL || sessions == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+	perror("socket");
+	exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(CONNECT_IP);
+    addr.sin_port = htons(SHELL_LOG_SERVER_PORT);
+
+    for (n = 0; n < (int) SZARR(payload); n++)
+	payload[n] = ' ' + rand() % 95;
+
+    for (n = 0; n < (int) nb_sessions; n++) {
+	sessions[n].open.sid = sessions[n].open.pid = 0x40000000 + n;
+	sessions[n].open.uid = 1000 + n % 16;
+	sessions[n].open.base_us = 0;
+    }
+
+    pthread_create(&tid, NULL, tail_log, &tail);
+
+    start = clock_us(CLOCK_MONOTONIC);
+
+    while ((elapsed = clock_us(CLOCK_MONOTONIC) - start) < duration * 1000000ULL) {
+	/* stay on the requested rate, sleep when ahead of it */
+
+	if (nb_sent * 1000000 > elapsed * rate) {
+	    usleep(100);
+	    continue;
+	}
+
+	s = &sessions[nb_sent % nb_sessions];
+	now = clock_us(CLOCK_REALTIME);
+
+	rd.sid = s->open.sid;
+	rd.delta_us = now;
+	rd.data = payload;
+	rd.seq = s->nb_sent + 1;
+
+	/* a shell mostly echoes keystrokes, with an output burst now and then */
+
+	if (s->nb_sent % 16 == 15) {
+	    rd.dir = OUTPUT_DIR;
+	    rd.len = 256 + rand() % (BUF_SZ - 256);
+	} else {
+	    rd.dir = s->nb_sent & 1 ? OUTPUT_DIR : INPUT_DIR;
+	    rd.len = 1;
+	}
+
+	n = frame_start(frame, 0);
+	if (s->nb_sent % SESSION_OPEN_EVERY == 0)
+	    n += record_put_open(&frame[n], &s->open);
+	n += record_put_data(&frame[n], &rd);
+
+	len = packet_seal(frame, n, pkt);
+	if (sendto(fd, pkt, len, 0, (struct sockaddr *) &addr, sizeof(addr)) < 0
+		&& errno != ENOBUFS && errno != EAGAIN) {
+	    perror("sendto");
+	    exit(1);
+	}
+
+	s->nb_sent++;
+	nb_sent++;
+	bytes_sent += len;
+    }
+
+    tail.done = 1;
+    pthread_join(tid, NULL);
+
+    qsort(tail.samples, tail.nb_samples, sizeof(uint32_t), cmp_u32);
+
+    printf("sent %llu packets from %u sessions in %.3f s\n",
+	    (unsigned long long) nb_sent, nb_sessions, elapsed / 1e6);
+    printf("  %.0f packets/s  %.2f MB/s\n",
+	    1e6 * nb_sent / elapsed, (double) bytes_sent / elapsed);
+    printf("  seen %llu, drop rate %.4f%%\n",
+	    (unsigned long long) tail.nb_seen,
+	    nb_sent ? 100.0 * (1.0 - (double) tail.nb_seen / nb_sent) : 0.0);
+
+    if (tail.nb_samples) {
+	printf("  latency p50 %u us  p99 %u us  max %u us\n",
+		tail.samples[tail.nb_samples / 2],
+		tail.samples[tail.nb_samples * 99 / 100],
+		tail.samples[tail.nb_samples - 1]);
+    }
+
+    close(fd);
+    close(tail.fd_log);
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "config.h"
+#include "rc4.h"
+#include "sha1.h"
+#include "packet.h"
+
+/*
+ * Micro benchmarks for the per-record hot path: RC4, SHA-1, v2 record
+ * framing and the whole seal/open of a packet, at the payload sizes the
+ * client actually sends.
+ */
+
+#define BENCH_MIN_US 500000
+
+typedef void (*bench_fn)(uint8_t *buf, uint32_t len);
+
+static volatile uint8_t sink;
+
+static void bench_rc4(uint8_t *buf, uint32_t len) {
+    struct rc4_state rc4;
+    static uint8_t key[SHA1_SZ];
+
+    rc4_setup(&rc4, key, SHA1_SZ);
+    rc4_crypt(&rc4, buf, len);
+    sink = buf[0];
+}
+
+/* One call keys and runs RC4_LANES streams of len bytes */
+static void bench_rc4x4(uint8_t *buf, uint32_t len) {
+    static uint8_t bufs[RC4_LANES][BUF_SZ];
+    static uint8_t key[RC4_LANES][SHA1_SZ];
+    struct rc4_state rc4[RC4_LANES];
+    struct rc4_state *states[RC4_LANES];
+    const uint8_t *keys[RC4_LANES];
+    uint8_t *data[RC4_LANES];
+    int lens[RC4_LANES];
+    int l = 0;
+
+    (void) buf;
+
+    for (l = 0; l < RC4_LANES; l++) {
+	states[l] = &rc4[l];
+	keys[l] = key[l];
+	data[l] = bufs[l];
+	lens[l] = len;
+    }
+
+    rc4_setup_multi(states, keys, SHA1_SZ, RC4_LANES);
+    rc4_crypt_multi(states, data, lens, RC4_LANES);
+    sink = bufs[0][0];
+}
+
+static void bench_sha1(uint8_t *buf, uint32_t len) {
+    uint8_t sum[SHA1_SZ];
+
+    sha1_digest(buf, len, sum);
+    sink = sum[0];
+}
+
+/* Key derivation of one packet, len is ignored */
+static void bench_key(uint8_t *buf, uint32_t len) {
+    const uint8_t *iv[1] = { buf };
+    uint8_t key[1][SHA1_SZ];
+
+    (void) len;
+
+    packet_keys(iv, key, 1);
+    sink = key[0][0];
+}
+
+static void bench_frame(uint8_t *buf, uint32_t len) {
+    static uint8_t frame[FRAME_MAX_SZ];
+    static Record_Open_t ro = { 4242, 1000, 4242, 1500000000000000ULL };
+    Record_Data_t rd = { 4242, 1234567, INPUT_DIR, len, buf, 1 };
+    Frame_Iter_t it;
+    Record_Open_t dro;
+    Record_Data_t drd;
+    int n = 0, kind = 0;
+
+    n = frame_start(frame, 0);
+    n += record_put_open(&frame[n], &ro);
+    n += record_put_data(&frame[n], &rd);
+
+    frame_iter_init(&it, &frame[FRAME_HDR_SZ], n - FRAME_HDR_SZ,
+	    FRAME_FLAGS(frame));
+    while (frame_next(&it, &kind, &dro, &drd) > 0)
+	sink = kind;
+}
+
+static void bench_seal(uint8_t *buf, uint32_t len) {
+    static uint8_t pkt[MAX_TRANSFER_PKT_SZ];
+
+    sink = packet_seal(buf, len, pkt);
+}
+
+static void bench_open(uint8_t *buf, uint32_t len) {
+    static uint8_t pkt[MAX_TRANSFER_PKT_SZ];
+    static uint8_t copy[MAX_TRANSFER_PKT_SZ];
+    static uint32_t sealed_len = 0;
+    static uint8_t *sealed_for = NULL;
+    static int pkt_len = 0;
+
+    /* seal once per size, time only the verify + decrypt */
+
+    if (sealed_for != buf || sealed_len != len) {
+	pkt_len = packet_seal(buf, len, pkt);
+	sealed_for = buf;
+	sealed_len = len;
+    }
+
+    memcpy(copy, pkt, pkt_len);
+    sink = packet_open(copy, pkt_len);
+}
+
+/* n: operations done by one call of fn, the figures are per operation */
+static void run(const char *name, bench_fn fn, uint8_t *buf, uint32_t len,
+	uint32_t n) {
+    uint64_t start = 0, elapsed = 0, iters = 0, batch = 1;
+
+    fn(buf, len);
+
+    start = clock_us(CLOCK_MONOTONIC);
+
+    do {
+	for (uint64_t i = 0; i < batch; i++)
+	    fn(buf, len);
+	iters += batch * n;
+	batch *= 2;
+	elapsed = clock_us(CLOCK_MONOTONIC) - start;
+    } while (elapsed < BENCH_MIN_US);
+
+    printf("%-8s %6u B  %10.1f ns/op  %12.0f ops/s  %9.2f MB/s\n", name, len,
+	    1000.0 * elapsed / iters, 1e6 * iters / elapsed,
+	    (double) len * iters / elapsed);
+}
+
+int main(void) {
+    static const uint32_t sizes[] = { 1, 16, 64, 512, BUF_SZ };
+    static uint8_t buf[BUF_SZ];
+    uint32_t i = 0;
+
+    for (i = 0; i < SZARR(buf); i++)
+	buf[i] = rand();
+
+    for (i = 0; i < SZARR(sizes); i++)
+	run("rc4", bench_rc4, buf, sizes[i], 1);
+    for (i = 0; i < SZARR(sizes); i++)
+	run("rc4x4", bench_rc4x4, buf, sizes[i], RC4_LANES);
+    for (i = 0; i < SZARR(sizes); i++)
+	run("sha1", bench_sha1, buf, sizes[i], 1);
+    run("key", bench_key, buf, RC4_SZ, 1);
+    for (i = 0; i < SZARR(sizes); i++)
+	run("frame", bench_frame, buf, sizes[i], 1);
+    for (i = 0; i < SZARR(sizes); i++)
+	run("seal", bench_seal, buf, sizes[i], 1);
+    for (i = 0; i < SZARR(sizes); i++)
+	run("open", bench_open, buf, sizes[i], 1);
+
+    return 0;
+}
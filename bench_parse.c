@@ -0,0 +1,163 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+
+#include "config.h"
+#include "packet.h"
+#include "codec.h"
+#include "logread.h"
+
+/*
+ * Parser throughput over a generated log: keystroke frames and output
+ * bursts from many sessions, stored the way the server writes them, then
+ * decrypted and decoded through the parser's read path.
+ */
+
+#define BENCH_SESSIONS 256
+
+typedef struct {
+    uint64_t records;
+    uint64_t bytes;
+} Bench_Count_t;
+
+static void on_open(void *ctx, uint32_t ip, const Record_Open_t *ro) {
+    (void) ctx;
+    (void) ip;
+    (void) ro;
+}
+
+static void on_data(void *ctx, uint32_t ip, const Record_Data_t *rd) {
+    Bench_Count_t *cnt = ctx;
+
+    (void) ip;
+
+    cnt->records++;
+    cnt->bytes += rd->len;
+}
+
+static int generate(const char *path, uint64_t size) {
+    static uint8_t logbuf[MAX_LOG_PKT_SZ];
+    static uint8_t frame[FRAME_MAX_SZ];
+    static uint8_t payload[BUF_SZ];
+    Record_Open_t ro;
+    Record_Data_t rd;
+    FILE *fp = NULL;
+    uint64_t written = 0, nb_pkt = 0;
+    uint32_t ip = htonl(0x0A000001);
+    int n = 0, len = 0;
+
+    if ((fp = fopen(path, "w")) == NULL) {
+	perror("fopen");
+	return -1;
+    }
+
+    for (n = 0; n < (int) SZARR(payload); n++)
+	payload[n] = ' ' + rand() % 95;
+
+    while (written < size) {
+	ro.sid = ro.pid = 1000 + nb_pkt % BENCH_SESSIONS;
+	ro.uid = 1000 + ro.sid % 16;
+	ro.base_us = 1500000000000000ULL;
+
+	rd.sid = ro.sid;
+	rd.delta_us = nb_pkt * 1000;
+	rd.seq = nb_pkt / BENCH_SESSIONS + 1;
+
+	/* mostly keystrokes, now and then a screenful of output */
+
+	if (nb_pkt % 16 == 15) {
+	    rd.dir = OUTPUT_DIR;
+	    rd.len = 256 + rand() % (BUF_SZ - 256);
+	} else {
+	    rd.dir = INPUT_DIR;
+	    rd.len = 1;
+	}
+	rd.data = payload;
+
+	n = frame_start(frame, 0);
+	if (nb_pkt / BENCH_SESSIONS % SESSION_OPEN_EVERY == 0)
+	    n += record_put_open(&frame[n], &ro);
+	n += record_put_data(&frame[n], &rd);
+
+	len = packet_seal(frame, n, STORED_PKT(logbuf));
+	stored_put_hdr(logbuf, ip, len);
+
+	fwrite(logbuf, STORED_HDR_SZ + len, 1, fp);
+	written += STORED_HDR_SZ + len;
+	nb_pkt++;
+    }
+
+    fclose(fp);
+
+    printf("generated %llu packets, %llu bytes\n",
+	    (unsigned long long) nb_pkt, (unsigned long long) written);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static Log_Packet_t pkts[LOG_BATCH];
+    Bench_Count_t cnt = { 0, 0 };
+    Log_Handler_t handler = { on_open, on_data, &cnt, NULL };
+    struct stat st;
+    uint64_t size = 0, nb_pkt = 0, nb_bad = 0, start = 0, elapsed = 0;
+    int fd = -1, i = 0, n = 0;
+
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s <logfile> [size in MB to generate]\n\n", argv[0]);
+	exit(1);
+    }
+
+    if (argc > 2) {
+	size = strtoull(argv[2], NULL, 0) * 1048576;
+	if (generate(argv[1], size))
+	    exit(1);
+    }
+
+    if ((fd = open(argv[1], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+	perror("open");
+	exit(1);
+    }
+
+    start = clock_us(CLOCK_MONOTONIC);
+
+    while ((n = log_read_packets(fd, pkts, LOG_BATCH)) > 0) {
+	for (i = 0; i < n; i++) {
+	    nb_pkt++;
+
+	    if (pkts[i].len == LOG_BAD_PKT) {
+		nb_bad++;
+		continue;
+	    }
+
+	    log_decode(pkts[i].plain, pkts[i].len, pkts[i].ip, &handler);
+	}
+    }
+
+    if (n == LOG_ERR)
+	exit(2);
+
+    elapsed = clock_us(CLOCK_MONOTONIC) - start;
+    if (elapsed == 0)
+	elapsed = 1;
+
+    printf("parsed %llu packets (%llu bad), %llu records in %.3f s\n",
+	    (unsigned long long) nb_pkt, (unsigned long long) nb_bad,
+	    (unsigned long long) cnt.records, elapsed / 1e6);
+    printf("  %.0f packets/s  %.0f records/s  %.2f MB/s log  %.2f MB/s payload\n",
+	    1e6 * nb_pkt / elapsed, 1e6 * cnt.records / elapsed,
+	    (double) st.st_size / elapsed, (double) cnt.bytes / elapsed);
+
+    close(fd);
+
+    return 0;
+}
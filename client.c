@@ -19,17 +19,21 @@
 #include <pty.h>
 #include <utmp.h>
 #include <stdbool.h>
+#include <sys/un.h>
+#include <poll.h>
 
 #include "config.h"
+#include "settings.h"
 #include "utils.h"
 #include "rc4.h"
 #include "sha1.h"
+#include "packet.h"
+#include "codec.h"
+#include "frag.h"
+#include "ring.h"
 
-#if CLIENT_DBG
-#define client_dbg(format, arg...) DBG_PRINT_FUNC(format, "CLIENT_DBG", ##arg)
-#else
-#define  client_dbg(x...)
-#endif
+#define client_dbg(format, arg...) \
+    SETTINGS_DBG(SETTINGS_DBG_CLIENT, format, "CLIENT_DBG", ##arg)
 
 #define client_err(format, arg...) DBG_PRINT_FUNC(format, "CLIENT_ERR", ##arg)
 
@@ -78,7 +82,7 @@ static void reset_terminal(struct termios *tm) {
     tcsetattr(0, TCSANOW, tm);
 }
 
-static int create_server_connection(Connection_Data_t *cd) {
+static int create_udp_connection(Connection_Data_t *cd) {
 
     assert(cd != NULL);
 
@@ -88,13 +92,79 @@ static int create_server_connection(Connection_Data_t *cd) {
     }
 
     cd->server_addr.sin_family = AF_INET;
-    cd->server_addr.sin_port = htons(SHELL_LOG_SERVER_PORT);
-    inet_aton(CONNECT_IP, &cd->server_addr.sin_addr);
-    cd->nb_pkt_sent = 0;
+    cd->server_addr.sin_port = htons(settings.server_port);
+    cd->server_addr.sin_addr.s_addr = settings.server_ip;
+
+    return 0;
+}
+
+static int create_relay_connection(Connection_Data_t *cd) {
+    struct sockaddr_un addr;
+
+    assert(cd != NULL);
+
+    if ((cd->relay_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+	return -1;
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, RELAY_SOCKET_PATH, sizeof (addr.sun_path) - 1);
+
+    if (connect(cd->relay_fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+	close(cd->relay_fd);
+	cd->relay_fd = -1;
+	return -1;
+    }
+
+    cd->transport = TRANSPORT_RELAY;
 
     return 0;
 }
 
+/*
+ * The binary is setgid RING_GROUP only to attach the ring, see ring.h.
+ * The mapping outlives the group; neither this process nor the shell
+ * keeps it.
+ */
+static void drop_ring_group(void) {
+    gid_t gid = getgid();
+
+    if (getegid() != gid && setregid(gid, gid) < 0) {
+	client_err("Drop group failed: %d\r\n", errno);
+	exit(1);
+    }
+}
+
+static int create_server_connection(Connection_Data_t *cd) {
+
+    assert(cd != NULL);
+
+    cd->nb_pkt_sent = 0;
+
+    /*
+     * prefer a collector on this host, then the local relay; both do the
+     * crypto and batching for us
+     */
+
+    cd->ring = ring_attach();
+    drop_ring_group();
+
+    if (cd->ring != NULL) {
+	client_dbg("Using shared memory ring %s\r\n", RING_SHM_NAME);
+	cd->transport = TRANSPORT_RING;
+	return 0;
+    }
+
+    if (create_relay_connection(cd) == 0) {
+	client_dbg("Using local relay %s\r\n", RELAY_SOCKET_PATH);
+	return 0;
+    }
+
+    cd->transport = TRANSPORT_UDP;
+
+    return create_udp_connection(cd);
+}
+
 static int create_real_shell_run_cmd(char *argv[],
 	char *cmd_str, int cmd_str_max_length) {
 
@@ -148,121 +218,349 @@ not_enough_buffer_length:
     return -1;
 }
 
-static int encrypt_and_send(Connection_Data_t *cd, Session_Data_t * sd) {
-    int i = 0;
-    sha1_context sha1;
-    struct rc4_state rc4;
-    unsigned char pktkey[32];
+static int encrypt_and_send(Connection_Data_t *cd, const uint8_t *frame,
+	int len) {
     unsigned char msg[MAX_TRANSFER_PKT_SZ];
-    int rc4_offset = 0;
-    int msg_index = 0;
+    int msg_len = 0;
 
     assert(cd != NULL);
-    assert(sd != NULL);
+    assert(frame != NULL);
 
-    srand(time(NULL));
+    /* encrypt and send the buffer */
 
-    /* setup a new RC4 IV */
+    msg_len = packet_seal(frame, len, msg);
 
-    for (rc4_offset = 0; rc4_offset < RC4_SZ; rc4_offset++)
-	msg[rc4_offset] = rand() & 0xFF;
+    sendto(cd->server_fd, msg, msg_len, 0,
+	    (struct sockaddr *) &cd->server_addr,
+	    sizeof ( cd->server_addr));
 
-    /* append the packet header */
+#ifdef DEBUG
+    Frame_Iter_t it;
+    Record_Open_t ro;
+    Record_Data_t rd;
+    int kind = 0;
 
-    memcpy(&msg[RC4_SZ + msg_index], sd, SESSION_SZ);
-    msg_index += SESSION_SZ;
+    if (packet_open(msg, msg_len) < 0) {
+	client_err("SHA-1 checksum verification failed\r\n");
+    } else {
+	frame_iter_init(&it, &PKT_DATA(msg)[FRAME_HDR_SZ], len - FRAME_HDR_SZ,
+		FRAME_FLAGS(frame));
+
+	printf("Decoded message: \r\n");
+	while (frame_next(&it, &kind, &ro, &rd) > 0) {
+	    if (kind == REC_OPEN) {
+		printf("      sid: %u\r\n", ro.sid);
+		printf("      uid: %u\r\n", ro.uid);
+		printf("      pid: %u\r\n", ro.pid);
+		printf("     base: %llu\r\n", (unsigned long long) ro.base_us);
+		continue;
+	    }
+	    printf("      sid: %u\r\n", rd.sid);
+	    printf("    delta: %llu\r\n", (unsigned long long) rd.delta_us);
+	    printf("      dir: %d\r\n", (int) rd.dir);
+	    printf("      len: %d\r\n", (int) rd.len);
+	    printf("     data: \r\n");
+	    __print_output(rd.data, rd.len);
+	}
+	printf("\r\n\r\n");
+    }
+#endif
 
-    memcpy(&msg[RC4_SZ + msg_index], &sd->buffer[i], sd->len);
-    msg_index += sd->len;
-    msg[RC4_SZ + msg_index++] = '\0';
+    return 0;
+}
 
-    /* setup the per-packet RC4 key */
+/*
+ * While the collector is asking us to slow down, UDP frames are merged
+ * into cd->pending and go out when it is full or coalesce_us after its
+ * first record, trading a little latency for far fewer datagrams.
+ */
+static int flush_pending(Connection_Data_t *cd) {
+    int ret = 0;
 
-    memcpy(pktkey, secret, RC4_SZ);
-    memcpy(pktkey + RC4_SZ, msg, RC4_SZ);
+    if (cd->pending_len > FRAME_HDR_SZ)
+	ret = encrypt_and_send(cd, cd->pending, cd->pending_len);
 
-    sha1_starts(&sha1);
-    sha1_update(&sha1, pktkey, SZARR(pktkey));
-    sha1_finish(&sha1, pktkey);
+    cd->pending_len = 0;
 
-    /* encrypt and send the buffer */
+    return ret;
+}
 
-    rc4_setup(&rc4, pktkey, SHA1_SZ);
-    rc4_crypt(&rc4, msg + RC4_SZ, msg_index + SHA1_SZ);
+static int queue_frame(Connection_Data_t *cd, uint8_t *frame, int len,
+	uint64_t now_us) {
 
-    sha1_starts(&sha1);
-    sha1_update(&sha1, &msg[RC4_SZ], msg_index);
-    sha1_finish(&sha1, &msg[RC4_SZ + msg_index]);
+    if (cd->pending_len && cd->pending_len + len - FRAME_HDR_SZ > BATCH_SZ)
+	flush_pending(cd);
 
-    sendto(cd->server_fd, msg, RC4_SZ + msg_index + SHA1_SZ, 0,
-	    (struct sockaddr *) &cd->server_addr,
-	    sizeof ( cd->server_addr));
+    if (len > BATCH_SZ)
+	return encrypt_and_send(cd, frame, len);
 
-#ifdef DEBUG
-    unsigned char sha1sum[SHA1_SZ];
-    Session_Data_t tsd;
-    int test_len = RC4_SZ + msg_index + SHA1_SZ;
-
-    printf("Sended message: \r\n");
-    printf("  seconds: %d\r\n", (int) sd->time);
-    printf("      uid: %d\r\n", (int) sd->uid);
-    printf("      pid: %d\r\n", (int) sd->pid);
-    printf("      dir: %d\r\n", (int) sd->dir);
-    printf("      len: %d\r\n", (int) sd->len);
-    printf("     data: \r\n");
-    __print_output(&sd->buffer[i], sd->len);
-    printf("\r\n\r\n");
-
-    sha1_starts(&sha1);
-    sha1_update(&sha1, msg + RC4_SZ, test_len - RC4_SZ - SHA1_SZ);
-    sha1_finish(&sha1, sha1sum);
-
-    if (memcmp(sha1sum, msg + test_len - SHA1_SZ, SHA1_SZ) != 0) {
-	shellog_err("SHA-1 checksum verification failed\n");
+    if (cd->pending_len == 0) {
+	memcpy(cd->pending, frame, len);
+	cd->pending_len = len;
+	cd->flush_at_us = now_us + cd->coalesce_us;
+	return 0;
     }
 
-    memcpy(pktkey, secret, RC4_SZ);
-    memcpy(pktkey + RC4_SZ, msg, RC4_SZ);
+    /* frames are just records after a header, append ours */
 
-    sha1_starts(&sha1);
-    sha1_update(&sha1, pktkey, 32);
-    sha1_finish(&sha1, pktkey);
+    memcpy(&cd->pending[cd->pending_len], &frame[FRAME_HDR_SZ],
+	    len - FRAME_HDR_SZ);
+    cd->pending_len += len - FRAME_HDR_SZ;
+
+    return 0;
+}
 
-    rc4_setup(&rc4, pktkey, SHA1_SZ);
-    rc4_crypt(&rc4, msg + RC4_SZ, test_len - RC4_SZ - SHA1_SZ);
+/* Every quiet SLOWDOWN_HOLD_MS halves the coalescing window again */
+static void coalesce_decay(Connection_Data_t *cd, uint64_t now_us) {
 
-    memcpy(&tsd, &msg[rc4_offset], sizeof (Session_Data_t));
+    if (cd->coalesce_us == 0 || now_us < cd->slow_until_us)
+	return;
 
-    printf("Decoded message: \r\n");
-    printf("  seconds: %d\r\n", (int) tsd.time);
-    printf("      uid: %d\r\n", (int) tsd.uid);
-    printf("      pid: %d\r\n", (int) tsd.pid);
-    printf("      dir: %d\r\n", (int) tsd.dir);
-    printf("      len: %d\r\n", (int) tsd.len);
-    printf("     data: \r\n");
-    __print_output(tsd.buffer, tsd.len);
-    printf("\r\n\r\n");
+    cd->coalesce_us /= 2;
+    if (cd->coalesce_us < settings.coalesce_min_ms * 1000) {
+	cd->coalesce_us = 0;
+	flush_pending(cd);
+    }
 
-#endif
+    cd->slow_until_us = now_us + SLOWDOWN_HOLD_MS * 1000ULL;
+}
+
+/*
+ * A slowdown from the collector, see FRAME_F_SLOWDOWN. It has to come
+ * from the server address, be sealed with our secret and be recent;
+ * each one doubles the coalescing window up to coalesce_max_ms.
+ */
+static void receive_slowdown(Connection_Data_t *cd, uint64_t now_us) {
+    uint8_t pkt[MAX_TRANSFER_PKT_SZ];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof (from);
+    uint64_t sent_ms = 0, wall_ms = 0;
+    uint32_t hold_ms = 0;
+    int len = 0;
+
+    if ((len = recvfrom(cd->server_fd, pkt, sizeof (pkt), MSG_DONTWAIT,
+	    (struct sockaddr *) &from, &fromlen)) < MIN_PKT_SZ)
+	return;
+
+    if (from.sin_addr.s_addr != cd->server_addr.sin_addr.s_addr ||
+	    from.sin_port != cd->server_addr.sin_port)
+	return;
+
+    if ((len = packet_open(pkt, len)) < 0 ||
+	    frame_get_slowdown(PKT_DATA(pkt), len, &hold_ms, &sent_ms))
+	return;
+
+    wall_ms = clock_us(CLOCK_REALTIME) / 1000;
+    if (sent_ms + SLOWDOWN_MAX_AGE_MS < wall_ms ||
+	    sent_ms > wall_ms + SLOWDOWN_MAX_AGE_MS)
+	return;
+
+    cd->coalesce_us = cd->coalesce_us ? cd->coalesce_us * 2 :
+	    settings.coalesce_min_ms * 1000;
+    if (cd->coalesce_us > settings.coalesce_max_ms * 1000)
+	cd->coalesce_us = settings.coalesce_max_ms * 1000;
+
+    cd->slow_until_us = now_us + hold_ms * 1000ULL;
+}
+
+/*
+ * Encode one read into a v2 frame. The open record goes in the first
+ * frame, every open_every frames after that, whenever we
+ * switch transport and in every bulk record, so the collector never
+ * waits long for it. The relay gets it in every frame: it costs nothing
+ * locally, and the relay drops records of a session it forgot.
+ */
+static int build_frame(Connection_Data_t *cd, int dir, const uint8_t *data,
+	uint32_t n, uint64_t now_us, int with_open, uint8_t *frame) {
+    Record_Data_t rd;
+    int len = 0;
+
+    len = frame_start(frame, 0);
+
+    if (with_open)
+	len += record_put_open(&frame[len], &cd->session);
+
+    rd.sid = cd->session.sid;
+    rd.seq = cd->seq;
+    rd.delta_us = now_us - cd->mono_base_us;
+    rd.dir = dir;
+    rd.len = n;
+    rd.data = data;
+
+    len += record_put_data(&frame[len], &rd);
+
+    return len;
+}
+
+static void emit_ring(const uint8_t *frag, uint32_t len, void *ctx) {
+    Connection_Data_t *cd = ctx;
+
+    if (cd->frag_err == 0)
+	cd->frag_err = ring_push(cd->ring, frag, len);
+}
+
+static void emit_udp(const uint8_t *frag, uint32_t len, void *ctx) {
+    encrypt_and_send(ctx, frag, len);
+}
+
+/*
+ * A frame over FRAME_MAX_SZ, see frag.h. If the ring cannot take all of
+ * it, it goes over UDP under a new msg_id; the collector gives up on
+ * the fragments it did get.
+ */
+static int send_fragments(Connection_Data_t *cd, uint8_t *frame, int len) {
+
+    if (cd->transport == TRANSPORT_RING) {
+	cd->frag_err = 0;
+	if (frag_split(frame, len, ++cd->frag_id, emit_ring, cd) < 0)
+	    return -1;
+
+	if (cd->frag_err == 0)
+	    return 0;
+
+	if (cd->server_fd < 0 && create_udp_connection(cd))
+	    return -1;
+    }
+
+    flush_pending(cd);
+
+    return frag_split(frame, len, ++cd->frag_id, emit_udp, cd) < 0 ? -1 : 0;
+}
+
+/*
+ * now_us is CLOCK_MONOTONIC, see clock_us(). Up to BULK_SZ of data;
+ * the relay checks every record on its own, it gets them BUF_SZ at a
+ * time.
+ */
+static int send_record(Connection_Data_t *cd, int dir, const uint8_t *data,
+	uint32_t n, uint64_t now_us) {
+    static uint8_t frame[BULK_FRAME_MAX_SZ];
+    int with_open = (cd->transport == TRANSPORT_RELAY ||
+	    cd->nb_pkt_sent % settings.open_every == 0);
+    int len = 0, ret = 0;
+    uint32_t off = 0;
+
+    assert(cd != NULL);
+    assert(data != NULL);
+
+    if (cd->transport == TRANSPORT_RELAY && n > BUF_SZ) {
+	for (off = 0; off < n; off += BUF_SZ)
+	    ret |= send_record(cd, dir, &data[off],
+		    (n - off > BUF_SZ) ? BUF_SZ : n - off, now_us);
+	return ret;
+    }
+
+    /* a record sent again over another transport keeps its number */
+
+    cd->seq++;
+
+    len = build_frame(cd, dir, data, n, now_us, with_open || n > BUF_SZ,
+	    frame);
+
+    if (len > FRAME_MAX_SZ) {
+	cd->nb_pkt_sent++;
+	return send_fragments(cd, frame, len);
+    }
+
+    if (cd->transport == TRANSPORT_RING) {
+	if (ring_push(cd->ring, frame, len) == 0) {
+	    cd->nb_pkt_sent++;
+	    return 0;
+	}
+
+	/* ring full or collector gone, send this one ourselves */
+
+	if (cd->server_fd < 0 && create_udp_connection(cd))
+	    return -1;
+
+	if (!with_open)
+	    len = build_frame(cd, dir, data, n, now_us, 1, frame);
+    }
+
+    if (cd->transport == TRANSPORT_RELAY) {
+
+	/* hand the plain frame over, the relay seals it upstream */
+
+	if (send(cd->relay_fd, frame, len, MSG_DONTWAIT) >= 0) {
+	    cd->nb_pkt_sent++;
+	    return 0;
+	}
+
+	/* a busy relay only costs us this record's crypto, a dead one for good */
+
+	if (errno != EAGAIN) {
+	    client_err("Relay send failed: %d, falling back to UDP\r\n", errno);
+	    close(cd->relay_fd);
+	    cd->relay_fd = -1;
+	    cd->transport = TRANSPORT_UDP;
+	}
+
+	if (cd->server_fd < 0 && create_udp_connection(cd))
+	    return -1;
+
+	if (!with_open)
+	    len = build_frame(cd, dir, data, n, now_us, 1, frame);
+    }
 
     cd->nb_pkt_sent++;
-    return 0;
+
+    coalesce_decay(cd, now_us);
+
+    if (cd->coalesce_us)
+	return queue_frame(cd, frame, len, now_us);
+
+    return encrypt_and_send(cd, frame, len);
+}
+
+/*
+ * Copy what the shell wrote to stdout as it comes, gathering up to
+ * bulk_size of it into buf while more is ready right away, so a burst
+ * of output is logged as one record. Returns what read() would.
+ */
+static int copy_output(int pty, uint8_t *buf) {
+    struct pollfd pfd = { pty, POLLIN, 0 };
+    int len = 0, n = 0, ret = 0;
+
+    do {
+	if ((n = read(pty, &buf[len], settings.read_size)) <= 0)
+	    return len ? len : n;
+
+	if ((ret = write(1, &buf[len], n)) != n) {
+	    if (ret >= 0)
+		errno = EIO;
+	    return -1;
+	}
+
+	len += n;
+    } while (settings.log_output && len + settings.read_size <=
+	    settings.bulk_size && poll(&pfd, 1, 0) > 0);
+
+    return len;
 }
 
 int main(int argc, char *argv[]) {
 
+    static uint8_t bulk[BULK_SZ];
     char real_shell[256];
     int pty = 0, tty = 0;
     Session_Data_t sd;
     Connection_Data_t cd;
     fd_set rd;
+    struct timeval tv;
     struct termios tty_tm; /* stored initial terminal settings */
     struct termios pty_tm; /* current PTY terminal settings */
-    struct timeval tv;
+    uint64_t now_us = 0;
     char* login_argv[] = {"-l"};
     char** shell_argv = NULL;
 
-    cd.server_fd = pty = tty = -1;
+    cd.server_fd = cd.relay_fd = pty = tty = -1;
+    cd.ring = NULL;
+    cd.coalesce_us = cd.pending_len = cd.seq = 0;
+    cd.frag_err = 0;
+
+    /* the environment is the user's, only the compiled settings count */
+
+    settings_load(0);
 
     /* reconstruct the original shell location */
 
@@ -325,7 +623,13 @@ int main(int argc, char *argv[]) {
 		goto exec_real_shell;
 	    }
 
-	    close(cd.server_fd);
+	    if (cd.server_fd >= 0)
+		close(cd.server_fd);
+
+	    if (cd.relay_fd >= 0)
+		close(cd.relay_fd);
+
+	    ring_detach(cd.ring);
 
 	    usleep(50000);
 	    if (is_login_shell) {
@@ -344,7 +648,17 @@ int main(int argc, char *argv[]) {
 	    /* Parent : shell logger */
 
 
-	    sd.uid = getuid();
+	    /*
+	     * wall clock once for the session base, then monotonic deltas:
+	     * sub-second, never going backwards and no syscall per read
+	     */
+
+	    cd.session.sid = sd.pid;
+	    cd.session.uid = getuid();
+	    cd.session.pid = sd.pid;
+	    cd.session.base_us = clock_us(CLOCK_REALTIME);
+	    cd.mono_base_us = clock_us(CLOCK_MONOTONIC);
+	    cd.frag_id = cd.session.sid << 16;
 
 	    while (1) {
 
@@ -354,20 +668,43 @@ int main(int argc, char *argv[]) {
 
 		int n = (pty > 0) ? pty : 0;
 
-		if ((n = select(n + 1, &rd, NULL, NULL, NULL)) < 0) {
+		/* slowdowns come back on the socket we send from */
+
+		if (cd.server_fd >= 0) {
+		    FD_SET(cd.server_fd, &rd);
+		    if (cd.server_fd > n)
+			n = cd.server_fd;
+		}
+
+		/* wake up in time to send a coalesced frame */
+
+		if (cd.pending_len) {
+		    now_us = clock_us(CLOCK_MONOTONIC);
+		    now_us = cd.flush_at_us > now_us ? cd.flush_at_us - now_us : 0;
+		    tv.tv_sec = now_us / 1000000;
+		    tv.tv_usec = now_us % 1000000;
+		}
+
+		if ((n = select(n + 1, &rd, NULL, NULL,
+			cd.pending_len ? &tv : NULL)) < 0) {
 		    if (n < 0 && (errno == EINTR || errno == EAGAIN))
 			goto check_sigs;
 		    break;
 		}
 
+		if (cd.pending_len && clock_us(CLOCK_MONOTONIC) >= cd.flush_at_us)
+		    flush_pending(&cd);
+
+		if (cd.server_fd >= 0 && FD_ISSET(cd.server_fd, &rd))
+		    receive_slowdown(&cd, clock_us(CLOCK_MONOTONIC));
+
 		if (FD_ISSET(0, &rd)) {
 
-		    gettimeofday(&tv, NULL);
-		    sd.time = tv.tv_sec;
+		    now_us = clock_us(CLOCK_MONOTONIC);
 
 		    /* transfer the data from stdin to pty */
 
-		    if ((n = read(0, sd.buffer, BUF_SZ)) <= 0) {
+		    if ((n = read(0, sd.buffer, settings.read_size)) <= 0) {
 			if (n < 0 && (errno == EINTR || errno == EAGAIN))
 			    goto check_sigs;
 			break;
@@ -403,9 +740,7 @@ int main(int argc, char *argv[]) {
 			memcpy(&prev_pty_tm, &pty_tm, sizeof (struct termios));
 		    }
 
-		    sd.dir = INPUT_DIR;
-		    sd.len = n;
-		    encrypt_and_send(&cd, &sd);
+		    send_record(&cd, INPUT_DIR, sd.buffer, n, now_us);
 
 		    if ((n = write(pty, sd.buffer, n)) != n) {
 			if (n < 0 && (errno == EINTR || errno == EAGAIN))
@@ -417,29 +752,19 @@ int main(int argc, char *argv[]) {
 
 		if (FD_ISSET(pty, &rd)) {
 
-		    gettimeofday(&tv, NULL);
-		    sd.time = tv.tv_sec;
+		    now_us = clock_us(CLOCK_MONOTONIC);
 
 		    /* transfer the data from pty to stdout */
 
-		    if ((n = read(pty, sd.buffer, BUF_SZ)) <= 0) {
+		    if ((n = copy_output(pty, bulk)) <= 0) {
 			if (n < 0 && (errno == EINTR || errno == EAGAIN))
 			    goto check_sigs;
 
 			break;
 		    }
 
-#if LOG_OUTPUT
-		    sd.dir = OUTPUT_DIR;
-		    sd.len = n;
-		    encrypt_and_send(&cd, &sd);
-#endif
-		    if ((n = write(1, sd.buffer, n)) != n) {
-			if (n < 0 && (errno == EINTR || errno == EAGAIN))
-			    goto check_sigs;
-
-			break;
-		    }
+		    if (settings.log_output)
+			send_record(&cd, OUTPUT_DIR, bulk, n, now_us);
 		}
 
 check_sigs:
@@ -451,6 +776,8 @@ check_sigs:
 
 	    }
 
+	    flush_pending(&cd);
+
 	    break;
     }
 
@@ -465,10 +792,16 @@ exec_real_shell:
     if (cd.server_fd >= 0)
 	close(cd.server_fd);
 
+    if (cd.relay_fd >= 0)
+	close(cd.relay_fd);
+
+    ring_detach(cd.ring);
+    drop_ring_group();
 
     client_dbg("exec_before_exit, parent: %zu; me: %zu\n", getppid(), getpid());
     execv(real_shell, argv);
 super_exit:
+    flush_pending(&cd);
     client_dbg("exec_before_exit, parent: %zu; me: %zu\n", getppid(), getpid());
     exit(1);
 }
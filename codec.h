@@ -0,0 +1,103 @@
+#ifndef _CODEC_H
+#define _CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Byte layouts of the packets and records everything exchanges, kept in
+ * one place instead of offsets spelled out at each use. Every offset is
+ * a constant, so the accessors fold into plain loads and stores.
+ *
+ * Stored packet, as the server logs it:
+ *
+ *   [ ip (IP_SZ) ][ len (LENGTH_SZ) ][ transfer packet (len) ]
+ *
+ * A jumbo packet, over MAX_TRANSFER_PKT_SZ, has STORED_LEN_JUMBO for len
+ * and its real length in the next 4 bytes. Readers drop that field, so
+ * in memory a stored packet always has the short header.
+ *
+ * Transfer packet, see packet.h:
+ *
+ *   [ IV (RC4_SZ) ][ RC4(plaintext) ][ SHA-1 of the ciphertext ]
+ *
+ * The plaintext is one of CODEC_VERSIONS record formats, told apart by
+ * log_codec(): a v1 Session_Data_t, a batch of them, a v2 frame or a
+ * fragment of one (see record.h). The readers keep a table of decoders indexed by it, so each
+ * format is decoded by its own straight-line function.
+ *
+ * Include config.h first.
+ */
+
+#define STORED_IP_OFF  0
+#define STORED_LEN_OFF (STORED_IP_OFF + IP_SZ)
+#define STORED_HDR_SZ  (STORED_LEN_OFF + LENGTH_SZ)
+#define STORED_LEN_JUMBO 0xFFFF
+#define STORED_JUMBO_HDR_SZ (STORED_HDR_SZ + sizeof (uint32_t))
+
+#define PKT_IV_OFF     0
+#define PKT_DATA_OFF   (PKT_IV_OFF + RC4_SZ)
+#define PKT_OVERHEAD   (RC4_SZ + SHA1_SZ)
+
+/* Transfer packet of a stored packet */
+#define STORED_PKT(buf) (&(buf)[STORED_HDR_SZ])
+
+/* Ciphertext (or plaintext once opened) and digest of a transfer packet */
+#define PKT_DATA(pkt) (&(pkt)[PKT_DATA_OFF])
+#define PKT_MAC(pkt, len) (&(pkt)[(len) - SHA1_SZ])
+#define PKT_DATA_LEN(len) ((len) - PKT_OVERHEAD)
+
+#define CODEC_V1       0 /* single Session_Data_t            */
+#define CODEC_V1_BATCH 1 /* BATCH_DIR / BATCH_Z_DIR records  */
+#define CODEC_V2       2 /* frame of varint records          */
+#define CODEC_V2_FRAG  3 /* slice of a frame, see frag.h     */
+#define CODEC_VERSIONS 4
+
+_Static_assert(SESSION_SZ == 17, "Session_Data_t header is 17 bytes");
+_Static_assert(sizeof (uint16_t) == LENGTH_SZ, "stored length is 16 bits");
+_Static_assert(MIN_PKT_SZ == PKT_OVERHEAD + FRAME_HDR_SZ,
+        "smallest packet carries an empty frame");
+_Static_assert(MAX_LOG_PKT_SZ == STORED_HDR_SZ + MAX_TRANSFER_PKT_SZ,
+        "stored packet is its header and a transfer packet");
+_Static_assert(MAX_TRANSFER_PKT_SZ < STORED_LEN_JUMBO,
+        "transfer packet length fits the stored length");
+_Static_assert(MAX_STORED_PKT_SZ == STORED_JUMBO_HDR_SZ + MAX_JUMBO_PKT_SZ,
+        "stored jumbo packet is its header and a transfer packet");
+_Static_assert(BULK_FRAME_MAX_SZ <= JUMBO_FRAME_SZ,
+        "a bulk record fits a fragmented frame");
+
+/* Header size of a stored packet of len bytes */
+static inline uint32_t stored_hdr_sz(uint32_t len) {
+    return (len > MAX_TRANSFER_PKT_SZ) ? STORED_JUMBO_HDR_SZ : STORED_HDR_SZ;
+}
+
+/* Returns the header size, the packet goes right after it */
+static inline uint32_t stored_put_hdr(uint8_t *buf, uint32_t ip,
+        uint32_t len) {
+    uint16_t len16 = (len > MAX_TRANSFER_PKT_SZ) ? STORED_LEN_JUMBO : len;
+
+    memcpy(&buf[STORED_IP_OFF], &ip, IP_SZ);
+    memcpy(&buf[STORED_LEN_OFF], &len16, LENGTH_SZ);
+
+    if (len16 != STORED_LEN_JUMBO)
+        return STORED_HDR_SZ;
+
+    memcpy(&buf[STORED_HDR_SZ], &len, sizeof (uint32_t));
+
+    return STORED_JUMBO_HDR_SZ;
+}
+
+/*
+ * Returns the transfer packet length, STORED_LEN_JUMBO when it follows;
+ * the client address goes in *ip.
+ */
+static inline uint16_t stored_get_hdr(const uint8_t *buf, uint32_t *ip) {
+    uint16_t len = 0;
+
+    memcpy(ip, &buf[STORED_IP_OFF], IP_SZ);
+    memcpy(&len, &buf[STORED_LEN_OFF], LENGTH_SZ);
+
+    return len;
+}
+
+#endif /* _CODEC_H */
@@ -0,0 +1,242 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include "column.h"
+
+static int bits_for(uint64_t v) {
+    return v ? 64 - __builtin_clzll(v) : 0;
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+/* LSB first; out must hold (nb * bits + 7) / 8 bytes plus 8 of slack */
+static uint32_t pack(uint8_t *out, const uint64_t *in, uint32_t nb, int bits) {
+    uint64_t acc = 0;
+    uint32_t i = 0, len = 0;
+    int fill = 0, n = 0, take = 0;
+    uint64_t v = 0;
+
+    if (bits == 0)
+	return 0;
+
+    for (i = 0; i < nb; i++) {
+	v = in[i];
+	for (n = bits; n > 0; n -= take) {
+	    take = (n < 64 - fill) ? n : 64 - fill;
+	    acc |= (take == 64 ? v : v & ((1ULL << take) - 1)) << fill;
+	    v = (take == 64) ? 0 : v >> take;
+	    fill += take;
+	    if (fill == 64) {
+		memcpy(&out[len], &acc, 8);
+		len += 8;
+		acc = 0;
+		fill = 0;
+	    }
+	}
+    }
+
+    if (fill) {
+	memcpy(&out[len], &acc, 8);
+	len += (fill + 7) / 8;
+    }
+
+    return len;
+}
+
+static void unpack(const uint8_t *in, uint64_t *out, uint32_t nb, int bits) {
+    uint64_t mask = (bits == 64) ? ~0ULL : (1ULL << bits) - 1;
+    uint64_t bit = 0, word = 0, v = 0;
+    uint32_t i = 0, shift = 0;
+
+    if (bits == 0) {
+	memset(out, 0, nb * sizeof (uint64_t));
+	return;
+    }
+
+    for (i = 0; i < nb; i++, bit += bits) {
+	shift = bit % 8;
+	memcpy(&word, &in[bit / 8], 8);
+	v = word >> shift;
+	if (shift + bits > 64)
+	    v |= (uint64_t) in[bit / 8 + 8] << (64 - shift);
+	out[i] = v & mask;
+    }
+}
+
+static int col_flush(Col_Writer_t *w) {
+    uint8_t out[COL_BLOCK * 8 + 16];
+    uint64_t tmp[COL_BLOCK];
+    uint64_t min = ~0ULL, max = 0, dmax = 0;
+    Col_Block_t blk;
+    uint32_t i = 0, len = 0;
+    int for_bits = 0, delta_bits = 0;
+
+    if (w->nb == 0)
+	return 0;
+
+    for (i = 0; i < w->nb; i++) {
+	if (w->vals[i] < min)
+	    min = w->vals[i];
+	if (w->vals[i] > max)
+	    max = w->vals[i];
+	if (i && zigzag(w->vals[i] - w->vals[i - 1]) > dmax)
+	    dmax = zigzag(w->vals[i] - w->vals[i - 1]);
+    }
+
+    for_bits = bits_for(max - min);
+    delta_bits = bits_for(dmax);
+
+    blk.nb = w->nb;
+
+    if (delta_bits < for_bits) {
+	blk.enc = COL_DELTA;
+	blk.bits = delta_bits;
+	blk.base = w->vals[0];
+	for (i = 1; i < w->nb; i++)
+	    tmp[i - 1] = zigzag(w->vals[i] - w->vals[i - 1]);
+	len = pack(out, tmp, w->nb - 1, delta_bits);
+    } else {
+	blk.enc = COL_FOR;
+	blk.bits = for_bits;
+	blk.base = min;
+	for (i = 0; i < w->nb; i++)
+	    tmp[i] = w->vals[i] - min;
+	len = pack(out, tmp, w->nb, for_bits);
+    }
+
+    w->nb = 0;
+
+    if (fwrite(&blk, sizeof (blk), 1, w->fp) != 1 ||
+	    (len && fwrite(out, len, 1, w->fp) != 1))
+	return -1;
+
+    return 0;
+}
+
+int col_create(Col_Writer_t *w, const char *path) {
+    Col_Header_t hdr = { COL_MAGIC, 0 };
+
+    if ((w->fp = fopen(path, "w")) == NULL)
+	return -1;
+
+    w->nb_rows = 0;
+    w->nb = 0;
+
+    /* row count is filled in on close */
+
+    fwrite(&hdr, sizeof (hdr), 1, w->fp);
+
+    return 0;
+}
+
+void col_append(Col_Writer_t *w, uint64_t v) {
+
+    w->vals[w->nb++] = v;
+    w->nb_rows++;
+
+    if (w->nb == COL_BLOCK)
+	col_flush(w);
+}
+
+int col_close(Col_Writer_t *w) {
+    Col_Header_t hdr = { COL_MAGIC, w->nb_rows };
+    int ret = col_flush(w);
+
+    if (fseek(w->fp, 0, SEEK_SET) ||
+	    fwrite(&hdr, sizeof (hdr), 1, w->fp) != 1)
+	ret = -1;
+
+    if (fclose(w->fp))
+	ret = -1;
+
+    return ret;
+}
+
+int col_open(Col_Reader_t *r, const char *path) {
+    const Col_Header_t *hdr = NULL;
+    struct stat st;
+    int fd = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return -1;
+
+    if (fstat(fd, &st) < 0 || (uint64_t) st.st_size < sizeof (Col_Header_t)) {
+	close(fd);
+	return -1;
+    }
+
+    r->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (r->map == MAP_FAILED)
+	return -1;
+
+    hdr = (const Col_Header_t *) r->map;
+    if (hdr->magic != COL_MAGIC) {
+	munmap((void *) r->map, st.st_size);
+	return -1;
+    }
+
+    r->size = st.st_size;
+    r->pos = sizeof (Col_Header_t);
+    r->nb_rows = hdr->nb_rows;
+
+    return 0;
+}
+
+/* Decode the next block into vals (COL_BLOCK); returns its rows, 0 at the end */
+int col_next(Col_Reader_t *r, uint64_t *vals) {
+    const Col_Block_t *blk = NULL;
+    uint8_t in[COL_BLOCK * 8 + 16];
+    uint32_t i = 0, nb = 0, len = 0;
+
+    if (r->pos + sizeof (Col_Block_t) > r->size)
+	return 0;
+
+    blk = (const Col_Block_t *) &r->map[r->pos];
+    r->pos += sizeof (Col_Block_t);
+
+    if (blk->nb == 0 || blk->nb > COL_BLOCK || blk->bits > 64)
+	return -1;
+
+    nb = (blk->enc == COL_DELTA) ? blk->nb - 1u : blk->nb;
+    len = ((uint64_t) nb * blk->bits + 7) / 8;
+
+    if (r->pos + len > r->size)
+	return -1;
+
+    /* copy out so unpack can read whole words past the end */
+
+    memcpy(in, &r->map[r->pos], len);
+    memset(&in[len], 0, 16);
+    r->pos += len;
+
+    if (blk->enc == COL_DELTA) {
+	unpack(in, &vals[1], nb, blk->bits);
+	vals[0] = blk->base;
+	for (i = 1; i < blk->nb; i++)
+	    vals[i] = vals[i - 1] + unzigzag(vals[i]);
+    } else {
+	unpack(in, vals, nb, blk->bits);
+	for (i = 0; i < nb; i++)
+	    vals[i] += blk->base;
+    }
+
+    return blk->nb;
+}
+
+void col_release(Col_Reader_t *r) {
+    munmap((void *) r->map, r->size);
+}
@@ -0,0 +1,67 @@
+#ifndef _COLUMN_H
+#define _COLUMN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Column files of the parser's metadata side store. Values are cut in
+ * blocks of COL_BLOCK rows, each block packed with however many bits its
+ * values need, either as offsets from the block minimum (COL_FOR) or as
+ * zigzag deltas from the previous value (COL_DELTA), whichever is
+ * smaller. Times within a session come out as a few bits per row.
+ *
+ *   [ Col_Header_t ][ Col_Block_t packed bits ]...
+ *
+ * All columns of a table have the same number of rows, so their blocks
+ * line up and can be scanned side by side. The parser writes two tables
+ * per log into logfile.cols/:
+ *
+ *   rec.time rec.uid rec.pid rec.ip rec.dir rec.len   one row per record
+ *   cmd.time cmd.uid cmd.pid cmd.ip cmd.hash          one per command
+ *
+ * with time in microseconds since the epoch and hash the hash64() of the
+ * command line.
+ */
+
+#define COL_MAGIC 0x4F434853 /* "SHCO" */
+#define COL_BLOCK 1024
+
+#define COL_FOR   0
+#define COL_DELTA 1
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint64_t nb_rows;
+} Col_Header_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t nb;
+    uint8_t enc;
+    uint8_t bits;
+    uint64_t base; /* minimum, or first value for COL_DELTA */
+} Col_Block_t;
+
+typedef struct {
+    FILE *fp;
+    uint64_t nb_rows;
+    uint32_t nb;
+    uint64_t vals[COL_BLOCK];
+} Col_Writer_t;
+
+typedef struct {
+    const uint8_t *map;
+    uint64_t size;
+    uint64_t pos;
+    uint64_t nb_rows;
+} Col_Reader_t;
+
+int col_create(Col_Writer_t *w, const char *path);
+void col_append(Col_Writer_t *w, uint64_t v);
+int col_close(Col_Writer_t *w);
+
+int col_open(Col_Reader_t *r, const char *path);
+int col_next(Col_Reader_t *r, uint64_t *vals);
+void col_release(Col_Reader_t *r);
+
+#endif /* _COLUMN_H */
@@ -0,0 +1,78 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "config.h"
+#include "utils.h"
+#include "settings.h"
+
+#define conf_err(format, arg...) DBG_PRINT_FUNC(format, "CONF_ERR", ##arg)
+
+/*
+ * Compiles the text settings into the file the programs map, see
+ * settings.h:
+ *
+ *   conf                                  SETTINGS_CONF_PATH to SETTINGS_PATH
+ *   conf -o /tmp/test.bin test.conf       another pair
+ *   conf -p                               settings as a program sees them
+ *
+ * Nothing is written when the text has an error, so a running setup
+ * keeps its last good settings.
+ */
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-o settings] [conf]\n"
+	    "       %s -p\n\n", name, name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *conf = SETTINGS_CONF_PATH, *out = SETTINGS_PATH;
+    Settings_t s;
+    int opt = 0, print = 0;
+
+    while ((opt = getopt(argc, argv, "o:p")) != -1) {
+	switch (opt) {
+	case 'o':
+	    out = optarg;
+	    break;
+	case 'p':
+	    print = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (print) {
+	if (optind != argc)
+	    usage(argv[0]);
+	if (settings_load(1))
+	    conf_err("Some settings ignored, see above\n");
+	settings_print(stdout, &settings);
+	return 0;
+    }
+
+    if (optind < argc - 1)
+	usage(argv[0]);
+    if (optind == argc - 1)
+	conf = argv[optind];
+
+    if (settings_parse(conf, &s)) {
+	conf_err("%s not compiled\n", conf);
+	exit(1);
+    }
+
+    if (settings_write(out, &s)) {
+	conf_err("%s write failed: %d\n", out, errno);
+	exit(1);
+    }
+
+    return 0;
+}
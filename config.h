@@ -19,13 +19,18 @@ extern "C" {
 #endif
 
 #include "utils.h"
+#include "record.h"
 
-/* Debug configuration */
+/*
+ * Debug configuration. This and the values marked below are only the
+ * defaults of the runtime settings, see settings.h.
+ */
 #define CLIENT_DBG 1
 #define SERVER_DBG 0
 #define PARSER_DBG 1
+#define RELAY_DBG 0
 
-/* Workmode configuration */
+/* Workmode configuration (setting) */
 #define LOG_OUTPUT 0
 
 #define DBG_OUT printf
@@ -39,32 +44,117 @@ extern "C" {
     } while (0)
 
 
+/* Runtime settings, see settings.h */
+#define SETTINGS_PATH      "/etc/shellog.bin"
+#define SETTINGS_CONF_PATH "/etc/shellog.conf"
+
+/* Collector address, segment size and age (settings) */
 #define CONNECT_IP      "127.0.0.1"
 #define SHELL_LOG_SERVER_PORT     40119
 #define REAL_SHELL_DIR  "/bin/"
 #define MAX_LOG_SIZE    (1048576 * 256)
-
-const char *secret = "\xBA\x36\xF7\x2A\x50\x8E\x5B\xD3" \
+#define SEGMENT_MAX_AGE_S 3600 /* rotate at least this often */
+#define SEGMENT_INDEX_US 1000000
+#define SEGMENT_SYNC_MS 1000 /* background fdatasync of the live segment */
+
+/* Receive buffer and backpressure on kernel drops */
+#define SERVER_RCVBUF_SZ (1048576 * 8) /* setting */
+#define SLOWDOWN_HOLD_MS 1000 /* coalesce this long after a slowdown */
+#define SLOWDOWN_MAX_AGE_MS 5000 /* older slowdowns are replays */
+#define COALESCE_MIN_MS 10 /* setting */
+#define COALESCE_MAX_MS 250 /* setting */
+
+/* Local aggregation relay */
+#define RELAY_SOCKET_PATH "/var/run/shellog.sock"
+#define RELAY_FLUSH_MS  50 /* setting */
+
+/* Collector metrics endpoint */
+#define METRICS_SOCKET_PATH "/var/run/shellog-metrics.sock"
+
+/* Collector rule engine alerts, see rules.h */
+#define RULES_SOCKET_PATH "/var/run/shellog-alerts.sock"
+
+/* Parser follow mode */
+#define FOLLOW_IDLE_MS  5000 /* move on from an unsealed segment */
+#define FOLLOW_FORGET_MS (3600 * 1000) /* drop a session this quiet */
+#define FOLLOW_CLIENTS  16   /* command stream subscribers */
+
+/* Shared memory ring to a collector on the same host */
+#define RING_SHM_NAME   "/shellog-ring"
+#define RING_GROUP      "shellog" /* only the setgid client is in it */
+#define RING_SLOTS      1024 /* power of two */
+#define RING_STALE_MS   5000 /* collector heartbeat timeout */
+#define RING_CLAIM_MS   1000 /* a claimed slot not published is given up */
+
+/* Resend the session open record every that many client frames (setting) */
+#define SESSION_OPEN_EVERY 32
+
+static const char secret[] = "\xBA\x36\xF7\x2A\x50\x8E\x5B\xD3" \
                "\x95\xF9\x34\xD3\x52\x26\x46\x74";
 
-#define BUF_SZ         1024*4
+#define BUF_SZ         1024*4 /* largest read_size setting */
 #define EOF_DATA_SZ 1
 #define SESSION_SZ (sizeof(Session_Data_t) - BUF_SZ)
 #define RC4_SZ 16
 #define SHA1_SZ 20
+#define IV_POOL_SZ 4096 /* random bytes fetched at once for the IVs */
 #define IP_SZ 4
 #define LENGTH_SZ 2
 #define INPUT_DIR 0
 #define OUTPUT_DIR 1
+/* v1 batches as written by older relays, see add_batch_data() */
+#define BATCH_DIR 2     /* buffer holds a batch of plain records   */
+#define BATCH_Z_DIR 3   /* same, deflated; raw size is prepended   */
+
+/* A single client record in a v2 frame, open record included */
+#define FRAME_MAX_SZ (FRAME_HDR_SZ + REC_OPEN_MAX_SZ + REC_DATA_HDR_MAX_SZ + BUF_SZ)
 
+#define MIN_PKT_SZ (RC4_SZ + FRAME_HDR_SZ + SHA1_SZ)
 #define MIN_TRANSFER_PKT_SZ (RC4_SZ + SESSION_SZ + SHA1_SZ + EOF_DATA_SZ)
-#define MAX_TRANSFER_PKT_SZ (BUF_SZ + MIN_TRANSFER_PKT_SZ)
+#define MAX_TRANSFER_PKT_SZ (RC4_SZ + FRAME_MAX_SZ + SHA1_SZ)
 #define MAX_LOG_PKT_SZ (MAX_TRANSFER_PKT_SZ + IP_SZ + LENGTH_SZ)
 
+/* Largest batch frame the server accepts in one datagram, and batch_size */
+#define BATCH_SZ (BUF_SZ - RC4_SZ - SHA1_SZ)
+/* Uncompressed batch limit, a deflated batch must still fit BATCH_SZ */
+#define RAW_BATCH_SZ (BATCH_SZ * 4)
+
+/*
+ * Frames over FRAME_MAX_SZ travel in up to FRAG_MAX_COUNT fragments of
+ * FRAG_SLICE_SZ bytes, each one fitting a BATCH_SZ datagram, see frag.h.
+ * Reassembled by the collector, they are stored as jumbo packets.
+ */
+#define FRAG_MAX_COUNT 32
+#define FRAG_SLICE_SZ (BATCH_SZ - FRAME_HDR_SZ - 3 * VARINT_MAX_SZ)
+#define JUMBO_FRAME_SZ (FRAG_MAX_COUNT * FRAG_SLICE_SZ)
+#define MAX_JUMBO_PKT_SZ (RC4_SZ + JUMBO_FRAME_SZ + SHA1_SZ)
+#define MAX_STORED_PKT_SZ (MAX_JUMBO_PKT_SZ + IP_SZ + LENGTH_SZ + 4)
+
+/* Terminal output read in one go by the client and sent as one record */
+#define BULK_SZ (1024 * 64) /* largest bulk_size setting */
+#define BULK_FRAME_MAX_SZ (FRAME_MAX_SZ - BUF_SZ + BULK_SZ)
+
+#define TRANSPORT_UDP   0
+#define TRANSPORT_RELAY 1
+#define TRANSPORT_RING  2
+
 typedef struct {
+    int transport;
     int server_fd;
+    int relay_fd;
+    void *ring;
     struct sockaddr_in server_addr;
     int nb_pkt_sent;
+    uint32_t seq;          /* of the last data record, see record.h */
+    Record_Open_t session;
+    uint64_t mono_base_us; /* CLOCK_MONOTONIC at session.base_us */
+    uint32_t coalesce_us;  /* 0: send every read right away */
+    uint64_t slow_until_us;
+    uint64_t flush_at_us;
+    uint32_t pending_len;
+    uint8_t pending[BATCH_SZ]; /* UDP frame being coalesced */
+    uint32_t frag_id;      /* of the last fragmented frame */
+    int frag_err;          /* the ring refused a fragment */
 } Connection_Data_t;
 
 typedef struct __attribute__((packed))
@@ -0,0 +1,149 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "frag.h"
+
+/* Returns the number of fragments, -1 if len needs more than allowed */
+int frag_split(const uint8_t *frame, uint32_t len, uint32_t msg_id,
+	frag_emit_t emit, void *ctx) {
+    uint8_t frag[BATCH_SZ];
+    uint32_t count = (len + FRAG_SLICE_SZ - 1) / FRAG_SLICE_SZ;
+    uint32_t i = 0, slice = 0;
+    int n = 0;
+
+    if (count == 0 || count > FRAG_MAX_COUNT)
+	return -1;
+
+    for (i = 0; i < count; i++) {
+	slice = (i == count - 1) ? len - i * FRAG_SLICE_SZ : FRAG_SLICE_SZ;
+
+	n = frame_start(frag, FRAME_F_FRAG);
+	n += varint_put(&frag[n], msg_id);
+	n += varint_put(&frag[n], i);
+	n += varint_put(&frag[n], count);
+	memcpy(&frag[n], &frame[i * FRAG_SLICE_SZ], slice);
+
+	emit(frag, n + slice, ctx);
+    }
+
+    return count;
+}
+
+void frag_init(Frag_Table_t *t) {
+    memset(t, 0, sizeof (*t));
+}
+
+void frag_free(Frag_Table_t *t) {
+    uint32_t i = 0;
+
+    for (i = 0; i < FRAG_SLOTS; i++)
+	_FREE(t->slots[i].buf);
+}
+
+/* Whether a frame from ip is still missing fragments */
+int frag_pending(const Frag_Table_t *t, uint32_t ip) {
+    uint32_t i = 0;
+
+    for (i = 0; i < FRAG_SLOTS; i++)
+	if (t->slots[i].count && t->slots[i].ip == ip)
+	    return 1;
+
+    return 0;
+}
+
+/* The pending frame of ip/msg_id, or a slot to start it in */
+static Frag_Slot_t *frag_slot(Frag_Table_t *t, uint32_t ip, uint32_t msg_id) {
+    Frag_Slot_t *s = NULL, *victim = NULL;
+    uint32_t i = 0;
+
+    for (i = 0; i < FRAG_SLOTS; i++) {
+	s = &t->slots[i];
+
+	if (s->count && s->ip == ip && s->msg_id == msg_id)
+	    return s;
+
+	if (victim == NULL || !s->count ||
+		(victim->count && s->started < victim->started))
+	    victim = s;
+    }
+
+    if (victim->count)
+	t->drops++;
+
+    victim->count = 0;
+    return victim;
+}
+
+/*
+ * Add one fragment frame. Returns 1 when it completes its frame, with
+ * *frame pointing at it until the next call, 0 while fragments are
+ * missing and -1 on a malformed fragment.
+ */
+int frag_add(Frag_Table_t *t, uint32_t ip, const uint8_t *frag,
+	uint32_t len, const uint8_t **frame, uint32_t *frame_len) {
+    Frag_Slot_t *s = NULL;
+    uint64_t msg_id = 0, index = 0, count = 0;
+    uint32_t pos = FRAME_HDR_SZ, slice = 0;
+    int r = 0;
+
+    if (!frame_is_v2(frag, len) || !(FRAME_FLAGS(frag) & FRAME_F_FRAG))
+	return -1;
+
+    if ((r = varint_get(&frag[pos], len - pos, &msg_id)) <= 0)
+	return -1;
+    pos += r;
+    if ((r = varint_get(&frag[pos], len - pos, &index)) <= 0)
+	return -1;
+    pos += r;
+    if ((r = varint_get(&frag[pos], len - pos, &count)) <= 0)
+	return -1;
+    pos += r;
+
+    slice = len - pos;
+
+    if (count == 0 || count > FRAG_MAX_COUNT || index >= count ||
+	    msg_id > UINT32_MAX || slice > FRAG_SLICE_SZ ||
+	    (index < count - 1 && slice != FRAG_SLICE_SZ) || slice == 0)
+	return -1;
+
+    t->clock++;
+    s = frag_slot(t, ip, msg_id);
+
+    if (s->count == 0) {
+	if (s->buf == NULL && (s->buf = malloc(JUMBO_FRAME_SZ)) == NULL)
+	    return -1;
+
+	s->ip = ip;
+	s->msg_id = msg_id;
+	s->count = count;
+	s->have = 0;
+	s->started = t->clock;
+	s->tag = t->tag;
+    } else if (s->count != count) {
+	return -1;
+    }
+
+    if (s->have & (1ULL << index))
+	return 0;
+
+    memcpy(&s->buf[index * FRAG_SLICE_SZ], &frag[pos], slice);
+    s->have |= 1ULL << index;
+
+    if (index == count - 1)
+	s->last_len = slice;
+
+    if (s->have != (1ULL << count) - 1)
+	return 0;
+
+    *frame = s->buf;
+    *frame_len = (count - 1) * FRAG_SLICE_SZ + s->last_len;
+    t->tag = s->tag;
+    s->count = 0;
+
+    return 1;
+}
@@ -0,0 +1,57 @@
+#ifndef _FRAG_H
+#define _FRAG_H
+
+#include <stdint.h>
+
+/*
+ * Frames too big for one datagram, FRAME_F_FRAG in record.h.
+ *
+ * frag_split() cuts a frame into fragments, slice i holding bytes
+ * [i * FRAG_SLICE_SZ, (i + 1) * FRAG_SLICE_SZ) of it, header included;
+ * only the last one may be shorter. msg_id tells the frames of a sender
+ * apart.
+ *
+ * A Frag_Table_t puts them back together. Fragments are keyed on the
+ * sender address and msg_id, and may come in any order or more than
+ * once. Up to FRAG_SLOTS frames are pending at a time: when another one
+ * starts, the one that has been pending the longest is given up and
+ * counted in drops, which is also how a lost fragment ends.
+ *
+ * tag is the caller's, set before each frag_add(): a frame keeps the one
+ * of its first fragment and puts it back in the table as it completes,
+ * so that a reader can tell where in the log the frame began.
+ *
+ * Include config.h first.
+ */
+
+#define FRAG_SLOTS 16
+
+typedef struct {
+    uint32_t ip;
+    uint32_t msg_id;
+    uint32_t count;    /* 0 for a free slot */
+    uint32_t last_len; /* of the last slice, once it came in */
+    uint64_t have;     /* bit i: slice i came in */
+    uint64_t started;  /* table clock when the first fragment came in */
+    uint64_t tag;      /* table tag then */
+    uint8_t *buf;      /* JUMBO_FRAME_SZ, allocated on first use */
+} Frag_Slot_t;
+
+typedef struct {
+    Frag_Slot_t slots[FRAG_SLOTS];
+    uint64_t clock;    /* counts fragments */
+    uint64_t tag;
+    uint64_t drops;
+} Frag_Table_t;
+
+typedef void (*frag_emit_t)(const uint8_t *frag, uint32_t len, void *ctx);
+
+int frag_split(const uint8_t *frame, uint32_t len, uint32_t msg_id,
+        frag_emit_t emit, void *ctx);
+void frag_init(Frag_Table_t *t);
+int frag_add(Frag_Table_t *t, uint32_t ip, const uint8_t *frag,
+        uint32_t len, const uint8_t **frame, uint32_t *frame_len);
+int frag_pending(const Frag_Table_t *t, uint32_t ip);
+void frag_free(Frag_Table_t *t);
+
+#endif /* _FRAG_H */
@@ -0,0 +1,478 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "config.h"
+#include "packet.h"
+#include "codec.h"
+#include "logread.h"
+
+#define logread_err(format, arg...) DBG_PRINT_FUNC(format, "LOGREAD_ERR", ##arg)
+
+/*
+ * Read the next stored packet, returns the length of its transfer packet.
+ * *size gets the bytes it takes in the log, the jumbo length included.
+ */
+static int read_stored(int fd, uint8_t *buf, uint32_t *ip, uint32_t *size) {
+    uint32_t jumbo = 0;
+    int len = 0, max = MAX_TRANSFER_PKT_SZ;
+    int ret = 0;
+
+    if ((ret = read(fd, buf, STORED_HDR_SZ)) < STORED_HDR_SZ) {
+	if (ret < 0) {
+	    logread_err("Log file read failed: %d\n", errno);
+	    return LOG_ERR;
+	}
+	return LOG_EOF;
+    }
+
+    len = stored_get_hdr(buf, ip);
+
+    /* block padding of a segment still being written in durable mode */
+
+    if (len == 0 && *ip == 0)
+	return LOG_EOF;
+
+    *size = STORED_HDR_SZ;
+
+    if (len == STORED_LEN_JUMBO) {
+	if ((ret = read(fd, &jumbo, sizeof (jumbo))) < (int) sizeof (jumbo)) {
+	    if (ret < 0) {
+		logread_err("Log file read failed: %d\n", errno);
+		return LOG_ERR;
+	    }
+	    return LOG_EOF;
+	}
+
+	len = (jumbo > MAX_JUMBO_PKT_SZ) ? -1 : (int) jumbo;
+	max = MAX_JUMBO_PKT_SZ;
+	*size = STORED_JUMBO_HDR_SZ;
+    }
+
+    if (len < MIN_PKT_SZ || len > max) {
+	logread_err("Invalid packet length %d, corrupted file.\n", len);
+	return LOG_ERR;
+    }
+
+    if ((ret = read(fd, STORED_PKT(buf), len)) < len) {
+	if (ret < 0) {
+	    logread_err("Log file read failed: %d\n", errno);
+	    return LOG_ERR;
+	}
+	return LOG_EOF;
+    }
+
+    *size += len;
+
+    return len;
+}
+
+/*
+ * Read and decrypt the next stored packet into buf (MAX_STORED_PKT_SZ).
+ * Returns the plaintext length with *plain pointing at it, LOG_EOF at the
+ * end of the log, on a truncated tail or on zero padding, LOG_ERR on a
+ * read error or a corrupted file and LOG_BAD_PKT when the packet fails
+ * verification.
+ */
+int log_read_packet(int fd, uint8_t *buf, uint32_t *ip, uint8_t **plain) {
+    uint32_t size = 0;
+    int len = 0;
+
+    if ((len = read_stored(fd, buf, ip, &size)) <= 0)
+	return len;
+
+    if ((len = packet_open(STORED_PKT(buf), len)) < 0)
+	return LOG_BAD_PKT;
+
+    *plain = PKT_DATA(STORED_PKT(buf));
+
+    return len;
+}
+
+/*
+ * Read up to n stored packets and decrypt them together, which keeps
+ * several RC4 streams in flight, see packet_open_multi(). Each p[i].len
+ * is set like the return of log_read_packet(). Reading stops short at
+ * the end of the log or on an error, with the file left at the start
+ * of the packet that could not be read. Returns the number of packets,
+ * or LOG_EOF / LOG_ERR when there was none.
+ */
+int log_read_packets(int fd, Log_Packet_t *p, int n) {
+    uint8_t *pkts[LOG_BATCH];
+    uint32_t lens[LOG_BATCH];
+    int ret[LOG_BATCH];
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    uint32_t size = 0;
+    int i = 0, len = 0;
+
+    if (n > LOG_BATCH)
+	n = LOG_BATCH;
+
+    for (i = 0; i < n; i++) {
+	if ((len = read_stored(fd, p[i].buf, &p[i].ip, &size)) <= 0) {
+	    lseek(fd, offset, SEEK_SET);
+	    break;
+	}
+
+	p[i].offset = offset;
+	pkts[i] = STORED_PKT(p[i].buf);
+	lens[i] = len;
+	offset += size;
+    }
+
+    if (i == 0)
+	return len;
+
+    packet_open_multi(pkts, lens, ret, i);
+
+    for (n = 0; n < i; n++) {
+	p[n].len = (ret[n] < 0) ? LOG_BAD_PKT : ret[n];
+	p[n].plain = PKT_DATA(STORED_PKT(p[n].buf));
+    }
+
+    return i;
+}
+
+static void decode_v1_rec(const Session_Data_t *sd, uint32_t ip,
+	const Log_Handler_t *h) {
+    Record_Open_t ro;
+    Record_Data_t rd;
+
+    ro.sid = rd.sid = sd->pid;
+    ro.uid = sd->uid;
+    ro.pid = sd->pid;
+    ro.base_us = 0;
+
+    rd.delta_us = (uint64_t) sd->time * 1000000;
+    rd.dir = sd->dir;
+    rd.len = sd->len;
+    rd.data = sd->buffer;
+    rd.seq = 0;
+
+    h->open(h->ctx, ip, &ro);
+    h->data(h->ctx, ip, &rd);
+}
+
+/* The Session_Data_t header of plain, NULL if it does not hold its data */
+static const Session_Data_t *v1_header(const uint8_t *plain, uint32_t len) {
+    const Session_Data_t *sd = (const Session_Data_t *) plain;
+
+    if (len < SESSION_SZ || sd->len > len - SESSION_SZ) {
+	logread_err("Invalid record length %u\n", (len < SESSION_SZ) ? 0 : sd->len);
+	return NULL;
+    }
+
+    return sd;
+}
+
+static int decode_v1(const uint8_t *plain, uint32_t len, uint32_t ip,
+	const Log_Handler_t *h) {
+    const Session_Data_t *sd = v1_header(plain, len);
+
+    if (sd == NULL)
+	return -1;
+
+    decode_v1_rec(sd, ip, h);
+
+    return 0;
+}
+
+/*
+ * Records forwarded by older relays arrive as a batch of plain
+ * Session_Data_t records, optionally deflated.
+ */
+static int decode_v1_batch(const uint8_t *plain, uint32_t len, uint32_t ip,
+	const Log_Handler_t *h) {
+    static __thread uint8_t raw[RAW_BATCH_SZ];
+    const Session_Data_t *sd = v1_header(plain, len);
+    const uint8_t *batch = NULL;
+    uLongf batch_len = 0;
+    uint32_t raw_len = 0;
+    uint32_t index = 0;
+    const Session_Data_t *rec = NULL;
+
+    if (sd == NULL)
+	return -1;
+
+    batch = sd->buffer;
+    batch_len = sd->len;
+
+    if (sd->dir == BATCH_Z_DIR) {
+	if (sd->len < sizeof (uint32_t)) {
+	    logread_err("Invalid compressed batch length %u\n", sd->len);
+	    return -1;
+	}
+
+	memcpy(&raw_len, sd->buffer, sizeof (uint32_t));
+	batch_len = SZARR(raw);
+
+	if (uncompress(raw, &batch_len, sd->buffer + sizeof (uint32_t),
+		sd->len - sizeof (uint32_t)) != Z_OK || batch_len != raw_len) {
+	    logread_err("Batch decompression failed\n");
+	    return -1;
+	}
+
+	batch = raw;
+    }
+
+    while (index + SESSION_SZ <= batch_len) {
+	rec = (const Session_Data_t *) &batch[index];
+
+	if (index + SESSION_SZ + rec->len > batch_len) {
+	    logread_err("Truncated record in batch\n");
+	    return -1;
+	}
+
+	decode_v1_rec(rec, ip, h);
+	index += SESSION_SZ + rec->len;
+    }
+
+    return 0;
+}
+
+static int decode_frame(const uint8_t *frame, uint32_t len, uint32_t ip,
+	const Log_Handler_t *h) {
+    static __thread uint8_t raw[RAW_BATCH_SZ];
+    Frame_Iter_t it;
+    Record_Open_t ro;
+    Record_Data_t rd;
+    uint64_t raw_len = 0;
+    uLongf inflated = 0;
+    int kind = 0, n = 0, ret = 0;
+
+    frame_iter_init(&it, &frame[FRAME_HDR_SZ], len - FRAME_HDR_SZ,
+	    FRAME_FLAGS(frame));
+
+    if (FRAME_FLAGS(frame) & FRAME_F_DEFLATE) {
+	n = varint_get(&frame[FRAME_HDR_SZ], len - FRAME_HDR_SZ, &raw_len);
+	inflated = SZARR(raw);
+
+	if (n < 0 || uncompress(raw, &inflated, &frame[FRAME_HDR_SZ + n],
+		len - FRAME_HDR_SZ - n) != Z_OK || inflated != raw_len) {
+	    logread_err("Frame decompression failed\n");
+	    return -1;
+	}
+
+	frame_iter_init(&it, raw, inflated, FRAME_FLAGS(frame));
+    }
+
+    while ((ret = frame_next(&it, &kind, &ro, &rd)) > 0) {
+	if (kind == REC_OPEN)
+	    h->open(h->ctx, ip, &ro);
+	else
+	    h->data(h->ctx, ip, &rd);
+    }
+
+    if (ret < 0) {
+	logread_err("Corrupted frame\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+static int peek_v1(const uint8_t *plain, uint32_t len, Record_Open_t *ro,
+	int *dir) {
+    const Session_Data_t *sd = (const Session_Data_t *) plain;
+
+    (void) len;
+
+    /* v1 headers only carry the record time, no session start */
+    ro->sid = ro->pid = sd->pid;
+    ro->uid = sd->uid;
+    ro->base_us = 0;
+    *dir = sd->dir;
+
+    return 0;
+}
+
+/* Batches and fragments do not start with the session they belong to */
+static int peek_none(const uint8_t *plain, uint32_t len,
+	Record_Open_t *ro, int *dir) {
+    (void) plain;
+    (void) len;
+    (void) ro;
+    (void) dir;
+
+    return -1;
+}
+
+/* A fragment goes into h->frag, the frame it completes is decoded */
+static int decode_frag(const uint8_t *plain, uint32_t len, uint32_t ip,
+	const Log_Handler_t *h) {
+    const uint8_t *frame = NULL;
+    uint32_t frame_len = 0;
+    int ret = 0;
+
+    if (h->frag == NULL)
+	return 0;
+
+    if ((ret = frag_add(h->frag, ip, plain, len, &frame, &frame_len)) <= 0) {
+	if (ret < 0)
+	    logread_err("Malformed fragment\n");
+	return ret;
+    }
+
+    if (log_codec(frame, frame_len) != CODEC_V2) {
+	logread_err("Fragments do not make a frame\n");
+	return -1;
+    }
+
+    return decode_frame(frame, frame_len, ip, h);
+}
+
+static int peek_frame(const uint8_t *plain, uint32_t len, Record_Open_t *ro,
+	int *dir) {
+    Frame_Iter_t it;
+    Record_Open_t next;
+    Record_Data_t rd;
+    int kind = 0;
+
+    if (FRAME_FLAGS(plain) &
+	    (FRAME_F_DEFLATE | FRAME_F_SLOWDOWN | FRAME_F_MERGED))
+	return -1;
+
+    frame_iter_init(&it, &plain[FRAME_HDR_SZ], len - FRAME_HDR_SZ,
+	    FRAME_FLAGS(plain));
+
+    if (frame_next_hdr(&it, &kind, ro, &rd) <= 0 || kind != REC_OPEN)
+	return -1;
+
+    if (frame_next_hdr(&it, &kind, &next, &rd) > 0 && kind == REC_DATA &&
+	    rd.sid == ro->sid)
+	*dir = rd.dir;
+
+    return 0;
+}
+
+/*
+ * Decoder of one record format, see codec.h: decode() goes through every
+ * record like log_decode(), peek() reads the session header from a
+ * prefix like log_peek(), without the version check.
+ */
+typedef struct {
+    const char *name;
+    int (*decode)(const uint8_t *plain, uint32_t len, uint32_t ip,
+	    const Log_Handler_t *h);
+    int (*peek)(const uint8_t *plain, uint32_t len, Record_Open_t *ro,
+	    int *dir);
+} Log_Codec_t;
+
+static const Log_Codec_t codecs[CODEC_VERSIONS] = {
+    [CODEC_V1]       = { "v1",       decode_v1,       peek_v1 },
+    [CODEC_V1_BATCH] = { "v1-batch", decode_v1_batch, peek_none },
+    [CODEC_V2]       = { "v2",       decode_frame,    peek_frame },
+    [CODEC_V2_FRAG]  = { "v2-frag",  decode_frag,     peek_none },
+};
+
+/*
+ * Record format of a plaintext, one of the CODEC_ versions, -1 when it
+ * is too short to be any. Only the leading header is looked at, so it
+ * also works on a prefix.
+ */
+int log_codec(const uint8_t *plain, uint32_t len) {
+    const Session_Data_t *sd = (const Session_Data_t *) plain;
+
+    if (frame_is_v2(plain, len))
+	return (FRAME_FLAGS(plain) & FRAME_F_FRAG) ? CODEC_V2_FRAG : CODEC_V2;
+
+    if (len < SESSION_SZ)
+	return -1;
+
+    return (sd->dir == BATCH_DIR || sd->dir == BATCH_Z_DIR) ?
+	    CODEC_V1_BATCH : CODEC_V1;
+}
+
+/* Returns 0 once every record went through h, -1 on a malformed packet */
+int log_decode(const uint8_t *plain, uint32_t len, uint32_t ip,
+	const Log_Handler_t *h) {
+    int version = log_codec(plain, len);
+
+    if (version < 0) {
+	logread_err("Packet too short for a record: %u\n", len);
+	return -1;
+    }
+
+    return codecs[version].decode(plain, len, ip, h);
+}
+
+/*
+ * Session header of a packet from the first bytes of its plaintext, at
+ * least LOG_PEEK_SZ of them when the packet is that long: the open
+ * record of the first session in a frame, or the Session_Data_t header
+ * of an older record. *dir is the direction of the first data record,
+ * -1 if it is not in the prefix. Returns -1 when the prefix does not
+ * tell: batches, deflated and slowdown frames.
+ */
+int log_peek(const uint8_t *plain, uint32_t len, Record_Open_t *ro,
+	int *dir) {
+    int version = log_codec(plain, len);
+
+    *dir = -1;
+
+    return (version < 0) ? -1 : codecs[version].peek(plain, len, ro, dir);
+}
+
+/*
+ * Feed keys from data[*pos] on. Returns the length of the next line
+ * completed by enter, its text in ed->line, with *pos just past the
+ * enter; 0 once every key went in.
+ */
+int line_feed(Line_Editor_t *ed, const uint8_t *data, uint32_t size,
+	uint32_t *pos, uint64_t offset) {
+    uint32_t len = 0;
+    uint8_t c = 0;
+
+    while (*pos < size) {
+	c = data[(*pos)++];
+
+	if (ed->esc) {
+	    /* ESC [ params final, or ESC O x */
+	    if (ed->esc == 1)
+		ed->esc = (c == '[' || c == 'O') ? 2 : 0;
+	    else if (c >= 0x40 && c <= 0x7E)
+		ed->esc = 0;
+	    continue;
+	}
+
+	switch (c) {
+	case 0x1B:
+	    ed->esc = 1;
+	    break;
+	case '\r':
+	case '\n':
+	    while (ed->len && ed->line[ed->len - 1] == ' ')
+		ed->len--;
+	    len = ed->len;
+	    ed->len = 0;
+	    if (len)
+		return len;
+	    break;
+	case 0x7F:
+	case 0x08:
+	    if (ed->len)
+		ed->len--;
+	    break;
+	case 0x03:
+	case 0x15:
+	    ed->len = 0;
+	    break;
+	default:
+	    if ((c < 0x20 && c != '\t') || ed->len == sizeof (ed->line))
+		break;
+	    if (ed->len == 0 && c == ' ')
+		break;
+	    if (ed->len == 0)
+		ed->offset = offset;
+	    ed->line[ed->len++] = (c == '\t') ? ' ' : c;
+	}
+    }
+
+    return 0;
+}
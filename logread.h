@@ -0,0 +1,171 @@
+#ifndef _LOGREAD_H
+#define _LOGREAD_H
+
+#include <stdint.h>
+
+#include "frag.h"
+
+/*
+ * Reading side of the server logs, shared by parser and replay.
+ *
+ * A stored packet is [ ip (IP_SZ) ][ len (LENGTH_SZ) ][ transfer packet ],
+ * see codec.h. log_decode() turns the plaintext of any record format
+ * into open/data callbacks; v1 records show up as an open record with a
+ * zero base and a data record whose delta is the absolute time. Include
+ * config.h first.
+ *
+ * Fragments are put back together in the Frag_Table_t of the handler
+ * and their frame decoded with the one that completes it; without a
+ * table they are skipped.
+ *
+ * The collector decodes on several threads at once (see rules.h), so
+ * the inflate buffers are per thread and nothing else is shared.
+ */
+
+#define LOG_EOF      0
+#define LOG_ERR     -1
+#define LOG_BAD_PKT -2
+
+typedef void (*log_open_cb)(void *ctx, uint32_t ip, const Record_Open_t *ro);
+typedef void (*log_data_cb)(void *ctx, uint32_t ip, const Record_Data_t *rd);
+
+typedef struct {
+    log_open_cb open;
+    log_data_cb data;
+    void *ctx;
+    Frag_Table_t *frag; /* NULL to skip fragments */
+} Log_Handler_t;
+
+#define LOG_BATCH 8
+
+typedef struct {
+    uint8_t buf[MAX_STORED_PKT_SZ];
+    uint32_t ip;
+    int len;         /* plaintext length or LOG_BAD_PKT */
+    uint8_t *plain;
+    uint64_t offset; /* of the stored packet in the log */
+} Log_Packet_t;
+
+/* Plaintext prefix log_peek() needs, see packet_decrypt_prefix() */
+#define LOG_PEEK_SZ (FRAME_HDR_SZ + REC_OPEN_MAX_SZ + REC_DATA_HDR_MAX_SZ)
+
+int log_read_packet(int fd, uint8_t *buf, uint32_t *ip, uint8_t **plain);
+int log_read_packets(int fd, Log_Packet_t *p, int n);
+int log_codec(const uint8_t *plain, uint32_t len);
+int log_decode(const uint8_t *plain, uint32_t len, uint32_t ip,
+        const Log_Handler_t *h);
+int log_peek(const uint8_t *plain, uint32_t len, Record_Open_t *ro,
+        int *dir);
+
+/*
+ * Per-session seek index written by the parser next to its output: one
+ * entry every INDEX_INTERVAL_US of session time, pointing at the stored
+ * packet that holds the first record at or after that time.
+ */
+
+#define INDEX_MAGIC 0x494C4853 /* "SHLI" */
+#define INDEX_INTERVAL_US 1000000
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t ip;
+    uint32_t sid;
+    uint32_t uid;
+    uint32_t pid;
+    uint8_t dir;          /* stream worth playing back */
+    uint64_t base_us;
+    uint64_t last_us;     /* delta of the last record */
+    uint64_t last_offset; /* stored packet holding it  */
+    uint32_t nb_entries;
+} Index_Header_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t delta_us;
+    uint64_t offset;
+} Index_Entry_t;
+
+/*
+ * Segment index written by the server when it seals a log segment
+ * (name.bin -> name.sidx): arrival time of the first stored packet
+ * written in each SEGMENT_INDEX_US slice and its offset in the segment.
+ */
+
+#define SEGMENT_INDEX_MAGIC 0x49534853 /* "SHSI" */
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t nb_entries;
+    uint64_t opened_us;
+    uint64_t size;
+} Segment_Index_Header_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t time_us; /* wall clock, microseconds since the epoch */
+    uint64_t offset;
+} Segment_Index_Entry_t;
+
+/*
+ * Session index of a segment (name.bin -> name.uidx), written along with
+ * the .sidx when the server runs with -i: a Segment_Index_Header_t with
+ * its own magic, then one entry per client session seen in the segment,
+ * sorted by uid and start. Sessions are told apart by client address,
+ * uid, pid and start, from the session header of each packet; merged and
+ * deflated frames are not in it.
+ */
+
+#define SEGMENT_SESSION_MAGIC 0x55534853 /* "SHSU" */
+
+typedef struct __attribute__((packed)) {
+    uint32_t ip;
+    uint32_t uid;
+    uint32_t pid;
+    uint64_t base_us;      /* session start, 0 for v1 */
+    uint64_t first_offset; /* first and last stored packet of it */
+    uint64_t last_offset;
+    uint64_t packets;
+    uint64_t bytes;        /* stored bytes */
+} Segment_Session_Entry_t;
+
+/*
+ * Command lines the parser rebuilt from the keystrokes of each session,
+ * written as logfile.cmds: a Command_Header_t and then one
+ * Command_Record_t followed by len bytes of text per command. time_us is
+ * when enter was hit, offset is the stored packet with the first key.
+ */
+
+#define COMMAND_MAGIC 0x4D434853 /* "SHCM" */
+#define COMMAND_MAX_SZ 1024
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t nb_commands;
+} Command_Header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t ip;
+    uint32_t sid;
+    uint32_t uid;
+    uint32_t pid;
+    uint64_t time_us;
+    uint64_t offset;
+    uint16_t len;
+} Command_Record_t;
+
+/*
+ * Line editor the keystrokes of a session are replayed through to get
+ * its commands back. Erase, kill and ^C are honoured; escape sequences
+ * (cursor keys, history) are dropped, since what they recall was never
+ * typed here.
+ */
+
+typedef struct {
+    uint32_t len;
+    int esc;
+    uint64_t offset; /* tag given with the first key of the line */
+    char line[COMMAND_MAX_SZ];
+} Line_Editor_t;
+
+int line_feed(Line_Editor_t *ed, const uint8_t *data, uint32_t size,
+        uint32_t *pos, uint64_t offset);
+
+#endif /* _LOGREAD_H */
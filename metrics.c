@@ -0,0 +1,325 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+
+#include "config.h"
+#include "metrics.h"
+
+static Metrics_Worker_t *workers[METRICS_MAX_WORKERS];
+static volatile int nb_workers = 0;
+
+static struct {
+    const char *name;
+    volatile uint64_t *value;
+} gauges[METRICS_MAX_GAUGES];
+static volatile int nb_gauges = 0;
+
+static const char *counter_names[MET_NB] = {
+    "packets_total",
+    "received_bytes_total",
+    "written_bytes_total",
+    "rotations_total",
+    "short_packets_total",
+    "long_packets_total",
+    "sha1_failures_total",
+    "bad_frames_total",
+    "recv_errors_total",
+    "write_errors_total",
+    "socket_drops",
+    "slowdowns_total",
+    "rule_matches_total",
+    "alert_drops_total",
+    "duplicate_records_total",
+    "late_records_total",
+    "lost_records_total",
+    "unindexed_packets_total",
+};
+
+static const char *stage_names[STAGE_NB] = { "recv", "verify", "write", "rules",
+    "peek" };
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+/* workers and gauges are registered once at startup, before serving */
+void metrics_register(Metrics_Worker_t *w, const char *name) {
+    if (nb_workers == METRICS_MAX_WORKERS)
+	return;
+
+    memset(w, 0, sizeof (*w));
+    w->name = name;
+    workers[nb_workers] = w;
+    __atomic_store_n(&nb_workers, nb_workers + 1, __ATOMIC_RELEASE);
+}
+
+void metrics_gauge(const char *name, volatile uint64_t *value) {
+    if (nb_gauges == METRICS_MAX_GAUGES)
+	return;
+
+    gauges[nb_gauges].name = name;
+    gauges[nb_gauges].value = value;
+    __atomic_store_n(&nb_gauges, nb_gauges + 1, __ATOMIC_RELEASE);
+}
+
+static int hist_bucket(uint64_t v) {
+    int shift = 0;
+
+    if (v < HIST_SUB)
+	return v;
+
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* smallest value falling into bucket b */
+static uint64_t hist_value(int b) {
+    int shift = b / HIST_SUB - 1;
+
+    if (b < HIST_SUB)
+	return b;
+
+    return (uint64_t) (HIST_SUB + b % HIST_SUB) << shift;
+}
+
+void metrics_record(Metrics_Worker_t *w, int stage, uint64_t v) {
+    Metrics_Hist_t *h = &w->hist[stage];
+    int b = hist_bucket(v);
+
+    METRIC_SET(&h->buckets[b], h->buckets[b] + 1);
+    METRIC_SET(&h->count, h->count + 1);
+    METRIC_SET(&h->sum, h->sum + v);
+    if (v > h->max)
+	METRIC_SET(&h->max, v);
+}
+
+/*
+ * Per client address packet counts. The rate is the number of packets
+ * seen during the last full second, which is cheap to keep and does not
+ * need the exporter to remember anything between scrapes.
+ */
+void metrics_ip(Metrics_Worker_t *w, uint32_t ip, uint32_t bytes) {
+    Metrics_Ip_t *e = NULL;
+    uint32_t sec = time(NULL);
+    uint32_t i = 0, h = (ip * 2654435761U) % METRICS_MAX_IPS;
+
+    for (i = 0; i < 8; i++) {
+	e = &w->ips[(h + i) % METRICS_MAX_IPS];
+	if (e->ip == ip)
+	    break;
+	if (e->packets == 0) {
+	    METRIC_SET(&e->ip, ip);
+	    break;
+	}
+    }
+    if (i == 8)
+	e = &w->ip_other;
+
+    if (e->sec != sec) {
+	METRIC_SET(&e->last_pkts, e->sec + 1 == sec ? e->cur_pkts : 0);
+	METRIC_SET(&e->cur_pkts, 0);
+	METRIC_SET(&e->sec, sec);
+    }
+
+    METRIC_SET(&e->cur_pkts, e->cur_pkts + 1);
+    METRIC_SET(&e->packets, e->packets + 1);
+    METRIC_SET(&e->bytes, e->bytes + bytes);
+}
+
+/* Per user packet counts, dir is that of the first record or -1 */
+void metrics_uid(Metrics_Worker_t *w, uint32_t uid, uint32_t bytes, int dir) {
+    Metrics_Uid_t *e = NULL;
+    uint32_t i = 0, h = (uid * 2654435761U) % METRICS_MAX_UIDS;
+
+    for (i = 0; i < 8; i++) {
+	e = &w->uids[(h + i) % METRICS_MAX_UIDS];
+	if (e->uid == uid && e->packets)
+	    break;
+	if (e->packets == 0) {
+	    METRIC_SET(&e->uid, uid);
+	    break;
+	}
+    }
+    if (i == 8)
+	e = &w->uid_other;
+
+    METRIC_SET(&e->packets, e->packets + 1);
+    METRIC_SET(&e->bytes, e->bytes + bytes);
+    if (dir == INPUT_DIR)
+	METRIC_SET(&e->input_packets, e->input_packets + 1);
+}
+
+static void dump_hist(FILE *fp, const char *worker, int stage,
+	const Metrics_Hist_t *h) {
+    uint64_t snap[HIST_BUCKETS];
+    uint64_t count = 0, seen = 0;
+    uint32_t q = 0;
+    int b = 0;
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+	snap[b] = METRIC_GET(&h->buckets[b]);
+	count += snap[b];
+    }
+
+    fprintf(fp, "shellog_%s_ns_count{worker=\"%s\"} %llu\n",
+	    stage_names[stage], worker, (unsigned long long) count);
+    fprintf(fp, "shellog_%s_ns_sum{worker=\"%s\"} %llu\n",
+	    stage_names[stage], worker,
+	    (unsigned long long) METRIC_GET(&h->sum));
+    fprintf(fp, "shellog_%s_ns_max{worker=\"%s\"} %llu\n",
+	    stage_names[stage], worker,
+	    (unsigned long long) METRIC_GET(&h->max));
+
+    if (count == 0)
+	return;
+
+    for (b = 0; b < HIST_BUCKETS && q < SZARR(quantiles); b++) {
+	seen += snap[b];
+	while (q < SZARR(quantiles) &&
+		seen >= (uint64_t) (quantiles[q] * count + 0.5)) {
+	    fprintf(fp, "shellog_%s_ns{worker=\"%s\",quantile=\"%g\"} %llu\n",
+		    stage_names[stage], worker, quantiles[q],
+		    (unsigned long long) hist_value(b));
+	    q++;
+	}
+    }
+}
+
+static void dump_ip(FILE *fp, const char *worker, const Metrics_Ip_t *e,
+	uint32_t now) {
+    uint32_t ip = METRIC_GET(&e->ip);
+    uint32_t sec = METRIC_GET(&e->sec);
+    uint64_t rate = 0;
+    char addr[16];
+
+    if (METRIC_GET(&e->packets) == 0)
+	return;
+
+    if (sec == now)
+	rate = METRIC_GET(&e->last_pkts);
+    else if (sec + 1 == now)
+	rate = METRIC_GET(&e->cur_pkts);
+
+    if (ip == 0)
+	strcpy(addr, "other");
+    else
+	sprintf(addr, "%d.%d.%d.%d", ip & 0xFF, (ip >> 8) & 0xFF,
+		(ip >> 16) & 0xFF, (ip >> 24) & 0xFF);
+
+    fprintf(fp, "shellog_client_packets_total{worker=\"%s\",ip=\"%s\"} %llu\n",
+	    worker, addr, (unsigned long long) METRIC_GET(&e->packets));
+    fprintf(fp, "shellog_client_bytes_total{worker=\"%s\",ip=\"%s\"} %llu\n",
+	    worker, addr, (unsigned long long) METRIC_GET(&e->bytes));
+    fprintf(fp, "shellog_client_packets_per_sec{worker=\"%s\",ip=\"%s\"} %llu\n",
+	    worker, addr, (unsigned long long) rate);
+}
+
+static void dump_uid(FILE *fp, const char *worker, const Metrics_Uid_t *e,
+	int other) {
+    char uid[16];
+
+    if (METRIC_GET(&e->packets) == 0)
+	return;
+
+    if (other)
+	strcpy(uid, "other");
+    else
+	sprintf(uid, "%u", METRIC_GET(&e->uid));
+
+    fprintf(fp, "shellog_user_packets_total{worker=\"%s\",uid=\"%s\"} %llu\n",
+	    worker, uid, (unsigned long long) METRIC_GET(&e->packets));
+    fprintf(fp, "shellog_user_bytes_total{worker=\"%s\",uid=\"%s\"} %llu\n",
+	    worker, uid, (unsigned long long) METRIC_GET(&e->bytes));
+    fprintf(fp, "shellog_user_input_packets_total{worker=\"%s\",uid=\"%s\"} %llu\n",
+	    worker, uid, (unsigned long long) METRIC_GET(&e->input_packets));
+}
+
+static void dump_metrics(FILE *fp) {
+    int n = __atomic_load_n(&nb_workers, __ATOMIC_ACQUIRE);
+    int g = __atomic_load_n(&nb_gauges, __ATOMIC_ACQUIRE);
+    uint32_t now = time(NULL);
+    int i = 0, j = 0;
+
+    for (j = 0; j < MET_NB; j++) {
+	for (i = 0; i < n; i++) {
+	    fprintf(fp, "shellog_%s{worker=\"%s\"} %llu\n", counter_names[j],
+		    workers[i]->name,
+		    (unsigned long long) METRIC_GET(&workers[i]->counters[j]));
+	}
+    }
+
+    for (i = 0; i < g; i++) {
+	fprintf(fp, "shellog_%s %llu\n", gauges[i].name,
+		(unsigned long long) *gauges[i].value);
+    }
+
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < STAGE_NB; j++)
+	    dump_hist(fp, workers[i]->name, j, &workers[i]->hist[j]);
+    }
+
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < METRICS_MAX_IPS; j++)
+	    dump_ip(fp, workers[i]->name, &workers[i]->ips[j], now);
+	dump_ip(fp, workers[i]->name, &workers[i]->ip_other, now);
+    }
+
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < METRICS_MAX_UIDS; j++)
+	    dump_uid(fp, workers[i]->name, &workers[i]->uids[j], 0);
+	dump_uid(fp, workers[i]->name, &workers[i]->uid_other, 1);
+    }
+}
+
+/* Thread body: answer every connection on METRICS_SOCKET_PATH with a dump */
+void *metrics_serve(void *arg) {
+    struct sockaddr_un addr;
+    FILE *fp = NULL;
+    int fd = -1, cfd = -1;
+
+    (void) arg;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	return NULL;
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, METRICS_SOCKET_PATH, sizeof (addr.sun_path) - 1);
+    unlink(METRICS_SOCKET_PATH);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+	    listen(fd, 4) < 0) {
+	close(fd);
+	return NULL;
+    }
+
+    chmod(METRICS_SOCKET_PATH, S_IRUSR | S_IWUSR);
+
+    while (1) {
+	if ((cfd = accept(fd, NULL, NULL)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+
+	if ((fp = fdopen(cfd, "w")) == NULL) {
+	    close(cfd);
+	    continue;
+	}
+
+	dump_metrics(fp);
+	fclose(fp);
+    }
+
+    close(fd);
+
+    return NULL;
+}
@@ -0,0 +1,120 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Collector metrics. Every worker thread owns one Metrics_Worker_t and is
+ * the only writer of it, so updates are plain relaxed stores with no lock
+ * or atomic read-modify-write; the exporter sums the blocks when someone
+ * connects to METRICS_SOCKET_PATH and gets a text dump back:
+ *
+ *     nc -U /var/run/shellog-metrics.sock
+ *
+ * Stage latencies go into log-linear (HDR style) histograms of
+ * nanoseconds: 16 linear sub-buckets per power of two, ~6% error.
+ */
+
+#define METRICS_MAX_WORKERS 8
+#define METRICS_MAX_GAUGES  8
+#define METRICS_MAX_IPS     256 /* per worker, the rest is lumped together */
+#define METRICS_MAX_UIDS    256 /* same, with the session index on */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum {
+    MET_PACKETS,       /* accepted packets */
+    MET_BYTES_RECV,
+    MET_BYTES_WRITTEN,
+    MET_ROTATIONS,
+    MET_SHORT_PKT,
+    MET_LONG_PKT,      /* datagrams over MAX_TRANSFER_PKT_SZ, dropped */
+    MET_BAD_SHA1,
+    MET_BAD_FRAME,
+    MET_RECV_ERR,
+    MET_WRITE_ERR,
+    MET_SOCKET_DROPS,  /* gauge: SO_RXQ_OVFL counter of the socket */
+    MET_SLOWDOWNS,     /* slowdown frames sent back to clients */
+    MET_RULE_MATCHES,  /* alerts raised by the rule engine */
+    MET_ALERT_DROPS,   /* alerts nobody was there to take */
+    MET_DUP_RECORDS,   /* seen by the rule engine, see reorder.h */
+    MET_LATE_RECORDS,
+    MET_LOST_RECORDS,
+    MET_UNINDEXED,     /* session header not readable, see segment.h */
+    MET_NB
+};
+
+enum {
+    STAGE_RECV,        /* kernel receive timestamp to our recvmsg */
+    STAGE_VERIFY,      /* SHA-1 check of the packet */
+    STAGE_WRITE,       /* log append, waiting for the log lock included */
+    STAGE_RULES,       /* decrypt, decode and rule matching */
+    STAGE_PEEK,        /* session header decryption */
+    STAGE_NB
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} Metrics_Hist_t;
+
+typedef struct {
+    uint32_t ip;
+    uint32_t sec;      /* second cur_pkts is counting */
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t cur_pkts;
+    uint64_t last_pkts; /* packets seen during the second before sec */
+} Metrics_Ip_t;
+
+typedef struct {
+    uint32_t uid;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t input_packets; /* led by a record from the terminal */
+} Metrics_Uid_t;
+
+typedef struct {
+    const char *name;
+    uint64_t counters[MET_NB];
+    Metrics_Hist_t hist[STAGE_NB];
+    Metrics_Ip_t ips[METRICS_MAX_IPS];
+    Metrics_Ip_t ip_other;
+    Metrics_Uid_t uids[METRICS_MAX_UIDS];
+    Metrics_Uid_t uid_other;
+} __attribute__((aligned(64))) Metrics_Worker_t;
+
+#define METRIC_SET(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define METRIC_GET(p)    __atomic_load_n((p), __ATOMIC_RELAXED)
+
+static inline void metrics_add(Metrics_Worker_t *w, int id, uint64_t n) {
+    METRIC_SET(&w->counters[id], w->counters[id] + n);
+}
+
+static inline void metrics_set(Metrics_Worker_t *w, int id, uint64_t v) {
+    METRIC_SET(&w->counters[id], v);
+}
+
+static inline uint64_t metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define metrics_time(w, stage, start_ns) \
+    metrics_record((w), (stage), metrics_now() - (start_ns))
+
+void metrics_register(Metrics_Worker_t *w, const char *name);
+void metrics_gauge(const char *name, volatile uint64_t *value);
+void metrics_record(Metrics_Worker_t *w, int stage, uint64_t ns);
+void metrics_ip(Metrics_Worker_t *w, uint32_t ip, uint32_t bytes);
+void metrics_uid(Metrics_Worker_t *w, uint32_t uid, uint32_t bytes, int dir);
+void *metrics_serve(void *arg);
+
+#endif /* _METRICS_H */
@@ -0,0 +1,257 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "output.h"
+
+#define OUT_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
+
+/* writev() until everything is out, iov is consumed */
+static int writev_all(int fd, struct iovec *iov, int n) {
+    ssize_t ret = 0;
+
+    while (n > 0) {
+	if ((ret = writev(fd, iov, n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	while (n > 0 && (size_t) ret >= iov->iov_len) {
+	    ret -= iov->iov_len;
+	    iov++;
+	    n--;
+	}
+
+	if (n > 0) {
+	    iov->iov_base = (uint8_t *) iov->iov_base + ret;
+	    iov->iov_len -= ret;
+	}
+    }
+
+    return 0;
+}
+
+/* Write out the buffer of f followed by len bytes of data */
+static int out_flush(Out_Writer_t *w, Out_File_t *f, const void *data,
+	uint32_t len) {
+    Out_Chunk_t chunk;
+    struct iovec iov[4];
+    int n = 0, ret = 0;
+
+    if (w->archive_fd < 0) {
+	iov[n].iov_base = f->buf;
+	iov[n++].iov_len = f->fill;
+	iov[n].iov_base = (void *) data;
+	iov[n++].iov_len = len;
+	ret = writev_all(f->fd, iov, n);
+    } else if (f->fill || len || f->trunc) {
+	chunk.magic = OUT_CHUNK_MAGIC;
+	chunk.name_len = strlen(f->name);
+	chunk.flags = f->trunc ? OUT_F_TRUNC : 0;
+	chunk.len = f->fill + len;
+
+	iov[n].iov_base = &chunk;
+	iov[n++].iov_len = sizeof (chunk);
+	iov[n].iov_base = f->name;
+	iov[n++].iov_len = chunk.name_len;
+	iov[n].iov_base = f->buf;
+	iov[n++].iov_len = f->fill;
+	iov[n].iov_base = (void *) data;
+	iov[n++].iov_len = len;
+	ret = writev_all(w->archive_fd, iov, n);
+    }
+
+    f->fill = 0;
+    f->trunc = 0;
+
+    if (ret < 0)
+	w->errors++;
+
+    return ret;
+}
+
+static void out_evict(Out_Writer_t *w, Out_File_t *f) {
+    out_flush(w, f, NULL, 0);
+
+    if (f->fd >= 0 && close(f->fd) < 0)
+	w->errors++;
+
+    f->fd = -1;
+    list_move(&f->lru, &w->free);
+}
+
+/*
+ * The cached entry of name, opened (or made room for) if it is not.
+ * trunc starts the file over.
+ */
+static Out_File_t *out_get(Out_Writer_t *w, const char *name, int trunc) {
+    uint64_t hash = hash64(name, strlen(name));
+    Out_File_t *f = NULL;
+
+    list_for_each_entry(f, &w->lru, lru) {
+	if (f->hash == hash && strcmp(f->name, name) == 0) {
+	    list_move(&f->lru, &w->lru);
+	    if (trunc) {
+		f->fill = 0;
+		f->trunc = 1;
+		if (f->fd >= 0 && ftruncate(f->fd, 0) < 0)
+		    w->errors++;
+	    }
+	    return f;
+	}
+    }
+
+    if (strlen(name) >= OUT_NAME_MAX) {
+	errno = ENAMETOOLONG;
+	return NULL;
+    }
+
+    if (list_empty(&w->free))
+	out_evict(w, list_entry(w->lru.prev, Out_File_t, lru));
+
+    f = list_entry(w->free.next, Out_File_t, lru);
+
+    if (f->buf == NULL && (f->buf = malloc(OUT_BUF_SZ)) == NULL)
+	return NULL;
+
+    if (w->archive_fd < 0 && (f->fd = open(name, O_WRONLY | O_CREAT |
+	    O_APPEND | (trunc ? O_TRUNC : 0), OUT_MODE)) < 0)
+	return NULL;
+
+    strcpy(f->name, name);
+    f->hash = hash;
+    f->fill = 0;
+    f->trunc = trunc;
+    list_move(&f->lru, &w->lru);
+
+    return f;
+}
+
+/* archive: write everything into that file instead, NULL for files */
+int out_init(Out_Writer_t *w, const char *archive) {
+    int i = 0;
+
+    memset(w, 0, sizeof (*w));
+    INIT_LIST_HEAD(&w->lru);
+    INIT_LIST_HEAD(&w->free);
+
+    for (i = 0; i < OUT_MAX_FILES; i++) {
+	w->files[i].fd = -1;
+	list_add_tail(&w->files[i].lru, &w->free);
+    }
+
+    w->archive_fd = -1;
+
+    if (archive && (w->archive_fd = open(archive,
+	    O_WRONLY | O_CREAT | O_TRUNC, OUT_MODE)) < 0)
+	return -1;
+
+    return 0;
+}
+
+/* Start name over, creating it empty */
+int out_truncate(Out_Writer_t *w, const char *name) {
+    return out_get(w, name, 1) ? 0 : -1;
+}
+
+/* Append len bytes to name. Returns 0, -1 if it could not be opened */
+int out_write(Out_Writer_t *w, const char *name, const void *data,
+	uint32_t len) {
+    Out_File_t *f = out_get(w, name, 0);
+
+    if (f == NULL)
+	return -1;
+
+    if (f->fill + len <= OUT_BUF_SZ) {
+	memcpy(&f->buf[f->fill], data, len);
+	f->fill += len;
+	return 0;
+    }
+
+    return out_flush(w, f, data, len);
+}
+
+/* Flush and close everything. Returns -1 if any write failed */
+int out_close(Out_Writer_t *w) {
+    int i = 0;
+
+    while (!list_empty(&w->lru))
+	out_evict(w, list_entry(w->lru.next, Out_File_t, lru));
+
+    for (i = 0; i < OUT_MAX_FILES; i++)
+	_FREE(w->files[i].buf);
+
+    if (w->archive_fd >= 0 && close(w->archive_fd) < 0)
+	w->errors++;
+
+    w->archive_fd = -1;
+
+    return w->errors ? -1 : 0;
+}
+
+/*
+ * Write the files of an archive into the current directory. Names with
+ * a path in them are refused. Returns -1 on a corrupted archive or a
+ * failed write.
+ */
+int out_extract(const char *archive) {
+    static Out_Writer_t w;
+    Out_Chunk_t chunk;
+    char name[OUT_NAME_MAX];
+    uint8_t *data = NULL, *tmp = NULL;
+    uint32_t size = 0;
+    FILE *fp = NULL;
+    int ret = -1;
+
+    if ((fp = fopen(archive, "r")) == NULL)
+	return -1;
+
+    out_init(&w, NULL);
+
+    while (fread(&chunk, sizeof (chunk), 1, fp) == 1) {
+	if (chunk.magic != OUT_CHUNK_MAGIC || chunk.name_len == 0 ||
+		chunk.name_len >= OUT_NAME_MAX ||
+		fread(name, chunk.name_len, 1, fp) != 1)
+	    goto out;
+
+	name[chunk.name_len] = '\0';
+	if (strchr(name, '/') || strcmp(name, ".") == 0 ||
+		strcmp(name, "..") == 0)
+	    goto out;
+
+	if (chunk.len > size) {
+	    if ((tmp = realloc(data, chunk.len)) == NULL)
+		goto out;
+	    data = tmp;
+	    size = chunk.len;
+	}
+
+	if (chunk.len && fread(data, chunk.len, 1, fp) != 1)
+	    goto out;
+
+	if ((chunk.flags & OUT_F_TRUNC) && out_truncate(&w, name) < 0)
+	    goto out;
+
+	if (out_write(&w, name, data, chunk.len) < 0)
+	    goto out;
+    }
+
+    ret = ferror(fp) ? -1 : 0;
+
+out:
+    if (out_close(&w) < 0)
+	ret = -1;
+    free(data);
+    fclose(fp);
+
+    return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stdint.h>
+
+#include "list.h"
+
+/*
+ * Output files of the parser. Writes go through a per-file buffer of
+ * OUT_BUF_SZ bytes and reach the file with one writev() per buffer, a
+ * piece too big for it going out in the same call. At most
+ * OUT_MAX_FILES files are open at a time; the least recently written
+ * one is flushed and closed to make room, and simply reopened for
+ * appending when it is written again.
+ *
+ * Archive mode puts every file into a single one instead, as a sequence
+ * of chunks carrying a flushed buffer each:
+ *
+ *   [ Out_Chunk_t ][ name (name_len) ][ data (len) ]...
+ *
+ * The chunks of a file are in order; one flagged OUT_F_TRUNC starts
+ * the file over. out_extract() turns an archive back into files.
+ */
+
+#define OUT_MAX_FILES 64
+#define OUT_BUF_SZ    (1024 * 64)
+#define OUT_NAME_MAX  128
+
+#define OUT_CHUNK_MAGIC 0x4F534853 /* "SHSO" */
+#define OUT_F_TRUNC 0x01
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t name_len;
+    uint16_t flags;
+    uint32_t len;
+} Out_Chunk_t;
+
+typedef struct {
+    char name[OUT_NAME_MAX];
+    uint64_t hash;
+    int fd;
+    int trunc;    /* archive: next chunk starts the file over */
+    uint32_t fill;
+    uint8_t *buf;
+    struct list_head lru;
+} Out_File_t;
+
+typedef struct {
+    Out_File_t files[OUT_MAX_FILES];
+    struct list_head lru;  /* open files, most recently written first */
+    struct list_head free;
+    int archive_fd;        /* -1 unless writing an archive */
+    int errors;
+} Out_Writer_t;
+
+int out_init(Out_Writer_t *w, const char *archive);
+int out_truncate(Out_Writer_t *w, const char *name);
+int out_write(Out_Writer_t *w, const char *name, const void *data,
+        uint32_t len);
+int out_close(Out_Writer_t *w);
+int out_extract(const char *archive);
+
+#endif /* _OUTPUT_H */
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "rc4.h"
+#include "sha1.h"
+#include "packet.h"
+#include "codec.h"
+
+#define packet_err(format, arg...) DBG_PRINT_FUNC(format, "PACKET_ERR", ##arg)
+
+/* SHA-1 state after the secret, shared by every key derivation */
+static sha1_midstate key_midstate;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static void key_midstate_init(void) {
+    sha1_midstate_init(&key_midstate, (const uint8_t *) secret);
+}
+
+static void packet_key(const uint8_t *iv, uint8_t key[SHA1_SZ]) {
+    pthread_once(&key_once, key_midstate_init);
+    sha1_midstate_digest(&key_midstate, iv, key);
+}
+
+/*
+ * Derive the RC4 keys of n packets, iv[i] pointing at the IV of each.
+ */
+void packet_keys(const uint8_t *iv[], uint8_t key[][SHA1_SZ], int n) {
+    int i = 0;
+
+    pthread_once(&key_once, key_midstate_init);
+
+    for (i = 0; i < n; i++)
+	sha1_midstate_digest(&key_midstate, iv[i], key[i]);
+}
+
+/*
+ * The IVs come from a per-thread pool of random bytes, so sealing a
+ * packet takes neither a syscall nor a lock. A forked child drops the
+ * pool it inherited, it would otherwise reuse the parent's IVs.
+ */
+static __thread uint8_t iv_pool[IV_POOL_SZ];
+static __thread uint32_t iv_left;
+static pthread_once_t iv_once = PTHREAD_ONCE_INIT;
+
+static void iv_forget(void) {
+    iv_left = 0;
+}
+
+static void iv_atfork(void) {
+    pthread_atfork(NULL, NULL, iv_forget);
+}
+
+static void iv_refill(void) {
+    ssize_t ret = 0;
+    size_t got = 0;
+    int fd = -1;
+
+    pthread_once(&iv_once, iv_atfork);
+
+    while (got < IV_POOL_SZ) {
+	if ((ret = getrandom(&iv_pool[got], IV_POOL_SZ - got, 0)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	got += ret;
+    }
+
+    if (got < IV_POOL_SZ && (fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+	while (got < IV_POOL_SZ &&
+		(ret = read(fd, &iv_pool[got], IV_POOL_SZ - got)) > 0)
+	    got += ret;
+	close(fd);
+    }
+
+    /* a predictable IV repeats the RC4 keystream, better stop here */
+    if (got < IV_POOL_SZ) {
+	packet_err("No randomness for the packet IVs: %d\n", errno);
+	abort();
+    }
+
+    iv_left = IV_POOL_SZ;
+}
+
+static void packet_iv(uint8_t iv[RC4_SZ]) {
+    if (iv_left < RC4_SZ)
+	iv_refill();
+
+    memcpy(iv, &iv_pool[IV_POOL_SZ - iv_left], RC4_SZ);
+    iv_left -= RC4_SZ;
+}
+
+/*
+ * Encrypt len bytes of plaintext into pkt, which must have room for
+ * RC4_SZ + len + SHA1_SZ bytes. Returns the packet length.
+ */
+int packet_seal(const uint8_t *plain, uint32_t len, uint8_t *pkt) {
+    struct rc4_state rc4;
+    uint8_t key[SHA1_SZ];
+
+    /* setup a new RC4 IV */
+
+    packet_iv(pkt);
+
+    memcpy(PKT_DATA(pkt), plain, len);
+
+    packet_key(&pkt[PKT_IV_OFF], key);
+
+    rc4_setup(&rc4, key, SHA1_SZ);
+    rc4_crypt(&rc4, PKT_DATA(pkt), len);
+
+    len += PKT_OVERHEAD;
+    sha1_digest(PKT_DATA(pkt), PKT_DATA_LEN(len), PKT_MAC(pkt, len));
+
+    return len;
+}
+
+/*
+ * Check the digest of a packet without decrypting it. Returns the
+ * length of its ciphertext, -1 on a short or tampered packet.
+ */
+int packet_verify(const uint8_t *pkt, uint32_t len) {
+    uint8_t sha1sum[SHA1_SZ];
+
+    if (len < PKT_OVERHEAD)
+	return -1;
+
+    sha1_digest(PKT_DATA(pkt), PKT_DATA_LEN(len), sha1sum);
+
+    if (memcmp(sha1sum, PKT_MAC(pkt, len), SHA1_SZ))
+	return -1;
+
+    return PKT_DATA_LEN(len);
+}
+
+/*
+ * Verify and decrypt a packet in place. On success the plaintext starts
+ * at pkt + RC4_SZ and its length is returned, -1 otherwise.
+ */
+int packet_open(uint8_t *pkt, uint32_t len) {
+    struct rc4_state rc4;
+    uint8_t key[SHA1_SZ];
+    int n = 0;
+
+    if ((n = packet_verify(pkt, len)) < 0)
+	return -1;
+
+    packet_key(&pkt[PKT_IV_OFF], key);
+
+    rc4_setup(&rc4, key, SHA1_SZ);
+    rc4_crypt(&rc4, PKT_DATA(pkt), n);
+
+    return n;
+}
+
+/*
+ * packet_open() over n packets: each one is verified on its own, then
+ * the good ones are keyed and decrypted RC4_LANES at a time, see rc4.h.
+ * ret[i] gets the plaintext length of pkt[i], or -1.
+ */
+void packet_open_multi(uint8_t *pkt[], const uint32_t len[], int ret[],
+	int n) {
+    struct rc4_state rc4[RC4_LANES];
+    struct rc4_state *states[RC4_LANES];
+    uint8_t keys[RC4_LANES][SHA1_SZ];
+    const uint8_t *key_ptrs[RC4_LANES];
+    const uint8_t *ivs[RC4_LANES];
+    uint8_t *data[RC4_LANES];
+    int lens[RC4_LANES];
+    int i = 0, l = 0;
+
+    for (l = 0; l < RC4_LANES; l++) {
+	states[l] = &rc4[l];
+	key_ptrs[l] = keys[l];
+    }
+
+    for (i = 0, l = 0; i < n; i++) {
+	if ((ret[i] = packet_verify(pkt[i], len[i])) >= 0) {
+	    ivs[l] = &pkt[i][PKT_IV_OFF];
+	    data[l] = PKT_DATA(pkt[i]);
+	    lens[l] = ret[i];
+	    l++;
+	}
+
+	if (l == RC4_LANES || (i == n - 1 && l)) {
+	    packet_keys(ivs, keys, l);
+	    rc4_setup_multi(states, key_ptrs, SHA1_SZ, l);
+	    rc4_crypt_multi(states, data, lens, l);
+	    l = 0;
+	}
+    }
+}
+
+/*
+ * Decrypt a packet already verified by the caller into plain, which
+ * must have room for len - RC4_SZ - SHA1_SZ bytes; pkt is left as is.
+ * Returns the plaintext length, -1 on a short packet.
+ */
+int packet_decrypt(const uint8_t *pkt, uint32_t len, uint8_t *plain) {
+    return packet_decrypt_prefix(pkt, len, plain, len);
+}
+
+/*
+ * packet_decrypt() of the first max bytes of the plaintext only, which
+ * is enough to read a record header without paying for its data.
+ * Returns the number of bytes decrypted, -1 on a short packet.
+ */
+int packet_decrypt_prefix(const uint8_t *pkt, uint32_t len, uint8_t *plain,
+	uint32_t max) {
+    struct rc4_state rc4;
+    uint8_t key[SHA1_SZ];
+
+    if (len < PKT_OVERHEAD)
+	return -1;
+
+    len = PKT_DATA_LEN(len);
+    if (len > max)
+	len = max;
+
+    memcpy(plain, PKT_DATA(pkt), len);
+
+    packet_key(&pkt[PKT_IV_OFF], key);
+
+    rc4_setup(&rc4, key, SHA1_SZ);
+    rc4_crypt(&rc4, plain, len);
+
+    return len;
+}
@@ -0,0 +1,29 @@
+#ifndef _PACKET_H
+#define _PACKET_H
+
+#include <stdint.h>
+
+/*
+ * Transfer packet layout, see codec.h:
+ *
+ *   [ RC4 IV (RC4_SZ) ][ RC4(plaintext) ][ SHA-1 of the ciphertext ]
+ *
+ * The per-packet RC4 key is SHA1(secret || IV). The plaintext is a v2
+ * frame, see record.h: a FRAME_HDR_SZ header, then the open and data
+ * records of its sessions. Older logs hold v1 plaintexts, a
+ * Session_Data_t header and its data, which log_codec() tells apart.
+ *
+ * Include config.h first.
+ */
+
+int packet_seal(const uint8_t *plain, uint32_t len, uint8_t *pkt);
+int packet_open(uint8_t *pkt, uint32_t len);
+int packet_verify(const uint8_t *pkt, uint32_t len);
+void packet_keys(const uint8_t *iv[], uint8_t key[][SHA1_SZ], int n);
+void packet_open_multi(uint8_t *pkt[], const uint32_t len[], int ret[],
+        int n);
+int packet_decrypt(const uint8_t *pkt, uint32_t len, uint8_t *plain);
+int packet_decrypt_prefix(const uint8_t *pkt, uint32_t len, uint8_t *plain,
+        uint32_t max);
+
+#endif /* _PACKET_H */
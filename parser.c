@@ -5,6 +5,9 @@
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
 #include <termios.h>
 #include <unistd.h>
 #include <signal.h>
@@ -15,45 +18,77 @@
 #include <netdb.h>
 #include <errno.h>
 #include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <getopt.h>
 #include <pty.h>
 
 #include "config.h"
+#include "settings.h"
 #include "rc4.h"
 #include "sha1.h"
 #include "utils.h"
 #include "list.h"
-
-#if PARSER_DBG
-#define parser_dbg(format, arg...) DBG_PRINT_FUNC(format, "PARSER_DBG", ##arg)
-#else
-#define  parser_dbg(x...)
-#endif
+#include "packet.h"
+#include "logread.h"
+#include "reorder.h"
+#include "column.h"
+#include "output.h"
+
+/* stdout carries the commands in follow mode */
+#define parser_dbg(format, arg...) do {                 \
+        if (!follow)                                    \
+            SETTINGS_DBG(SETTINGS_DBG_PARSER, format,   \
+                    "PARSER_DBG", ##arg);               \
+    } while (0)
 
 #define parser_err(format, arg...) DBG_PRINT_FUNC(format, "PARSER_ERR", ##arg)
 
+#define UNKNOWN_ID ((uint32_t) -1)
+
+static int follow = 0;
+
 typedef struct {
     uint8_t * data;
     uint8_t dir;
     uint32_t size;
-    uint32_t time;
+    uint64_t delta_us; /* since the session base */
+    uint64_t offset;   /* stored packet it came in */
     struct list_head list;
 } Log_List_t;
 
 typedef struct {
     uint32_t ip;
+    uint32_t sid;
     uint32_t uid;
     uint32_t pid;
-    uint8_t sha1_hash[20];
+    uint64_t base_us; /* 0 for v1 records, their times are absolute */
+    uint64_t last_us;
+    uint64_t last_offset;
+    int has_output;
+    Index_Entry_t *index;
+    uint32_t nb_index;
+    uint32_t index_size;
+    Line_Editor_t *live; /* follow mode: line being typed */
+    uint64_t seen_us;    /* follow mode: last record, monotonic */
+    Reorder_t reorder;
     Log_List_t data;
     struct list_head list;
 } Session_List_t;
 
-static Session_List_t *sl = NULL;
+typedef void (*command_cb)(void *ctx, Session_List_t *cur_sl, uint64_t offset,
+        uint64_t delta_us, const char *line, uint32_t len);
+
+static LIST_HEAD(sessions);
 
-Session_List_t * create_session(Session_Data_t *sd, uint32_t ip, uint8_t *sha1sum) {
+static int listen_fd = -1;
+static Frag_Table_t frags;
+static int clients[FOLLOW_CLIENTS];
+static int nb_clients = 0;
+
+static Session_List_t * create_session(uint32_t ip, uint32_t sid) {
 
     Session_List_t *cur_sl = NULL;
-    Log_List_t * new_data = NULL;
 
     if ((cur_sl = malloc(sizeof (Session_List_t))) == NULL) {
         parser_err("Memory allocation error\n");
@@ -63,215 +98,576 @@ Session_List_t * create_session(Session_Data_t *sd, uint32_t ip, uint8_t *sha1su
     INIT_LIST_HEAD(&(cur_sl->data.list));
 
     cur_sl->ip = ip;
-    cur_sl->uid = sd->uid;
-    cur_sl->pid = sd->pid;
+    cur_sl->sid = sid;
+    cur_sl->uid = UNKNOWN_ID;
+    cur_sl->pid = UNKNOWN_ID;
+    cur_sl->seen_us = follow ? clock_us(CLOCK_MONOTONIC) : 0;
+
+    /* newest first, a reused session id finds its latest session */
+
+    list_add(&(cur_sl->list), &sessions);
+
+    return cur_sl;
+}
+
+static void free_session(Session_List_t *cur_sl) {
+
+    Log_List_t *entry = NULL, *tmp = NULL;
+
+    list_for_each_entry_safe(entry, tmp, &(cur_sl->data.list), list) {
+        list_del(&(entry->list));
+        free(entry->data);
+        free(entry);
+    }
+
+    reorder_init(&cur_sl->reorder);
+    list_del(&(cur_sl->list));
+    free(cur_sl->index);
+    free(cur_sl->live);
+    free(cur_sl);
+}
+
+static Session_List_t * find_session(uint32_t ip, uint32_t sid) {
+
+    Session_List_t *cur_sl = NULL;
+
+    list_for_each_entry(cur_sl, &sessions, list) {
+        if (cur_sl->ip == ip && cur_sl->sid == sid)
+            return cur_sl;
+    }
+
+    return create_session(ip, sid);
+}
+
+static Log_List_t * add_session_data(Session_List_t *cur_sl, uint8_t dir,
+        uint64_t delta_us, uint64_t offset, const uint8_t *data, uint32_t len) {
+
+    Log_List_t * new_data = NULL;
+    struct list_head *p;
 
     if ((new_data = malloc(sizeof (Log_List_t))) == NULL) {
         parser_err("Memory allocation error\n");
         exit(1);
     }
+
     memset(new_data, 0, sizeof (Log_List_t));
-    INIT_LIST_HEAD(&(new_data->list));
 
-    if ((new_data->data = malloc(sd->len)) == NULL) {
+    if ((new_data->data = malloc(len + 1)) == NULL) {
         parser_err("Memory allocation error\n");
         exit(1);
     }
 
-    memcpy(new_data->data, sd->buffer, sd->len);
-    INIT_LIST_HEAD(&(cur_sl->list));
+    memcpy(new_data->data, data, len);
+    new_data->data[len] = '\0';
 
-    new_data->dir = sd->dir;
-    new_data->time = sd->time;
+    parser_dbg("--- %s\r\n", new_data->data);
 
-    memcpy(cur_sl->sha1_hash, sha1sum, SHA1_SZ);
+    new_data->dir = dir;
+    new_data->delta_us = delta_us;
+    new_data->offset = offset;
+    new_data->size = len;
 
-    return cur_sl;
+    /*
+     * Keep the session ordered by time. Datagrams are almost always in
+     * order, so the walk back from the tail usually stops right away.
+     */
+
+    list_for_each_prev(p, &(cur_sl->data.list)) {
+        if (list_entry(p, Log_List_t, list)->delta_us <= delta_us)
+            break;
+    }
+
+    list_add(&(new_data->list), p);
+
+    return new_data;
 }
 
-static void add_session_data(Session_Data_t *sd, uint32_t ip) {
+static void add_open(Record_Open_t *ro, uint32_t ip) {
 
-    sha1_context sha1;
-    uint8_t sha1sum[SHA1_SZ];
-    Session_List_t *cur_sl = NULL;
-    Log_List_t * new_data = NULL;
+    Session_List_t *cur_sl = find_session(ip, ro->sid);
 
+    /* same id, different start: the pid was reused by a new session */
 
-    sha1_starts(&sha1);
-    sha1_update(&sha1, &ip, IP_SZ);
-    sha1_update(&sha1, &sd->uid, sizeof (uint32_t));
-    sha1_update(&sha1, &sd->pid, sizeof (uint32_t));
-    sha1_finish(&sha1, sha1sum);
+    if (cur_sl->pid != UNKNOWN_ID && cur_sl->base_us != ro->base_us)
+        cur_sl = create_session(ip, ro->sid);
 
-    if (sl != NULL) {
+    cur_sl->uid = ro->uid;
+    cur_sl->pid = ro->pid;
+    cur_sl->base_us = ro->base_us;
+}
+
+static void add_index(Session_List_t *cur_sl, uint64_t delta_us,
+        uint64_t offset) {
+
+    if (cur_sl->nb_index &&
+            delta_us < cur_sl->index[cur_sl->nb_index - 1].delta_us + INDEX_INTERVAL_US)
+        return;
 
-        list_for_each_entry(cur_sl, &(sl->list), list) {
+    if (cur_sl->nb_index == cur_sl->index_size) {
+        cur_sl->index_size = cur_sl->index_size ? 2 * cur_sl->index_size : 64;
+        cur_sl->index = realloc(cur_sl->index,
+                cur_sl->index_size * sizeof (Index_Entry_t));
+        if (cur_sl->index == NULL) {
+            parser_err("Memory allocation error\n");
+            exit(1);
+        }
+    }
 
-            if (memcmp(&cur_sl->sha1_hash, sha1sum, SHA1_SZ) == 0) {
+    cur_sl->index[cur_sl->nb_index].delta_us = delta_us;
+    cur_sl->index[cur_sl->nb_index].offset = offset;
+    cur_sl->nb_index++;
+}
 
-                /* Found session, add new command data and return */
+/* Hand each command typed in the session to emit(), see line_feed() */
+static void rebuild_commands(Session_List_t *cur_sl, command_cb emit,
+        void *ctx) {
+    Log_List_t *entry = NULL;
+    Line_Editor_t ed;
+    uint32_t pos = 0, len = 0;
 
-                if ((new_data = malloc(sizeof (Log_List_t))) == NULL) {
-                    parser_err("Memory allocation error\n");
-                    exit(1);
-                }
+    memset(&ed, 0, sizeof (ed));
 
-                memset(new_data, 0, sizeof (Log_List_t));
+    list_for_each_entry(entry, &(cur_sl->data.list), list) {
+        if (entry->dir != INPUT_DIR)
+            continue;
 
-                if ((new_data->data = malloc(sd->len)) == NULL) {
-                    parser_err("Memory allocation error\n");
-                    exit(1);
-                }
+        pos = 0;
+        while ((len = line_feed(&ed, entry->data, entry->size, &pos,
+                entry->offset)) > 0)
+            emit(ctx, cur_sl, ed.offset, entry->delta_us, ed.line, len);
+    }
+}
 
-                memcpy(new_data->data, sd->buffer, sd->len);
+/* Follow mode: print each command as soon as it is entered */
+static void stream_command(Session_List_t *cur_sl, uint64_t delta_us,
+        const char *line, uint32_t len) {
+    char out[COMMAND_MAX_SZ + 128];
+    struct in_addr addr;
+    time_t t = (cur_sl->base_us + delta_us) / 1000000;
+    int n = 0, i = 0;
 
-                parser_dbg("--- %s\r\n", new_data->data);
+    addr.s_addr = cur_sl->ip;
 
-                new_data->dir = sd->dir;
-                new_data->time = sd->time;
-                new_data->size = sd->len;
+    n = strftime(out, sizeof (out), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    n += snprintf(&out[n], sizeof (out) - n, " %s uid %d pid %d: %.*s\n",
+            inet_ntoa(addr), (int) cur_sl->uid, (int) cur_sl->pid, (int) len,
+            line);
 
-                list_add(&(new_data->list), &(cur_sl->data.list));
-                return;
-            }
+    if (listen_fd < 0) {
+        fwrite(out, n, 1, stdout);
+        fflush(stdout);
+        return;
+    }
+
+    for (i = 0; i < nb_clients; ) {
+        if (send(clients[i], out, n, MSG_NOSIGNAL | MSG_DONTWAIT) != n) {
+            /* gone, or too far behind to keep */
+            close(clients[i]);
+            clients[i] = clients[--nb_clients];
+            continue;
         }
+        i++;
     }
+}
+
+static void on_open(void *ctx, uint32_t ip, const Record_Open_t *ro) {
+
+    Record_Open_t open = *ro;
+
+    (void) ctx;
+
+    parser_dbg("Session %u: uid %u, pid %u\r\n", ro->sid, ro->uid, ro->pid);
 
-    /* Create new session */
+    add_open(&open, ip);
+}
+
+/* A record of cur_sl, in order, out of the reorder window */
+static void session_data(void *ctx, const Record_Data_t *rd, uint64_t offset) {
+
+    Session_List_t *cur_sl = ctx;
+    Log_List_t *entry = NULL;
+    uint32_t pos = 0, len = 0;
+
+    /* follow mode keeps nothing but the line being typed */
 
-    cur_sl = create_session(sd, ip, sha1sum);
-    if (sl == NULL) {
-        sl = cur_sl;
+    if (follow) {
+        if (rd->dir != INPUT_DIR)
+            return;
+        if (cur_sl->live == NULL &&
+                (cur_sl->live = calloc(1, sizeof (Line_Editor_t))) == NULL) {
+            parser_err("Memory allocation error\n");
+            exit(1);
+        }
+        pos = 0;
+        while ((len = line_feed(cur_sl->live, rd->data, rd->len, &pos,
+                offset)) > 0)
+            stream_command(cur_sl, rd->delta_us, cur_sl->live->line, len);
         return;
     }
 
-    list_add(&(cur_sl->list), &(sl->list));
+    entry = add_session_data(cur_sl, rd->dir, rd->delta_us, offset,
+            rd->data, rd->len);
+
+#if 1
+    printf("Decoded message: \r\n");
+    printf("      sid: %u\r\n", rd->sid);
+    printf("      uid: %d\r\n", (int) cur_sl->uid);
+    printf("      pid: %d\r\n", (int) cur_sl->pid);
+    printf("    delta: %llu\r\n", (unsigned long long) rd->delta_us);
+    printf("      dir: %d\r\n", (uint32_t) rd->dir);
+    printf("      len: %d\r\n", (uint32_t) rd->len);
+    printf("     data: \r\n");
+    __print_output(entry->data, entry->size);
+    printf("\r\n\r\n");
+#endif
+
+    add_index(cur_sl, rd->delta_us, offset);
+
+    if (rd->dir == OUTPUT_DIR)
+        cur_sl->has_output = 1;
+
+    if (rd->delta_us >= cur_sl->last_us) {
+        cur_sl->last_us = rd->delta_us;
+        cur_sl->last_offset = offset;
+    }
 }
 
-static int read_and_decrypt(int fd) {
-    uint32_t src_ip;
-    int len = 0;
-    sha1_context sha1;
-    struct rc4_state rc4;
-    int ret = 0;
-    unsigned char buffer[MAX_LOG_PKT_SZ];
-    uint32_t buffer_write_index = 0;
-    uint32_t buffer_read_index = 0;
-    uint8_t sha1sum[SHA1_SZ];
-    uint8_t pktkey[32];
-    Session_Data_t * sd = NULL;
-    uint8_t * command_buf = NULL;
-    size_t command_size = 0;
-
-    while (ret = read(fd, buffer, IP_SZ + LENGTH_SZ)) {
-        if (ret < IP_SZ + LENGTH_SZ) {
-            if (ret < 0) {
-                parser_err("Log file read failed: %d\n", errno);
-                exit(1);
-            } else {
-                parser_err("Log file empty\n");
-                exit(0);
-            }
-        }
+static void session_gap(void *ctx, uint32_t sid, uint32_t first,
+        uint32_t last) {
 
-        buffer_write_index += IP_SZ + LENGTH_SZ;
+    Session_List_t *cur_sl = ctx;
+    struct in_addr addr;
 
-        memcpy(&src_ip, &buffer[buffer_read_index], IP_SZ);
-        buffer_read_index += IP_SZ;
-        memcpy(&len, &buffer[buffer_read_index], LENGTH_SZ);
-        buffer_read_index += LENGTH_SZ;
+    addr.s_addr = cur_sl->ip;
 
-        parser_dbg("Packet size: %d\n", len);
+    fprintf(stderr, "Session %u from %s: records %u to %u lost\n", sid,
+            inet_ntoa(addr), first, last);
+}
 
-        if (len < MIN_TRANSFER_PKT_SZ) {
-            parser_err("Invalid packet length %d, corrupted file.\n", len);
-            exit(2);
+static void on_data(void *ctx, uint32_t ip, const Record_Data_t *rd) {
+
+    Session_List_t *cur_sl = find_session(ip, rd->sid);
+    Reorder_Handler_t h = { session_data, session_gap, cur_sl };
+
+    /* a batch run holds records by count alone, till the end of the log */
+
+    if (follow)
+        cur_sl->seen_us = clock_us(CLOCK_MONOTONIC);
+
+    reorder_push(&cur_sl->reorder, rd, *(uint64_t *) ctx, cur_sl->seen_us,
+            &h);
+}
+
+/* Give up on the gaps still open, and sum up what the windows saw */
+static void flush_sessions(void) {
+
+    Session_List_t *cur_sl = NULL;
+    Reorder_Handler_t h = { session_data, session_gap, NULL };
+    struct in_addr addr;
+
+    list_for_each_entry(cur_sl, &sessions, list) {
+        h.ctx = cur_sl;
+        reorder_flush(&cur_sl->reorder, &h);
+
+        if (cur_sl->reorder.dups || cur_sl->reorder.late ||
+                cur_sl->reorder.lost) {
+            addr.s_addr = cur_sl->ip;
+            fprintf(stderr, "Session %u from %s: %u duplicates, %u late, "
+                    "%u lost\n", cur_sl->sid, inet_ntoa(addr),
+                    cur_sl->reorder.dups, cur_sl->reorder.late,
+                    cur_sl->reorder.lost);
         }
+    }
+}
 
-        /* TODO: Wait timeout to read if file is not ready yet */
-        ret = read(fd, &buffer[buffer_write_index], len);
-        if (ret < len) {
-            if (ret < 0) {
-                parser_err("Log file read failed: %d\n", errno);
-                exit(1);
+/*
+ * Follow mode: a gap nobody filled in time is not waited for any longer,
+ * and a session quiet for FOLLOW_FORGET_MS is dropped. Should it come
+ * back, it starts over, without its uid and pid until its next open
+ * record and without the line it had half typed.
+ */
+static void expire_sessions(uint64_t now_us) {
+
+    Session_List_t *cur_sl = NULL, *tmp = NULL;
+    Reorder_Handler_t h = { session_data, session_gap, NULL };
+
+    list_for_each_entry_safe(cur_sl, tmp, &sessions, list) {
+        h.ctx = cur_sl;
+
+        if (cur_sl->reorder.nb_held)
+            reorder_expire(&cur_sl->reorder, now_us, &h);
+
+        if (now_us - cur_sl->seen_us < FOLLOW_FORGET_MS * 1000ULL)
+            continue;
+
+        reorder_flush(&cur_sl->reorder, &h);
+        free_session(cur_sl);
+    }
+}
+
+/*
+ * Decode the stored packets from *offset on. A record cut short by the
+ * end of the file is left for the next call: the file is rewound to its
+ * start. Returns the number of packets read, -1 on a corrupted file.
+ * Records of a fragmented frame are tagged with its first fragment.
+ */
+static int read_packets(int fd, uint64_t *offset) {
+    static Log_Packet_t pkts[LOG_BATCH];
+    int i = 0, n = 0, nb = 0;
+    Log_Handler_t handler = { on_open, on_data, &frags.tag, &frags };
+
+    while ((n = log_read_packets(fd, pkts, LOG_BATCH)) > 0) {
+
+        for (i = 0; i < n; i++) {
+            *offset = pkts[i].offset;
+            frags.tag = *offset;
+
+            if (pkts[i].len == LOG_BAD_PKT) {
+                parser_err("SHA-1 checksum verification failed\n");
             } else {
-                parser_err("Log file empty\n");
-                exit(0);
+                parser_dbg("Packet size: %d\n", pkts[i].len);
+                log_decode(pkts[i].plain, pkts[i].len, pkts[i].ip, &handler);
             }
         }
 
-        buffer_write_index += len;
+        nb += n;
+    }
+
+    if (n == LOG_ERR)
+        return -1;
+
+    *offset = lseek(fd, 0, SEEK_CUR);
+
+    return nb;
+}
+
+static int read_and_decrypt(int fd) {
+    uint64_t offset = 0;
+
+    if (read_packets(fd, &offset) < 0)
+        exit(2);
+
+    flush_sessions();
+
+    if (frags.drops)
+        fprintf(stderr, "%llu fragmented frames incomplete\n",
+                (unsigned long long) frags.drops);
+
+    frag_free(&frags);
+
+    parser_dbg("All done\n");
+
+    return 0;
+}
+
+static int open_stream(const char *path) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof (addr.sun_path) - 1);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        parser_err("Socket creation failed: %d\n", errno);
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+            listen(listen_fd, FOLLOW_CLIENTS) < 0) {
+        parser_err("Socket %s bind failed: %d\n", path, errno);
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
 
-        /* Check SHA1 checksum */
+    return 0;
+}
 
-        sha1_starts(&sha1);
-        sha1_update(&sha1, &buffer[RC4_SZ + IP_SZ + LENGTH_SZ],
-                len - RC4_SZ - SHA1_SZ);
-        sha1_finish(&sha1, sha1sum);
+static void accept_clients(void) {
+    int fd = -1;
 
-        if (memcmp(sha1sum, &buffer[IP_SZ + LENGTH_SZ + len - SHA1_SZ], SHA1_SZ)) {
-            parser_err("SHA-1 checksum verification failed\n");
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        if (nb_clients == FOLLOW_CLIENTS) {
+            close(fd);
             continue;
         }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        clients[nb_clients++] = fd;
+    }
+}
 
-        /* Decrypt */
+static int is_segment(const char *name) {
+    size_t len = strlen(name);
 
-        memcpy(pktkey, secret, RC4_SZ);
-        memcpy(pktkey + RC4_SZ, &buffer[IP_SZ + LENGTH_SZ], RC4_SZ);
+    return strncmp(name, "shellog-", 8) == 0 && len > 12 &&
+            strcmp(&name[len - 4], ".bin") == 0;
+}
 
-        sha1_starts(&sha1);
-        sha1_update(&sha1, pktkey, 32);
-        sha1_finish(&sha1, pktkey);
+/*
+ * Segment names sort by creation time: pick the newest one in dir, or
+ * the first one after the given name. Returns 0 when there is none.
+ */
+static int find_segment(const char *dir, const char *after, int newest,
+        char *name, size_t size) {
+    DIR *d = NULL;
+    struct dirent *de = NULL;
+    int found = 0;
+
+    if ((d = opendir(dir)) == NULL) {
+        parser_err("Directory %s open failed: %d\n", dir, errno);
+        return 0;
+    }
 
-        rc4_setup(&rc4, pktkey, SHA1_SZ);
-        rc4_crypt(&rc4, &buffer[IP_SZ + LENGTH_SZ + RC4_SZ],
-                len - RC4_SZ - SHA1_SZ);
+    while ((de = readdir(d)) != NULL) {
+        if (!is_segment(de->d_name))
+            continue;
+        if (newest) {
+            if (found && strcmp(de->d_name, name) <= 0)
+                continue;
+        } else {
+            if (strcmp(de->d_name, after) <= 0 ||
+                    (found && strcmp(de->d_name, name) >= 0))
+                continue;
+        }
+        snprintf(name, size, "%s", de->d_name);
+        found = 1;
+    }
 
-        sd = &buffer[IP_SZ + LENGTH_SZ + RC4_SZ];
+    closedir(d);
 
-#if 1
-        printf("Decoded message: \r\n");
-        printf("  seconds: %d\r\n", (uint32_t) sd->time);
-        printf("      uid: %d\r\n", (uint32_t) sd->uid);
-        printf("      pid: %d\r\n", (uint32_t) sd->pid);
-        printf("      dir: %d\r\n", (uint32_t) sd->dir);
-        printf("      len: %d\r\n", (uint32_t) sd->len);
-        printf("     data: \r\n");
-        __print_output(sd->buffer, sd->len);
-        printf("\r\n\r\n");
-#endif
+    return found;
+}
 
-        buffer_write_index = buffer_read_index = 0;
+/*
+ * Tail the live segment and stream commands as they are typed. The
+ * server's writes to the segment directory wake us through inotify; a
+ * trailing record still being written is picked up on the next wake.
+ * Once the segment is sealed (its .sidx shows up) or has been idle for
+ * FOLLOW_IDLE_MS with a newer one around, move on to the next segment.
+ */
+static void follow_log(const char *path) {
+    struct stat st;
+    struct pollfd fds[2];
+    char dir[256], cur[256], next[256], name[600];
+    char events[4096];
+    uint64_t offset = 0, idle_since = 0, now = 0;
+    int fd = -1, ifd = -1, broken = 0, nb = 0;
+    char *slash = NULL;
+
+    if (stat(path, &st) < 0) {
+        parser_err("Log %s not found: %d\n", path, errno);
+        exit(1);
+    }
 
-        /* Find session */
+    cur[0] = '\0';
+
+    if (S_ISDIR(st.st_mode)) {
+        snprintf(dir, SZARR(dir), "%s", path);
+    } else {
+        snprintf(dir, SZARR(dir), "%s", path);
+        if ((slash = strrchr(dir, '/')) == NULL) {
+            strcpy(dir, ".");
+            snprintf(cur, SZARR(cur), "%s", path);
+        } else {
+            snprintf(cur, SZARR(cur), "%s", slash + 1);
+            *(slash == dir ? slash + 1 : slash) = '\0';
+        }
+    }
 
-        add_session_data(sd, src_ip);
+    if ((ifd = inotify_init1(IN_NONBLOCK)) < 0 ||
+            inotify_add_watch(ifd, dir, IN_MODIFY | IN_CREATE | IN_MOVED_TO |
+            IN_CLOSE_WRITE) < 0) {
+        parser_err("Watching of %s failed: %d\n", dir, errno);
+        exit(1);
     }
 
-    parser_dbg("All done\n");
+    fds[0].fd = ifd;
+    fds[0].events = POLLIN;
+    fds[1].fd = listen_fd;
+    fds[1].events = POLLIN;
+
+    idle_since = clock_us(CLOCK_MONOTONIC);
+
+    while (1) {
+        if (cur[0] == '\0')
+            find_segment(dir, NULL, 1, cur, SZARR(cur));
+
+        if (fd < 0 && cur[0]) {
+            snprintf(name, SZARR(name), "%s/%s", dir, cur);
+            if ((fd = open(name, O_RDONLY)) < 0) {
+                parser_err("Log file %s open failed: %d\n", name, errno);
+                exit(1);
+            }
+            offset = 0;
+            broken = 0;
+            idle_since = clock_us(CLOCK_MONOTONIC);
+        }
+
+        now = clock_us(CLOCK_MONOTONIC);
+
+        if (fd >= 0 && !broken) {
+            if ((nb = read_packets(fd, &offset)) < 0) {
+                parser_err("Log file %s is corrupted at %llu\n", cur,
+                        (unsigned long long) offset);
+                broken = 1;
+            } else if (nb) {
+                idle_since = now;
+            }
+        }
+
+        if (fd >= 0) {
+            snprintf(name, SZARR(name), "%s/%s", dir, cur);
+            strcpy(strrchr(name, '.'), ".sidx");
+
+            if ((access(name, F_OK) == 0 || broken ||
+                    now - idle_since > FOLLOW_IDLE_MS * 1000ULL) &&
+                    find_segment(dir, cur, 0, next, SZARR(next))) {
+
+                /* sealed: whatever came before the .sidx is in by now */
+
+                if (!broken)
+                    read_packets(fd, &offset);
+
+                close(fd);
+                fd = -1;
+                snprintf(cur, SZARR(cur), "%s", next);
+                continue;
+            }
+        }
+
+        if (poll(fds, listen_fd < 0 ? 1 : 2, 1000) < 0 && errno != EINTR) {
+            parser_err("Poll failed: %d\n", errno);
+            exit(1);
+        }
+
+        while (read(ifd, events, sizeof (events)) > 0)
+            ;
+
+        if (listen_fd >= 0 && (fds[1].revents & POLLIN))
+            accept_clients();
 
+        expire_sessions(clock_us(CLOCK_MONOTONIC));
+    }
 }
 
-static int dump_to_file(){
-    Session_List_t *tmp_entry = NULL, *tmp_st_entry = NULL;
-    Log_List_t *log_entry = NULL,
-               *log_tmp_entry = NULL,
-               *log_tmp_st_entry = NULL;
-    FILE *fp;
-    int ret = 0;
+/* Per session output files, or the archive holding them, see output.h */
+static Out_Writer_t out;
+
+static int dump_to_file(void) {
+    Session_List_t *tmp_entry = NULL;
+    Log_List_t *log_tmp_entry = NULL;
     char dump_buf[32];
     char msg_buf[4096];
     uint32_t msg_buf_index = 0;
-    struct list_head *p;
 
-    if (sl == NULL || sl == 0){
+    if (list_empty(&sessions)){
         parser_err("Session list is not defined\r\n");
         return -1;
     }
 
-    list_for_each_entry_safe(tmp_entry, tmp_st_entry, &(sl->list), list) {
-        if (tmp_entry == NULL || tmp_entry == 0)
-            continue;
+    list_for_each_entry(tmp_entry, &sessions, list) {
 
         parser_dbg("Founded session: UID: %d, PID: %d\r\n", tmp_entry->uid, tmp_entry->pid);
 
@@ -279,78 +675,341 @@ static int dump_to_file(){
 
         msg_buf_index = 0;
 
-        if ((fp = fopen(dump_buf, "a")) == NULL){
+        if (out_write(&out, dump_buf, msg_buf, 0) < 0) {
             parser_err("Opening of file %s is failed: %d\r\n", dump_buf, errno);
             return -1;
         }
 
-        log_entry = &(tmp_entry->data);
-        if (log_entry != NULL) {
+        list_for_each_entry(log_tmp_entry, &(tmp_entry->data.list), list) {
+            parser_dbg("%d:[%s]\r\n",log_tmp_entry->size ,log_tmp_entry->data);
+
+            if (log_tmp_entry->size == 1 && log_tmp_entry->data[0] == '\r'){
+                msg_buf[msg_buf_index] = '\0';
+                parser_dbg("End of command: %s\r\n", msg_buf);
+                out_write(&out, dump_buf, msg_buf, msg_buf_index);
+                msg_buf_index = 0;
+            }
+
+            if (msg_buf_index + log_tmp_entry->size >= SZARR(msg_buf))
+                continue;
+
+            memcpy(&msg_buf[msg_buf_index], log_tmp_entry->data, log_tmp_entry->size);
+            msg_buf_index+=log_tmp_entry->size;
+        }
+    }
+
+    return 0;
+}
 
-            list_for_each_prev(p, &(log_entry->list)){
-                log_tmp_entry = list_entry(p, Log_List_t, list);
-                parser_dbg("%d:[%s]\r\n",log_tmp_entry->size ,log_tmp_entry->data);
+/*
+ * Write each session as a typescript and timing file pair, so it plays
+ * back with its original pacing through scriptreplay(1). The output
+ * stream is used when it was logged, the keystrokes otherwise.
+ */
+static int dump_timing(void) {
+    Session_List_t *cur_sl = NULL;
+    Log_List_t *entry = NULL;
+    char ts_name[48], tm_name[48], line[64];
+    uint8_t dir = INPUT_DIR;
+    uint64_t prev_us = 0;
+    time_t start;
+    int n = 0;
 
-                if (log_tmp_entry->size == 1 && log_tmp_entry->data[0] == '\r'){
-                    msg_buf[msg_buf_index] = '\0';
-                    parser_dbg("End of command: %s\r\n", msg_buf);
-                    fwrite(msg_buf, msg_buf_index, 1, fp);
-                    msg_buf_index = 0;
-                }
+    list_for_each_entry(cur_sl, &sessions, list) {
 
-                memcpy(&msg_buf[msg_buf_index], log_tmp_entry->data, log_tmp_entry->size);
-                msg_buf_index+=log_tmp_entry->size;
+        if (list_empty(&(cur_sl->data.list)))
+            continue;
 
+        dir = INPUT_DIR;
+        list_for_each_entry(entry, &(cur_sl->data.list), list) {
+            if (entry->dir == OUTPUT_DIR) {
+                dir = OUTPUT_DIR;
+                break;
             }
+        }
 
-            /*
-               list_for_each_entry_safe(log_tmp_entry,
-                    log_tmp_st_entry, &(log_entry->list), list) {
+        snprintf(ts_name, SZARR(ts_name), "%d-%d-%d.typescript", cur_sl->uid,
+                cur_sl->pid, cur_sl->ip);
+        if (out_truncate(&out, ts_name) < 0) {
+            parser_err("Opening of file %s is failed: %d\r\n", ts_name, errno);
+            return -1;
+        }
 
-                if (log_tmp_entry == NULL || log_tmp_entry == 0)
-                    continue;
+        snprintf(tm_name, SZARR(tm_name), "%d-%d-%d.timing", cur_sl->uid,
+                cur_sl->pid, cur_sl->ip);
+        if (out_truncate(&out, tm_name) < 0) {
+            parser_err("Opening of file %s is failed: %d\r\n", tm_name, errno);
+            return -1;
+        }
 
-                parser_dbg("%d:[%s]\r\n",log_tmp_entry->size ,log_tmp_entry->data);
+        entry = list_entry(cur_sl->data.list.next, Log_List_t, list);
+        start = (cur_sl->base_us + entry->delta_us) / 1000000;
+        n = snprintf(line, SZARR(line), "Script started on %s", ctime(&start));
+        out_write(&out, ts_name, line, n);
 
-                if (log_tmp_entry->size == 1 && log_tmp_entry->data[0] == '\r'){
-                    msg_buf[msg_buf_index] = '\0';
-                    parser_dbg("End of command: %s\r\n", msg_buf);
-                    fwrite(msg_buf, msg_buf_index, 1, fp);
-                    msg_buf_index = 0;
-                }
+        prev_us = entry->delta_us;
 
-                memcpy(&msg_buf[msg_buf_index], log_tmp_entry->data, log_tmp_entry->size);
-                msg_buf_index+=log_tmp_entry->size;
+        list_for_each_entry(entry, &(cur_sl->data.list), list) {
+            if (entry->dir != dir)
+                continue;
 
-                //snprintf(msg_buf, log_tmp_entry->size, "%s", (char *)log_tmp_entry->data);
-            }
-*/
+            n = snprintf(line, SZARR(line), "%llu.%06llu %u\n",
+                    (unsigned long long) (entry->delta_us - prev_us) / 1000000,
+                    (unsigned long long) (entry->delta_us - prev_us) % 1000000,
+                    entry->size);
+            out_write(&out, tm_name, line, n);
+            out_write(&out, ts_name, entry->data, entry->size);
+            prev_us = entry->delta_us;
         }
-        fclose(fp);
+    }
+
+    return 0;
+}
+
+/* Write each session's seek index for replay */
+static int dump_index(void) {
+    Session_List_t *cur_sl = NULL;
+    Index_Header_t hdr;
+    char name[48];
 
+    list_for_each_entry(cur_sl, &sessions, list) {
 
+        if (cur_sl->nb_index == 0)
+            continue;
+
+        snprintf(name, SZARR(name), "%d-%d-%d.idx", cur_sl->uid,
+                cur_sl->pid, cur_sl->ip);
+        if (out_truncate(&out, name) < 0) {
+            parser_err("Opening of file %s is failed: %d\r\n", name, errno);
+            return -1;
+        }
+
+        memset(&hdr, 0, sizeof (hdr));
+        hdr.magic = INDEX_MAGIC;
+        hdr.ip = cur_sl->ip;
+        hdr.sid = cur_sl->sid;
+        hdr.uid = cur_sl->uid;
+        hdr.pid = cur_sl->pid;
+        hdr.dir = cur_sl->has_output ? OUTPUT_DIR : INPUT_DIR;
+        hdr.base_us = cur_sl->base_us;
+        hdr.last_us = cur_sl->last_us;
+        hdr.last_offset = cur_sl->last_offset;
+        hdr.nb_entries = cur_sl->nb_index;
+
+        out_write(&out, name, &hdr, sizeof (hdr));
+        out_write(&out, name, cur_sl->index,
+                cur_sl->nb_index * sizeof (Index_Entry_t));
+    }
+
+    return 0;
+}
+
+static void write_command(void *ctx, Session_List_t *cur_sl, uint64_t offset,
+        uint64_t delta_us, const char *line, uint32_t len) {
+    FILE *fp = ctx;
+    Command_Record_t cr;
+
+    cr.ip = cur_sl->ip;
+    cr.sid = cur_sl->sid;
+    cr.uid = cur_sl->uid;
+    cr.pid = cur_sl->pid;
+    cr.time_us = cur_sl->base_us + delta_us;
+    cr.offset = offset;
+    cr.len = len;
+
+    fwrite(&cr, sizeof (cr), 1, fp);
+    fwrite(line, len, 1, fp);
+}
+
+/* Write the commands of every session to logfile.cmds, for search */
+static int dump_commands(const char *logfile) {
+    Session_List_t *cur_sl = NULL;
+    Command_Header_t hdr = { COMMAND_MAGIC, 0 };
+    const char *base = strrchr(logfile, '/');
+    char name[256];
+    FILE *fp = NULL;
+
+    snprintf(name, SZARR(name), "%s.cmds", base ? base + 1 : logfile);
+
+    if ((fp = fopen(name, "w")) == NULL) {
+        parser_err("Opening of file %s is failed: %d\r\n", name, errno);
+        return -1;
+    }
+
+    fwrite(&hdr, sizeof (hdr), 1, fp);
+
+    list_for_each_entry(cur_sl, &sessions, list)
+        rebuild_commands(cur_sl, write_command, fp);
+
+    fclose(fp);
+
+    return 0;
+}
+
+static const char *rec_columns[] = { "time", "uid", "pid", "ip", "dir", "len" };
+static const char *cmd_columns[] = { "time", "uid", "pid", "ip", "hash" };
+
+static void column_command(void *ctx, Session_List_t *cur_sl, uint64_t offset,
+        uint64_t delta_us, const char *line, uint32_t len) {
+    Col_Writer_t *cols = ctx;
+
+    (void) offset;
+
+    col_append(&cols[0], cur_sl->base_us + delta_us);
+    col_append(&cols[1], cur_sl->uid);
+    col_append(&cols[2], cur_sl->pid);
+    col_append(&cols[3], cur_sl->ip);
+    col_append(&cols[4], hash64(line, len));
+}
+
+/*
+ * Write the metadata side store for stats into logfile.cols/, see
+ * column.h. Rows go out session by session, so times stay sorted within
+ * long runs and delta encode to a few bits.
+ */
+static int dump_columns(const char *logfile) {
+    Session_List_t *cur_sl = NULL;
+    Log_List_t *entry = NULL;
+    Col_Writer_t rec[SZARR(rec_columns)];
+    Col_Writer_t cmd[SZARR(cmd_columns)];
+    const char *base = strrchr(logfile, '/');
+    char dir[256], name[300];
+    uint32_t i = 0;
+    int ret = 0;
+
+    snprintf(dir, SZARR(dir), "%s.cols", base ? base + 1 : logfile);
+
+    if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) {
+        parser_err("Creating of directory %s is failed: %d\r\n", dir, errno);
+        return -1;
+    }
+
+    for (i = 0; i < SZARR(rec_columns); i++) {
+        snprintf(name, SZARR(name), "%s/rec.%s", dir, rec_columns[i]);
+        if (col_create(&rec[i], name)) {
+            parser_err("Opening of file %s is failed: %d\r\n", name, errno);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < SZARR(cmd_columns); i++) {
+        snprintf(name, SZARR(name), "%s/cmd.%s", dir, cmd_columns[i]);
+        if (col_create(&cmd[i], name)) {
+            parser_err("Opening of file %s is failed: %d\r\n", name, errno);
+            return -1;
+        }
+    }
+
+    list_for_each_entry(cur_sl, &sessions, list) {
+        list_for_each_entry(entry, &(cur_sl->data.list), list) {
+            col_append(&rec[0], cur_sl->base_us + entry->delta_us);
+            col_append(&rec[1], cur_sl->uid);
+            col_append(&rec[2], cur_sl->pid);
+            col_append(&rec[3], cur_sl->ip);
+            col_append(&rec[4], entry->dir);
+            col_append(&rec[5], entry->size);
+        }
+
+        rebuild_commands(cur_sl, column_command, cmd);
     }
+
+    for (i = 0; i < SZARR(rec_columns); i++)
+        ret |= col_close(&rec[i]);
+
+    for (i = 0; i < SZARR(cmd_columns); i++)
+        ret |= col_close(&cmd[i]);
+
+    if (ret)
+        parser_err("Writing of columns in %s is failed\r\n", dir);
+
+    return ret;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [--archive file] <logfile>\n"
+            "       %s --follow [--socket path] <segment|directory>\n"
+            "       %s --extract <archive>\n\n",
+            name, name, name);
+    exit(1);
 }
 
 int main(int argc, char *argv[]) {
 
-    int fd_log = 0;
+    static const struct option options[] = {
+        { "follow", no_argument, NULL, 'f' },
+        { "socket", required_argument, NULL, 's' },
+        { "archive", required_argument, NULL, 'a' },
+        { "extract", no_argument, NULL, 'x' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *sock_path = NULL, *archive = NULL;
+    int fd_log = 0, opt = 0, extract = 0;
+
+    settings_load(1);
+
+    while ((opt = getopt_long(argc, argv, "fs:a:x", options, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            follow = 1;
+            break;
+        case 's':
+            sock_path = optarg;
+            break;
+        case 'a':
+            archive = optarg;
+            break;
+        case 'x':
+            extract = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-    if (argc < 2) {
-        fprintf(stderr, "usage: %s <logfile> \n\n", argv[0]);
-        exit(1);
+    if (optind >= argc)
+        usage(argv[0]);
+
+    if (follow) {
+        if (sock_path && open_stream(sock_path) < 0)
+            exit(1);
+        follow_log(argv[optind]);
+        return 0;
+    }
+
+    if (extract) {
+        if (out_extract(argv[optind]) < 0) {
+            parser_err("Extracting of %s is failed\n", argv[optind]);
+            exit(2);
+        }
+        return 0;
     }
 
-    if ((fd_log = open(argv[1], O_RDONLY)) < 0) {
+    if ((fd_log = open(argv[optind], O_RDONLY)) < 0) {
         parser_err("Log file open failed: %d\n", errno);
         exit(1);
     }
 
+    if (out_init(&out, archive) < 0) {
+        parser_err("Opening of file %s is failed: %d\n", archive, errno);
+        exit(1);
+    }
+
     /* parse the logfile */
 
     read_and_decrypt(fd_log);
 
     dump_to_file();
 
+    dump_timing();
+
+    dump_index();
+
+    if (out_close(&out) < 0)
+        parser_err("Writing of the session files is failed\n");
+
+    dump_commands(argv[optind]);
+
+    dump_columns(argv[optind]);
+
     return 0;
 }
@@ -1,8 +1,9 @@
 #include "rc4.h"
 
-void rc4_setup( struct rc4_state *s, unsigned char *key,  int length )
+void rc4_setup( struct rc4_state *s, const unsigned char *key, int length )
 {
-    int i, j, k, *m, a;
+    int i, k;
+    unsigned char j, a, *m;
 
     s->x = 0;
     s->y = 0;
@@ -10,12 +11,12 @@ void rc4_setup( struct rc4_state *s, unsigned char *key,  int length )
 
     for( i = 0; i < 256; i++ )
     {
-        m[i] = i;
+        m[i] = (unsigned char) i;
     }
 
-    j = k = 0;
+    j = 0;
 
-    for( i = 0; i < 256; i++ )
+    for( i = k = 0; i < 256; i++ )
     {
         a = m[i];
         j = (unsigned char) ( j + a + key[k] );
@@ -25,8 +26,9 @@ void rc4_setup( struct rc4_state *s, unsigned char *key,  int length )
 }
 
 void rc4_crypt( struct rc4_state *s, unsigned char *data, int length )
-{ 
-    int i, x, y, *m, a, b;
+{
+    int i;
+    unsigned char x, y, a, b, *m;
 
     x = s->x;
     y = s->y;
@@ -44,3 +46,83 @@ void rc4_crypt( struct rc4_state *s, unsigned char *data, int length )
     s->x = x;
     s->y = y;
 }
+
+/*
+ * Key up to RC4_LANES states at once, all with keys of the same length.
+ * Lanes past n are left alone.
+ */
+void rc4_setup_multi( struct rc4_state *s[], const unsigned char *key[],
+                      int length, int n )
+{
+    int i, k, l;
+    unsigned char j[RC4_LANES], a, *m;
+
+    if( n > RC4_LANES ) n = RC4_LANES;
+
+    for( l = 0; l < n; l++ )
+    {
+        s[l]->x = 0;
+        s[l]->y = 0;
+        j[l] = 0;
+        for( i = 0; i < 256; i++ )
+        {
+            s[l]->m[i] = (unsigned char) i;
+        }
+    }
+
+    for( i = k = 0; i < 256; i++ )
+    {
+        for( l = 0; l < n; l++ )
+        {
+            m = s[l]->m;
+            a = m[i];
+            j[l] = (unsigned char) ( j[l] + a + key[l][k] );
+            m[i] = m[j[l]]; m[j[l]] = a;
+        }
+        if( ++k >= length ) k = 0;
+    }
+}
+
+/*
+ * Run up to RC4_LANES streams over their own buffers. The common length
+ * goes in lockstep, whatever is left of the longer ones one at a time.
+ */
+void rc4_crypt_multi( struct rc4_state *s[], unsigned char *data[],
+                      const int length[], int n )
+{
+    int i, l, common;
+    unsigned char x[RC4_LANES], y[RC4_LANES], a, b, *m;
+
+    if( n > RC4_LANES ) n = RC4_LANES;
+    if( n <= 0 ) return;
+
+    common = length[0];
+
+    for( l = 0; l < n; l++ )
+    {
+        x[l] = s[l]->x;
+        y[l] = s[l]->y;
+        if( length[l] < common ) common = length[l];
+    }
+
+    for( i = 0; i < common; i++ )
+    {
+        for( l = 0; l < n; l++ )
+        {
+            m = s[l]->m;
+            x[l] = (unsigned char) ( x[l] + 1 ); a = m[x[l]];
+            y[l] = (unsigned char) ( y[l] + a );
+            m[x[l]] = b = m[y[l]];
+            m[y[l]] = a;
+            data[l][i] ^= m[(unsigned char) ( a + b )];
+        }
+    }
+
+    for( l = 0; l < n; l++ )
+    {
+        s[l]->x = x[l];
+        s[l]->y = y[l];
+        if( length[l] > common )
+            rc4_crypt( s[l], data[l] + common, length[l] - common );
+    }
+}
@@ -1,12 +1,30 @@
 #ifndef _RC4_H
 #define _RC4_H
 
+/*
+ * The state is kept in bytes: the whole S-box is 256 bytes, four cache
+ * lines, instead of 1 KiB of ints.
+ *
+ * Every RC4 step depends on the one before, so a single stream mostly
+ * waits on its own table loads. The _multi calls advance up to
+ * RC4_LANES independent streams in lockstep, one step of each in turn,
+ * which lets the loads of different streams overlap; for many short
+ * packets, where the key schedule dominates, that is most of the cost.
+ */
+
+#define RC4_LANES 4
+
 struct rc4_state
 {
-    int x, y, m[256];
+    unsigned char x, y, m[256];
 };
 
-void rc4_setup( struct rc4_state *s, unsigned char *key,  int length );
+void rc4_setup( struct rc4_state *s, const unsigned char *key, int length );
 void rc4_crypt( struct rc4_state *s, unsigned char *data, int length );
 
+void rc4_setup_multi( struct rc4_state *s[], const unsigned char *key[],
+                      int length, int n );
+void rc4_crypt_multi( struct rc4_state *s[], unsigned char *data[],
+                      const int length[], int n );
+
 #endif /* rc4.h */
@@ -0,0 +1,192 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "record.h"
+
+int varint_put(uint8_t *buf, uint64_t v) {
+    int n = 0;
+
+    while (v >= 0x80) {
+	buf[n++] = (uint8_t) v | 0x80;
+	v >>= 7;
+    }
+    buf[n++] = (uint8_t) v;
+
+    return n;
+}
+
+/* Returns the number of bytes consumed, -1 on a truncated or overlong varint */
+int varint_get(const uint8_t *buf, uint32_t len, uint64_t *v) {
+    uint32_t n = 0;
+    int shift = 0;
+
+    *v = 0;
+
+    while (n < len && n < VARINT_MAX_SZ) {
+	*v |= (uint64_t) (buf[n] & 0x7F) << shift;
+	if ((buf[n++] & 0x80) == 0)
+	    return n;
+	shift += 7;
+    }
+
+    return -1;
+}
+
+int frame_start(uint8_t *buf, uint8_t flags) {
+    memset(buf, 0, FRAME_HDR_SZ - 1);
+    FRAME_FLAGS(buf) = FRAME_V2 | FRAME_F_SEQ | flags;
+
+    return FRAME_HDR_SZ;
+}
+
+int frame_is_v2(const uint8_t *buf, uint32_t len) {
+    static const uint8_t zero[FRAME_HDR_SZ - 1];
+
+    return len >= FRAME_HDR_SZ &&
+	    memcmp(buf, zero, FRAME_HDR_SZ - 1) == 0 &&
+	    (FRAME_FLAGS(buf) & FRAME_VERSION_MASK) == FRAME_V2;
+}
+
+int frame_put_slowdown(uint8_t *buf, uint32_t hold_ms, uint64_t sent_ms) {
+    int n = frame_start(buf, FRAME_F_SLOWDOWN);
+
+    n += varint_put(&buf[n], hold_ms);
+    n += varint_put(&buf[n], sent_ms);
+
+    return n;
+}
+
+int frame_get_slowdown(const uint8_t *buf, uint32_t len, uint32_t *hold_ms,
+	uint64_t *sent_ms) {
+    uint64_t v = 0;
+    int n = FRAME_HDR_SZ, r = 0;
+
+    if (!frame_is_v2(buf, len) || !(FRAME_FLAGS(buf) & FRAME_F_SLOWDOWN))
+	return -1;
+
+    if ((r = varint_get(&buf[n], len - n, &v)) <= 0)
+	return -1;
+    *hold_ms = v;
+    n += r;
+
+    if ((r = varint_get(&buf[n], len - n, sent_ms)) <= 0)
+	return -1;
+
+    return 0;
+}
+
+int record_put_open(uint8_t *buf, const Record_Open_t *ro) {
+    int n = 0;
+
+    n += varint_put(&buf[n], (uint64_t) ro->sid << 1 | REC_OPEN);
+    n += varint_put(&buf[n], ro->uid);
+    n += varint_put(&buf[n], ro->pid);
+    n += varint_put(&buf[n], ro->base_us);
+
+    return n;
+}
+
+int record_put_data(uint8_t *buf, const Record_Data_t *rd) {
+    int n = 0;
+
+    n += varint_put(&buf[n], (uint64_t) rd->sid << 1 | REC_DATA);
+    n += varint_put(&buf[n], rd->seq);
+    n += varint_put(&buf[n], rd->delta_us);
+    n += varint_put(&buf[n], (uint64_t) rd->len << 1 | (rd->dir & 1));
+    memcpy(&buf[n], rd->data, rd->len);
+
+    return n + rd->len;
+}
+
+int record_data_sz(const Record_Data_t *rd) {
+    uint8_t tmp[REC_DATA_HDR_MAX_SZ];
+    int n = 0;
+
+    n += varint_put(&tmp[n], (uint64_t) rd->sid << 1 | REC_DATA);
+    n += varint_put(&tmp[n], rd->seq);
+    n += varint_put(&tmp[n], rd->delta_us);
+    n += varint_put(&tmp[n], (uint64_t) rd->len << 1 | (rd->dir & 1));
+
+    return n + rd->len;
+}
+
+/*
+ * buf/len cover the records, i.e. the frame without its header, flags
+ * is the version/flags byte of that header.
+ */
+void frame_iter_init(Frame_Iter_t *it, const uint8_t *buf, uint32_t len,
+	uint8_t flags) {
+    it->buf = buf;
+    it->len = len;
+    it->pos = 0;
+    it->has_seq = (flags & FRAME_F_SEQ) != 0;
+}
+
+#define ITER_GET(it, v)                                         \
+    do {                                                        \
+	int __n = varint_get(&(it)->buf[(it)->pos],             \
+		(it)->len - (it)->pos, &(v));                   \
+	if (__n < 0)                                            \
+	    return -1;                                          \
+	(it)->pos += __n;                                       \
+    } while (0)
+
+/*
+ * Decode the next record. Returns 1 and sets kind and ro or rd, 0 at the
+ * end of the frame, -1 if the frame is corrupted.
+ */
+int frame_next(Frame_Iter_t *it, int *kind, Record_Open_t *ro,
+	Record_Data_t *rd) {
+    int ret = frame_next_hdr(it, kind, ro, rd);
+
+    if (ret <= 0 || *kind == REC_OPEN)
+	return ret;
+
+    if (rd->len > it->len - it->pos)
+	return -1;
+
+    rd->data = &it->buf[it->pos];
+    it->pos += rd->len;
+
+    return 1;
+}
+
+/*
+ * frame_next() that stops after the header of a data record: rd->data
+ * is left NULL and the data does not need to be in the buffer, so a
+ * frame prefix is enough. The iterator is then done with.
+ */
+int frame_next_hdr(Frame_Iter_t *it, int *kind, Record_Open_t *ro,
+	Record_Data_t *rd) {
+    uint64_t v = 0;
+
+    if (it->pos >= it->len)
+	return 0;
+
+    ITER_GET(it, v);
+    *kind = v & 1;
+
+    if (*kind == REC_OPEN) {
+	ro->sid = v >> 1;
+	ITER_GET(it, v);
+	ro->uid = v;
+	ITER_GET(it, v);
+	ro->pid = v;
+	ITER_GET(it, ro->base_us);
+	return 1;
+    }
+
+    rd->sid = v >> 1;
+    rd->seq = 0;
+    if (it->has_seq) {
+	ITER_GET(it, v);
+	rd->seq = v;
+    }
+    ITER_GET(it, rd->delta_us);
+    ITER_GET(it, v);
+    rd->dir = v & 1;
+    rd->len = v >> 1;
+    rd->data = NULL;
+
+    return 1;
+}
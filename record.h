@@ -0,0 +1,104 @@
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <stdint.h>
+
+/*
+ * Compact (v2) record encoding.
+ *
+ * A frame starts with FRAME_HDR_SZ bytes: four zero bytes, where a v1
+ * Session_Data_t keeps its non-zero time, followed by a version/flags
+ * byte. The rest is a sequence of records, each one led by a varint
+ * holding the session id and the record kind:
+ *
+ *   open: varint(sid << 1 | 1) varint(uid) varint(pid) varint(base_us)
+ *   data: varint(sid << 1) [varint(seq)] varint(delta_us)
+ *         varint(len << 1 | dir) data
+ *
+ * An open record is sent once per frame for each session that has data
+ * in it, so every datagram still decodes on its own; data records only
+ * carry the time elapsed since the session base.
+ *
+ * In a FRAME_F_SEQ frame, which is every frame frame_start() begins,
+ * data records carry their sequence number in the session: it starts at
+ * 1 and lets readers drop duplicates, restore the order and spot lost
+ * records, see reorder.h. Older frames decode with a zero seq.
+ *
+ * A deflated frame (FRAME_F_DEFLATE) carries varint(raw_len) and the
+ * deflate stream of the records instead.
+ *
+ * A fragment (FRAME_F_FRAG) carries varint(msg_id) varint(index)
+ * varint(count) and a slice of a frame too big for one datagram, the
+ * whole frame header included, see frag.h.
+ *
+ * A merged frame (FRAME_F_MERGED) holds records of several sessions,
+ * see batch.h: its first open record does not describe all of it.
+ *
+ * A slowdown frame (FRAME_F_SLOWDOWN) goes the other way, from the
+ * collector to a client, and holds varint(hold_ms) varint(sent_ms): the
+ * collector is dropping datagrams, coalesce harder for hold_ms. It is
+ * sealed like any other packet and never logged.
+ */
+
+#define FRAME_HDR_SZ 5
+#define FRAME_V2 0x02
+#define FRAME_VERSION_MASK 0x07
+#define FRAME_F_MERGED 0x08
+#define FRAME_F_DEFLATE 0x10
+#define FRAME_F_SLOWDOWN 0x20
+#define FRAME_F_SEQ 0x40
+#define FRAME_F_FRAG 0x80
+
+/* Version/flags byte of a frame */
+#define FRAME_FLAGS(frame) ((frame)[FRAME_HDR_SZ - 1])
+
+#define REC_DATA 0
+#define REC_OPEN 1
+
+#define VARINT_MAX_SZ 10
+#define REC_OPEN_MAX_SZ (4 * VARINT_MAX_SZ)
+#define REC_DATA_HDR_MAX_SZ (4 * VARINT_MAX_SZ)
+
+typedef struct {
+    uint32_t sid;
+    uint32_t uid;
+    uint32_t pid;
+    uint64_t base_us; /* session start, microseconds since the epoch */
+} Record_Open_t;
+
+typedef struct {
+    uint32_t sid;
+    uint64_t delta_us; /* since the session base */
+    uint8_t dir;
+    uint32_t len;
+    const uint8_t *data;
+    uint32_t seq;      /* in the session from 1, 0 when unknown */
+} Record_Data_t;
+
+typedef struct {
+    const uint8_t *buf;
+    uint32_t len;
+    uint32_t pos;
+    int has_seq;
+} Frame_Iter_t;
+
+int varint_put(uint8_t *buf, uint64_t v);
+int varint_get(const uint8_t *buf, uint32_t len, uint64_t *v);
+
+int frame_start(uint8_t *buf, uint8_t flags);
+int frame_is_v2(const uint8_t *buf, uint32_t len);
+int frame_put_slowdown(uint8_t *buf, uint32_t hold_ms, uint64_t sent_ms);
+int frame_get_slowdown(const uint8_t *buf, uint32_t len, uint32_t *hold_ms,
+        uint64_t *sent_ms);
+int record_put_open(uint8_t *buf, const Record_Open_t *ro);
+int record_put_data(uint8_t *buf, const Record_Data_t *rd);
+int record_data_sz(const Record_Data_t *rd);
+
+void frame_iter_init(Frame_Iter_t *it, const uint8_t *buf, uint32_t len,
+        uint8_t flags);
+int frame_next(Frame_Iter_t *it, int *kind, Record_Open_t *ro,
+        Record_Data_t *rd);
+int frame_next_hdr(Frame_Iter_t *it, int *kind, Record_Open_t *ro,
+        Record_Data_t *rd);
+
+#endif /* _RECORD_H */
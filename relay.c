@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "config.h"
+#include "settings.h"
+#include "utils.h"
+#include "packet.h"
+#include "codec.h"
+#include "batch.h"
+
+#define relay_dbg(format, arg...) \
+    SETTINGS_DBG(SETTINGS_DBG_RELAY, format, "RELAY_DBG", ##arg)
+
+#define relay_err(format, arg...) DBG_PRINT_FUNC(format, "RELAY_ERR", ##arg)
+
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;
+    Frame_Batch_t raw;     /* what clients hand us, up to RAW_BATCH_SZ   */
+    Frame_Batch_t split;   /* re-cut of a raw batch that did not deflate */
+    uint64_t opened_ms;    /* when the first record entered the batch    */
+    uint32_t flush_ms;     /* relay_flush_ms, wider after slowdowns      */
+    uint64_t slow_until_ms;
+} Relay_t;
+
+static uint64_t now_ms(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void send_frame(const uint8_t *frame, uint32_t len, void *ctx) {
+    Relay_t *relay = ctx;
+    uint8_t msg[PKT_OVERHEAD + RAW_BATCH_SZ + FRAME_MAX_SZ];
+    int msg_len = 0;
+
+    msg_len = packet_seal(frame, len, msg);
+
+    if (sendto(relay->fd, msg, msg_len, 0, (struct sockaddr *) &relay->addr,
+	    sizeof (relay->addr)) < 0) {
+	relay_err("Upstream send failed: %d\r\n", errno);
+    }
+}
+
+/*
+ * Ship a raw batch upstream. It is deflated when that makes it fit a
+ * single datagram, otherwise it is cut into batch_size frames.
+ */
+static void flush_raw(const uint8_t *frame, uint32_t len, void *ctx) {
+    Relay_t *relay = ctx;
+    uint8_t zbuf[BATCH_SZ];
+    uLongf zlen = 0;
+    int n = 0;
+
+    relay_dbg("Flushing %u records, %u bytes\r\n", relay->raw.nb_records, len);
+
+    n = frame_start(zbuf, FRAME_F_DEFLATE);
+    n += varint_put(&zbuf[n], len - FRAME_HDR_SZ);
+    zlen = settings.batch_size - n;
+
+    if (compress2(&zbuf[n], &zlen, &frame[FRAME_HDR_SZ], len - FRAME_HDR_SZ,
+	    Z_BEST_SPEED) == Z_OK && n + zlen < len) {
+	send_frame(zbuf, n + zlen, relay);
+	return;
+    }
+
+    if (len <= settings.batch_size) {
+	send_frame(frame, len, relay);
+	return;
+    }
+
+    batch_add_frame(&relay->split, frame, len, 0, NULL);
+    batch_flush(&relay->split);
+}
+
+/* Every quiet SLOWDOWN_HOLD_MS halves the flush window again */
+static void flush_decay(Relay_t *relay, uint64_t now) {
+
+    if (relay->flush_ms == settings.relay_flush_ms ||
+	    now < relay->slow_until_ms)
+	return;
+
+    relay->flush_ms /= 2;
+    if (relay->flush_ms < settings.relay_flush_ms)
+	relay->flush_ms = settings.relay_flush_ms;
+
+    relay->slow_until_ms = now + SLOWDOWN_HOLD_MS;
+}
+
+/*
+ * A slowdown from the collector, checked as the client does. Each one
+ * doubles the flush window up to coalesce_max_ms, so batches fill up
+ * and go as fewer, deflated datagrams.
+ */
+static void receive_slowdown(Relay_t *relay, uint64_t now) {
+    uint8_t pkt[MAX_TRANSFER_PKT_SZ];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof (from);
+    uint64_t sent_ms = 0, wall_ms = 0;
+    uint32_t hold_ms = 0, max_ms = 0;
+    int len = 0;
+
+    if ((len = recvfrom(relay->fd, pkt, sizeof (pkt), MSG_DONTWAIT,
+	    (struct sockaddr *) &from, &fromlen)) < MIN_PKT_SZ)
+	return;
+
+    if (from.sin_addr.s_addr != relay->addr.sin_addr.s_addr ||
+	    from.sin_port != relay->addr.sin_port)
+	return;
+
+    if ((len = packet_open(pkt, len)) < 0 ||
+	    frame_get_slowdown(PKT_DATA(pkt), len, &hold_ms, &sent_ms))
+	return;
+
+    wall_ms = now_ms();
+    if (sent_ms + SLOWDOWN_MAX_AGE_MS < wall_ms ||
+	    sent_ms > wall_ms + SLOWDOWN_MAX_AGE_MS)
+	return;
+
+    max_ms = (settings.coalesce_max_ms > settings.relay_flush_ms) ?
+	    settings.coalesce_max_ms : settings.relay_flush_ms;
+
+    relay->flush_ms *= 2;
+    if (relay->flush_ms > max_ms)
+	relay->flush_ms = max_ms;
+
+    relay->slow_until_ms = now + hold_ms;
+
+    relay_dbg("Slowdown, flushing every %u ms\r\n", relay->flush_ms);
+}
+
+static int create_local_socket(void) {
+    struct sockaddr_un addr;
+    int fd = -1, n = 1;
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+	relay_err("Socket creation failed: %d\r\n", errno);
+	return -1;
+    }
+
+    /* trust the kernel, not the record, about who is talking */
+
+    if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &n, sizeof (n)) < 0) {
+	relay_err("Set socket options failed: %d\r\n", errno);
+	close(fd);
+	return -1;
+    }
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, RELAY_SOCKET_PATH, sizeof (addr.sun_path) - 1);
+
+    unlink(RELAY_SOCKET_PATH);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+	relay_err("Bind socket failed: %d\r\n", errno);
+	close(fd);
+	return -1;
+    }
+
+    /* every user's shell wrapper has to be able to reach us */
+
+    chmod(RELAY_SOCKET_PATH, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP |
+	    S_IROTH | S_IWOTH);
+
+    return fd;
+}
+
+static int receive_frame(int fd, uint8_t *frame, struct ucred *cred) {
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    char ctrl[CMSG_SPACE(sizeof (struct ucred))];
+    int len = 0, found = 0;
+
+    iov.iov_base = frame;
+    iov.iov_len = FRAME_MAX_SZ;
+
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof (ctrl);
+
+    if ((len = recvmsg(fd, &msg, 0)) < FRAME_HDR_SZ)
+	return -1;
+
+    if (msg.msg_flags & MSG_TRUNC) {
+	relay_err("Oversized frame dropped\r\n");
+	return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	if (cmsg->cmsg_level == SOL_SOCKET &&
+		cmsg->cmsg_type == SCM_CREDENTIALS) {
+	    memcpy(cred, CMSG_DATA(cmsg), sizeof (*cred));
+	    found = 1;
+	}
+    }
+
+    if (!found) {
+	relay_err("Frame without credentials dropped\r\n");
+	return -1;
+    }
+
+    return len;
+}
+
+int main(void) {
+    int local_fd = -1;
+    int len = 0;
+    int timeout = 0;
+    uint64_t now = 0;
+    struct pollfd pfd[2];
+    struct ucred cred;
+    uint32_t uid = 0;
+    uint8_t frame[FRAME_MAX_SZ];
+    static Relay_t relay;
+
+    if (settings_load(1))
+	exit(1);
+
+    if ((local_fd = create_local_socket()) < 0)
+	exit(1);
+
+    if ((relay.fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+	relay_err("Socket creation failed: %d\r\n", errno);
+	exit(1);
+    }
+
+    relay.addr.sin_family = AF_INET;
+    relay.addr.sin_port = htons(settings.server_port);
+    relay.addr.sin_addr.s_addr = settings.server_ip;
+
+    batch_init(&relay.raw, RAW_BATCH_SZ, flush_raw, &relay);
+    batch_init(&relay.split, settings.batch_size, send_frame, &relay);
+    relay.flush_ms = settings.relay_flush_ms;
+    relay.slow_until_ms = 0;
+
+    if (fork() != 0)
+	exit(0);
+
+    setsid();
+
+    /* slowdowns come back on the socket we send from */
+
+    pfd[0].fd = local_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = relay.fd;
+    pfd[1].events = POLLIN;
+
+    while (1) {
+	timeout = -1;
+	now = now_ms();
+
+	flush_decay(&relay, now);
+
+	if (relay.raw.nb_records) {
+	    timeout = (relay.opened_ms + relay.flush_ms > now) ?
+		    (int) (relay.opened_ms + relay.flush_ms - now) : 0;
+	}
+
+	if (poll(pfd, 2, timeout) <= 0) {
+	    batch_flush(&relay.raw);
+	    continue;
+	}
+
+	if (pfd[1].revents & POLLIN)
+	    receive_slowdown(&relay, now_ms());
+
+	if (!(pfd[0].revents & POLLIN))
+	    continue;
+
+	if ((len = receive_frame(local_fd, frame, &cred)) < 0)
+	    continue;
+
+	if (relay.raw.nb_records == 0)
+	    relay.opened_ms = now_ms();
+
+	/* uid and pid are the kernel's, sessions are bound to the sender */
+
+	uid = cred.uid;
+	if (batch_add_frame(&relay.raw, frame, len, cred.pid, &uid) != 0) {
+	    relay_dbg("Records from pid %d dropped, %llu in all, %llu "
+		    "sessions evicted\r\n", (int) cred.pid,
+		    (unsigned long long) relay.raw.drops,
+		    (unsigned long long) relay.raw.evictions);
+	}
+    }
+
+    return ( 0);
+}
@@ -0,0 +1,144 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "reorder.h"
+
+void reorder_init(Reorder_t *r) {
+    uint32_t i = 0;
+
+    for (i = 0; i < r->nb_held; i++)
+	free(r->held[i]);
+
+    memset(r, 0, sizeof (*r));
+}
+
+/* rd, the record due next, goes through */
+static void advance(Reorder_t *r, const Record_Data_t *rd, uint64_t tag,
+	const Reorder_Handler_t *h) {
+    r->behind = r->behind << 1 | 1;
+    r->next = rd->seq + 1;
+
+    h->data(h->ctx, rd, tag);
+}
+
+/* Let through the held records the window edge has come up to */
+static void release(Reorder_t *r, const Reorder_Handler_t *h) {
+    Reorder_Held_t *hr = NULL;
+    uint32_t i = 0;
+
+    for (i = 0; i < r->nb_held; ) {
+	if (r->held[i]->rd.seq != r->next) {
+	    i++;
+	    continue;
+	}
+
+	hr = r->held[i];
+	r->held[i] = r->held[--r->nb_held];
+	advance(r, &hr->rd, hr->tag, h);
+	free(hr);
+	i = 0;
+    }
+}
+
+/* Stop waiting for the oldest gap: report it and move past it */
+static void skip_gap(Reorder_t *r, const Reorder_Handler_t *h) {
+    uint32_t i = 0, first = 0, gap = 0;
+
+    for (i = 1; i < r->nb_held; i++) {
+	if (r->held[i]->rd.seq < r->held[first]->rd.seq)
+	    first = i;
+    }
+
+    if (h->gap)
+	h->gap(h->ctx, r->held[first]->rd.sid, r->next,
+		r->held[first]->rd.seq - 1);
+
+    gap = r->held[first]->rd.seq - r->next;
+
+    /* the numbers skipped stay clear, they may still come in late */
+
+    r->behind = (gap >= 64) ? 0 : r->behind << gap;
+    r->lost += gap;
+    r->next = r->held[first]->rd.seq;
+
+    release(r, h);
+}
+
+void reorder_push(Reorder_t *r, const Record_Data_t *rd, uint64_t tag,
+	uint64_t now_us, const Reorder_Handler_t *h) {
+    Reorder_Held_t *hr = NULL;
+    uint32_t d = 0, i = 0;
+
+    if (rd->seq == 0) {
+	h->data(h->ctx, rd, tag);
+	return;
+    }
+
+    if (r->next == 0)
+	r->next = rd->seq;
+
+    if (rd->seq == r->next) {
+	advance(r, rd, tag, h);
+	if (r->nb_held)
+	    release(r, h);
+    } else if (rd->seq < r->next) {
+	d = r->next - 1 - rd->seq;
+	if (d < 64 && !(r->behind & (1ULL << d))) {
+	    r->behind |= 1ULL << d;
+	    r->late++;
+	    if (r->lost)
+		r->lost--;
+	    h->data(h->ctx, rd, tag);
+	} else {
+	    r->dups++;
+	}
+	return;
+    } else {
+	for (i = 0; i < r->nb_held; i++) {
+	    if (r->held[i]->rd.seq == rd->seq) {
+		r->dups++;
+		return;
+	    }
+	}
+
+	if ((hr = malloc(sizeof (Reorder_Held_t) + rd->len)) == NULL) {
+	    /* no room to wait, let it through out of order */
+	    h->data(h->ctx, rd, tag);
+	    return;
+	}
+
+	memcpy(hr->data, rd->data, rd->len);
+	hr->rd = *rd;
+	hr->rd.data = hr->data;
+	hr->tag = tag;
+
+	if (r->nb_held == 0)
+	    r->held_us = now_us;
+	r->held[r->nb_held++] = hr;
+
+	if (r->nb_held > REORDER_HOLD)
+	    skip_gap(r, h);
+    }
+
+    reorder_expire(r, now_us, h);
+}
+
+/* Skip the oldest gap once it has been waited for REORDER_HOLD_US */
+void reorder_expire(Reorder_t *r, uint64_t now_us,
+	const Reorder_Handler_t *h) {
+    if (r->nb_held && now_us - r->held_us >= REORDER_HOLD_US) {
+	skip_gap(r, h);
+	r->held_us = now_us;
+    }
+}
+
+/* The session is over, or the reader is: give up on every gap */
+void reorder_flush(Reorder_t *r, const Reorder_Handler_t *h) {
+    while (r->nb_held)
+	skip_gap(r, h);
+}
@@ -0,0 +1,63 @@
+#ifndef _REORDER_H
+#define _REORDER_H
+
+#include <stdint.h>
+
+/*
+ * Per-session reorder window over the sequence numbers of data records
+ * (see FRAME_F_SEQ in record.h), between decoding and whatever rebuilds
+ * the session.
+ *
+ * Records arriving in order go straight through, at the cost of one
+ * compare. A record from ahead is held back, up to REORDER_HOLD of them,
+ * until the gap before it fills. When the holding room runs out, or the
+ * oldest held record has waited REORDER_HOLD_US, the gap is given up:
+ * it is reported as lost and the held records go through in order.
+ * Records behind the window edge go through late if they were never
+ * seen, a bitmap of the last 64 numbers tells them from duplicates;
+ * duplicates and anything older are dropped. Records with no number
+ * (seq 0) are not touched.
+ *
+ * Include config.h first.
+ */
+
+#define REORDER_HOLD    4
+#define REORDER_HOLD_US 500000
+
+typedef struct {
+    Record_Data_t rd;
+    uint64_t tag;
+    uint8_t data[];
+} Reorder_Held_t;
+
+typedef struct {
+    uint32_t next;       /* next number due, 0 before the first record */
+    uint32_t nb_held;
+    uint64_t behind;     /* bit i set: next - 1 - i went through */
+    uint64_t held_us;    /* when the oldest held record came in */
+    Reorder_Held_t *held[REORDER_HOLD + 1];
+    uint32_t dups;
+    uint32_t late;
+    uint32_t lost;       /* given up on and not seen since */
+} Reorder_t;
+
+/* tag is handed back with the record, e.g. where it was read from */
+typedef void (*reorder_data_cb)(void *ctx, const Record_Data_t *rd,
+        uint64_t tag);
+typedef void (*reorder_gap_cb)(void *ctx, uint32_t sid, uint32_t first,
+        uint32_t last);
+
+typedef struct {
+    reorder_data_cb data;
+    reorder_gap_cb gap;  /* may be NULL */
+    void *ctx;
+} Reorder_Handler_t;
+
+void reorder_init(Reorder_t *r);
+void reorder_push(Reorder_t *r, const Record_Data_t *rd, uint64_t tag,
+        uint64_t now_us, const Reorder_Handler_t *h);
+void reorder_expire(Reorder_t *r, uint64_t now_us,
+        const Reorder_Handler_t *h);
+void reorder_flush(Reorder_t *r, const Reorder_Handler_t *h);
+
+#endif /* _REORDER_H */
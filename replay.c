@@ -0,0 +1,195 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+
+#include "config.h"
+#include "logread.h"
+
+#define replay_err(format, arg...) DBG_PRINT_FUNC(format, "REPLAY_ERR", ##arg)
+
+typedef struct {
+    Index_Header_t hdr;
+    uint8_t dir;
+    double speed;      /* 0 plays everything at once */
+    uint64_t start_us; /* session time to start playing from */
+    uint64_t prev_us;  /* last record played */
+} Replay_t;
+
+static int load_index(const char *path, Index_Header_t *hdr,
+	Index_Entry_t **entries) {
+    struct stat st;
+    int fd = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+	replay_err("Index open failed: %d\n", errno);
+	return -1;
+    }
+
+    if (read(fd, hdr, sizeof (*hdr)) != sizeof (*hdr) ||
+	    hdr->magic != INDEX_MAGIC || hdr->nb_entries == 0 ||
+	    (uint64_t) st.st_size != sizeof (*hdr) +
+	    (uint64_t) hdr->nb_entries * sizeof (Index_Entry_t)) {
+	replay_err("Invalid index file %s\n", path);
+	close(fd);
+	return -1;
+    }
+
+    *entries = malloc(hdr->nb_entries * sizeof (Index_Entry_t));
+
+    if (*entries == NULL || read(fd, *entries, hdr->nb_entries *
+	    sizeof (Index_Entry_t)) != (ssize_t) (hdr->nb_entries *
+	    sizeof (Index_Entry_t))) {
+	replay_err("Index read failed: %d\n", errno);
+	close(fd);
+	return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/* Last entry at or before delta_us, so seeking never scans the log */
+static const Index_Entry_t *seek_index(const Index_Entry_t *entries,
+	uint32_t nb, uint64_t delta_us) {
+    uint32_t lo = 0, hi = nb;
+
+    while (hi - lo > 1) {
+	uint32_t mid = lo + (hi - lo) / 2;
+
+	if (entries[mid].delta_us <= delta_us)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+
+    return &entries[lo];
+}
+
+static void on_open(void *ctx, uint32_t ip, const Record_Open_t *ro) {
+    (void) ctx;
+    (void) ip;
+    (void) ro;
+}
+
+static void on_data(void *ctx, uint32_t ip, const Record_Data_t *rd) {
+    Replay_t *rp = ctx;
+    struct timespec ts;
+    uint64_t wait_us = 0;
+
+    if (ip != rp->hdr.ip || rd->sid != rp->hdr.sid || rd->dir != rp->dir ||
+	    rd->delta_us < rp->start_us)
+	return;
+
+    if (rp->speed > 0 && rd->delta_us > rp->prev_us) {
+	wait_us = (rd->delta_us - rp->prev_us) / rp->speed;
+	ts.tv_sec = wait_us / 1000000;
+	ts.tv_nsec = (wait_us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+    }
+
+    if (rd->delta_us > rp->prev_us)
+	rp->prev_us = rd->delta_us;
+
+    write(1, rd->data, rd->len);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s speed] [-t seconds] [-i|-o] <logfile> <index>\n\n"
+	    "  -s  playback speed factor, 0 dumps without delays (default 1)\n"
+	    "  -t  start that many seconds into the session\n"
+	    "  -i  play the keystrokes\n"
+	    "  -o  play the terminal output\n\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    static uint8_t buffer[MAX_STORED_PKT_SZ];
+    static Frag_Table_t frags;
+    Replay_t rp;
+    Index_Entry_t *entries = NULL;
+    const Index_Entry_t *entry = NULL;
+    Log_Handler_t handler = { on_open, on_data, &rp, &frags };
+    uint8_t *plain = NULL;
+    uint32_t ip = 0;
+    off_t offset = 0;
+    double seek = 0;
+    int dir = -1;
+    int opt = 0, fd = -1, len = 0;
+
+    rp.speed = 1;
+
+    while ((opt = getopt(argc, argv, "s:t:io")) != -1) {
+	switch (opt) {
+	    case 's':
+		rp.speed = atof(optarg);
+		break;
+	    case 't':
+		seek = atof(optarg);
+		break;
+	    case 'i':
+		dir = INPUT_DIR;
+		break;
+	    case 'o':
+		dir = OUTPUT_DIR;
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+
+    if (argc - optind != 2 || rp.speed < 0 || seek < 0)
+	usage(argv[0]);
+
+    if (load_index(argv[optind + 1], &rp.hdr, &entries))
+	exit(1);
+
+    rp.dir = (dir < 0) ? rp.hdr.dir : dir;
+    rp.start_us = entries[0].delta_us + (uint64_t) (seek * 1000000);
+    rp.prev_us = rp.start_us;
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0) {
+	replay_err("Log file open failed: %d\n", errno);
+	exit(1);
+    }
+
+    entry = seek_index(entries, rp.hdr.nb_entries, rp.start_us);
+
+    if ((offset = lseek(fd, entry->offset, SEEK_SET)) < 0) {
+	replay_err("Log file seek failed: %d\n", errno);
+	exit(1);
+    }
+
+    /*
+     * play until the packet holding the session's last record, and the
+     * rest of its frame if that one was fragmented
+     */
+
+    while (offset <= (off_t) rp.hdr.last_offset ||
+	    frag_pending(&frags, rp.hdr.ip)) {
+	if ((len = log_read_packet(fd, buffer, &ip, &plain)) == LOG_EOF)
+	    break;
+
+	if (len == LOG_ERR)
+	    exit(2);
+
+	if (len != LOG_BAD_PKT)
+	    log_decode(plain, len, ip, &handler);
+
+	offset = lseek(fd, 0, SEEK_CUR);
+    }
+
+    frag_free(&frags);
+    free(entries);
+    close(fd);
+
+    return 0;
+}
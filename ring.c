@@ -0,0 +1,288 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <grp.h>
+
+#include "config.h"
+#include "ring.h"
+
+#define RING_SZ (sizeof (Ring_t) + RING_SLOTS * sizeof (Ring_Slot_t))
+
+/* Slot seq while the producer of ticket pos copies its frame in */
+#define RING_WRITING(pos) ((uint32_t) (pos) - 1)
+
+static uint64_t ring_now_ms(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* The collector creates the segment for gid, producers only open it */
+static Ring_t *ring_map(int flags, gid_t gid) {
+    Ring_t *ring = NULL;
+    int fd = -1;
+
+    if ((fd = shm_open(RING_SHM_NAME, flags, 0)) < 0)
+	return NULL;
+
+    if ((flags & O_CREAT) && (fchown(fd, -1, gid) ||
+	    fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) ||
+	    ftruncate(fd, RING_SZ))) {
+	close(fd);
+	shm_unlink(RING_SHM_NAME);
+	return NULL;
+    }
+
+    ring = mmap(NULL, RING_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return (ring == MAP_FAILED) ? NULL : ring;
+}
+
+/*
+ * Collector side: (re)create the ring, dropping whatever was left in it.
+ * Fails with ENOENT when RING_GROUP does not exist.
+ */
+Ring_t *ring_create(void) {
+    struct group *gr = NULL;
+    Ring_t *ring = NULL;
+    uint32_t i = 0;
+
+    shm_unlink(RING_SHM_NAME);
+
+    errno = 0;
+    if ((gr = getgrnam(RING_GROUP)) == NULL) {
+	if (errno == 0)
+	    errno = ENOENT;
+	return NULL;
+    }
+
+    if ((ring = ring_map(O_RDWR | O_CREAT | O_EXCL, gr->gr_gid)) == NULL)
+	return NULL;
+
+    ring->nb_slots = RING_SLOTS;
+    ring->head = ring->tail = 0;
+    ring->drops = ring->skips = 0;
+    ring->stuck_ms = 0;
+
+    for (i = 0; i < RING_SLOTS; i++)
+	ring->slots[i].seq = i;
+
+    ring->alive_ms = ring_now_ms();
+    __atomic_store_n(&ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+    return ring;
+}
+
+/* Producer side: attach to a live collector's ring */
+Ring_t *ring_attach(void) {
+    Ring_t *ring = NULL;
+
+    if ((ring = ring_map(O_RDWR, -1)) == NULL)
+	return NULL;
+
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != RING_MAGIC ||
+	    ring->nb_slots != RING_SLOTS) {
+	ring_detach(ring);
+	return NULL;
+    }
+
+    return ring;
+}
+
+void ring_detach(Ring_t *ring) {
+    if (ring != NULL)
+	munmap(ring, RING_SZ);
+}
+
+/*
+ * Returns 0 once the record is queued, -1 when the ring is full or the
+ * collector stopped draining it; the caller then picks another transport.
+ */
+int ring_push(Ring_t *ring, const uint8_t *frame, uint32_t len) {
+    Ring_Slot_t *slot = NULL;
+    uint64_t pos = 0;
+    uint32_t expected = 0;
+    int32_t dif = 0;
+
+    if (len > FRAME_MAX_SZ || ring_now_ms() - ring->alive_ms > RING_STALE_MS)
+	return -1;
+
+    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    while (1) {
+	slot = &ring->slots[pos & (RING_SLOTS - 1)];
+	dif = (int32_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+		(uint32_t) pos);
+
+	if (dif == 0) {
+	    if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+		    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	} else if (dif < 0 &&
+		__atomic_load_n(&ring->head, __ATOMIC_RELAXED) == pos) {
+	    __atomic_add_fetch(&ring->drops, 1, __ATOMIC_RELAXED);
+	    return -1;
+	} else {
+	    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+    }
+
+    /*
+     * The collector may have given the slot up while we were away, and
+     * another producer taken it since: only write it once it is marked
+     * as being written, which the collector does not take back.
+     */
+
+    expected = (uint32_t) pos;
+    if (!__atomic_compare_exchange_n(&slot->seq, &expected,
+	    RING_WRITING(pos), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	return -1;
+
+    memcpy(slot->frame, frame, len);
+    slot->len = len;
+
+    __atomic_store_n(&slot->seq, (uint32_t) (pos + 1), __ATOMIC_RELEASE);
+
+    /* only pay for a syscall when the collector sleeps */
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED)) {
+	__atomic_add_fetch(&ring->futex, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &ring->futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+
+    return 0;
+}
+
+/* Whether the slot at tail is claimed but not published yet */
+static int ring_stuck(Ring_t *ring) {
+    uint64_t pos = ring->tail;
+    Ring_Slot_t *slot = &ring->slots[pos & (RING_SLOTS - 1)];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != pos &&
+	    (seq == (uint32_t) pos || seq == RING_WRITING(pos));
+}
+
+/*
+ * Give up the slot at tail once it has been claimed and left unwritten
+ * for RING_CLAIM_MS. Returns 1 when it did. A slot being written is
+ * never given up: its producer could still be copying into it.
+ */
+static int ring_skip(Ring_t *ring) {
+    uint64_t pos = ring->tail, now = 0;
+    Ring_Slot_t *slot = &ring->slots[pos & (RING_SLOTS - 1)];
+    uint32_t expected = (uint32_t) pos;
+
+    if (!ring_stuck(ring)) {
+	ring->stuck_ms = 0;
+	return 0;
+    }
+
+    now = ring_now_ms();
+    if (ring->stuck_ms == 0)
+	ring->stuck_ms = now;
+    if (now - ring->stuck_ms < RING_CLAIM_MS)
+	return 0;
+
+    /* the producer publishing right now wins */
+
+    if (!__atomic_compare_exchange_n(&slot->seq, &expected,
+	    (uint32_t) (pos + RING_SLOTS), 0, __ATOMIC_ACQ_REL,
+	    __ATOMIC_ACQUIRE))
+	return 0;
+
+    __atomic_add_fetch(&ring->skips, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, pos + 1, __ATOMIC_RELEASE);
+    ring->stuck_ms = 0;
+
+    return 1;
+}
+
+/* Single consumer: returns the frame length, 0 if the ring is empty */
+int ring_pop(Ring_t *ring, uint8_t *frame) {
+    Ring_Slot_t *slot = NULL;
+    uint64_t pos = ring->tail;
+    uint32_t len = 0;
+
+    slot = &ring->slots[pos & (RING_SLOTS - 1)];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != (uint32_t) (pos + 1)) {
+	if (!ring_skip(ring))
+	    return 0;
+
+	pos = ring->tail;
+	slot = &ring->slots[pos & (RING_SLOTS - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+		(uint32_t) (pos + 1))
+	    return 0;
+    }
+
+    ring->stuck_ms = 0;
+
+    len = slot->len;
+    if (len > FRAME_MAX_SZ)
+	len = 0;
+
+    memcpy(frame, slot->frame, len);
+
+    __atomic_store_n(&slot->seq, (uint32_t) (pos + RING_SLOTS), __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->tail, pos + 1, __ATOMIC_RELEASE);
+
+    return len;
+}
+
+/* Let producers know the collector is still draining the ring */
+void ring_heartbeat(Ring_t *ring) {
+    ring->alive_ms = ring_now_ms();
+}
+
+/*
+ * Sleep until a producer publishes something or timeout_ms elapses. A
+ * stuck ring gets no heartbeat and is looked at again after
+ * RING_CLAIM_MS.
+ */
+void ring_wait(Ring_t *ring, int timeout_ms) {
+    struct timespec ts;
+    Ring_Slot_t *slot = NULL;
+    uint32_t val = 0;
+    int stuck = ring_stuck(ring);
+
+    if (stuck && timeout_ms > RING_CLAIM_MS)
+	timeout_ms = RING_CLAIM_MS;
+    else if (!stuck)
+	ring_heartbeat(ring);
+
+    val = __atomic_load_n(&ring->futex, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    slot = &ring->slots[ring->tail & (RING_SLOTS - 1)];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+	    (uint32_t) (ring->tail + 1)) {
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	syscall(SYS_futex, &ring->futex, FUTEX_WAIT, val, &ts, NULL, 0);
+    }
+
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+
+    if (!ring_stuck(ring))
+	ring_heartbeat(ring);
+}
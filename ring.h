@@ -0,0 +1,60 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <stdint.h>
+
+/*
+ * Multi-producer / single-consumer ring of v2 client frames in POSIX
+ * shared memory. Producers (shell wrappers) claim slots with a CAS
+ * on head and publish them through the per-slot sequence number; the
+ * collector drains them in order. A futex is only touched when the
+ * collector is actually asleep, so a busy ring costs no syscalls at all.
+ *
+ * Nothing in the ring is checked against the kernel, the uid in an open
+ * record is taken as written. So the segment is only readable and
+ * writable by RING_GROUP: the client binary is installed setgid to it,
+ * attaches, then drops the group before the user's shell starts.
+ * Without the group the collector runs without a ring and clients use
+ * the relay, which has the kernel's credentials.
+ *
+ * A producer that dies between claiming a slot and publishing it would
+ * stop the ring there. After RING_CLAIM_MS the collector gives the slot
+ * up, counting it in skips, and stops the heartbeat meanwhile so that
+ * new clients go elsewhere. Producers only copy a frame in after moving
+ * the slot to a writing state with one CAS, so one that comes back
+ * finds its slot gone and sends the record another way, without
+ * touching the frame of whoever took the slot next. A slot already
+ * being written is never given up.
+ */
+
+#define RING_MAGIC 0x53484C52 /* "SHLR" */
+
+typedef struct {
+    volatile uint32_t seq;
+    uint32_t len;
+    uint8_t frame[FRAME_MAX_SZ];
+} Ring_Slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t nb_slots;
+    volatile uint64_t alive_ms; /* collector heartbeat */
+    volatile uint64_t drops;    /* records lost on a full ring */
+    volatile uint32_t waiting;  /* collector is asleep on futex */
+    volatile uint32_t futex;
+    volatile uint64_t skips;    /* slots given up, see RING_CLAIM_MS */
+    uint64_t stuck_ms;          /* collector only: when tail got stuck */
+    volatile uint64_t head __attribute__((aligned(64)));
+    volatile uint64_t tail __attribute__((aligned(64)));
+    Ring_Slot_t slots[] __attribute__((aligned(64)));
+} Ring_t;
+
+Ring_t *ring_create(void);
+Ring_t *ring_attach(void);
+void ring_detach(Ring_t *ring);
+int ring_push(Ring_t *ring, const uint8_t *frame, uint32_t len);
+int ring_pop(Ring_t *ring, uint8_t *frame);
+void ring_heartbeat(Ring_t *ring);
+void ring_wait(Ring_t *ring, int timeout_ms);
+
+#endif /* _RING_H */
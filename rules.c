@@ -0,0 +1,520 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <time.h>
+#include <errno.h>
+
+#include "config.h"
+#include "utils.h"
+#include "packet.h"
+#include "codec.h"
+#include "logread.h"
+#include "metrics.h"
+#include "reorder.h"
+#include "rules.h"
+
+#define rules_err(format, arg...) DBG_PRINT_FUNC(format, "RULES_ERR", ##arg)
+
+#define NO_RULE ((uint32_t) -1)
+#define MAX_STATES 65536 /* transitions are uint16_t */
+
+typedef struct {
+    char name[RULES_NAME_SZ];
+    int is_regex;
+    regex_t re;
+    char *literal;    /* fed to the automaton, NULL when none */
+    uint32_t len;
+    uint32_t next;    /* next rule ending at the same state */
+} Rule_t;
+
+static Rule_t *rules = NULL;
+static uint32_t nb_rules = 0;
+static uint32_t *always = NULL; /* regexes with no literal run */
+static uint32_t nb_always = 0;
+
+static uint8_t byte_class[256];
+static uint32_t nb_classes = 0;
+static uint16_t *delta = NULL;     /* nb_states x nb_classes */
+static uint16_t *out_state = NULL; /* state itself or nearest fail with rules */
+static uint16_t *out_link = NULL;  /* next state down that chain */
+static uint32_t *out_first = NULL; /* first rule ending right there */
+static uint32_t nb_states = 0;
+
+static int alert_fd = -1;
+static struct sockaddr_un alert_addr;
+
+static void longest_run(void *ctx, const char *s, uint32_t len) {
+    Rule_t *r = ctx;
+
+    if (len <= r->len)
+	return;
+
+    free(r->literal);
+    if ((r->literal = malloc(len)) == NULL) {
+	rules_err("Memory allocation error\n");
+	exit(1);
+    }
+    memcpy(r->literal, s, len);
+    r->len = len;
+}
+
+static int parse_rule(char *line, Rule_t *r) {
+    char *name = NULL, *pat = NULL, *end = NULL;
+    int err = 0;
+
+    memset(r, 0, sizeof (*r));
+
+    name = line + strspn(line, " \t");
+    if (*name == '#' || *name == '\0')
+	return 0;
+
+    pat = name + strcspn(name, " \t");
+    if (*pat == '\0')
+	return -1;
+    *pat++ = '\0';
+    pat += strspn(pat, " \t");
+
+    end = pat + strlen(pat);
+    while (end > pat && (end[-1] == ' ' || end[-1] == '\t'))
+	*--end = '\0';
+    if (end == pat)
+	return -1;
+
+    snprintf(r->name, sizeof (r->name), "%s", name);
+
+    if (end - pat >= 2 && pat[0] == '/' && end[-1] == '/') {
+	end[-1] = '\0';
+	pat++;
+	if ((err = regcomp(&r->re, pat, REG_EXTENDED | REG_NOSUB))) {
+	    rules_err("Rule %s: bad regex %s: %d\n", r->name, pat, err);
+	    return -1;
+	}
+	r->is_regex = 1;
+	/* bracket expressions are not gated on a literal, to be safe */
+	if (strchr(pat, '[') || regex_runs(pat, longest_run, r) < 0) {
+	    free(r->literal);
+	    r->literal = NULL;
+	    r->len = 0;
+	}
+    } else {
+	longest_run(r, pat, end - pat);
+    }
+
+    return 1;
+}
+
+/*
+ * Compile the literals: bytes no literal uses share class 0, a trie is
+ * built over the classes and turned into a full DFA by filling every
+ * missing edge from the failure state, breadth first.
+ */
+static int build_automaton(void) {
+    uint16_t *fail = NULL, *queue = NULL;
+    uint32_t max_states = 1, head = 0, tail = 0;
+    uint32_t i = 0, j = 0, c = 0, s = 0, t = 0;
+
+    memset(byte_class, 0, sizeof (byte_class));
+    nb_classes = 1;
+
+    for (i = 0; i < nb_rules; i++) {
+	for (j = 0; j < rules[i].len; j++) {
+	    if (byte_class[(uint8_t) rules[i].literal[j]] == 0)
+		byte_class[(uint8_t) rules[i].literal[j]] = nb_classes++;
+	}
+	max_states += rules[i].len;
+    }
+
+    if (max_states > MAX_STATES) {
+	rules_err("Rule literals too long: %u states\n", max_states);
+	return -1;
+    }
+
+    delta = calloc((size_t) max_states * nb_classes, sizeof (uint16_t));
+    out_state = calloc(max_states, sizeof (uint16_t));
+    out_link = calloc(max_states, sizeof (uint16_t));
+    out_first = malloc(max_states * sizeof (uint32_t));
+    fail = calloc(max_states, sizeof (uint16_t));
+    queue = malloc(max_states * sizeof (uint16_t));
+
+    if (!delta || !out_state || !out_link || !out_first || !fail || !queue) {
+	rules_err("Memory allocation error\n");
+	exit(1);
+    }
+
+    memset(out_first, 0xFF, max_states * sizeof (uint32_t));
+    nb_states = 1;
+
+    /* the trie; state 0 is the root and never a child, so 0 is no edge */
+
+    for (i = 0; i < nb_rules; i++) {
+	if (rules[i].literal == NULL)
+	    continue;
+
+	for (s = 0, j = 0; j < rules[i].len; j++) {
+	    c = byte_class[(uint8_t) rules[i].literal[j]];
+	    if (delta[s * nb_classes + c] == 0)
+		delta[s * nb_classes + c] = nb_states++;
+	    s = delta[s * nb_classes + c];
+	}
+
+	rules[i].next = out_first[s];
+	out_first[s] = i;
+    }
+
+    for (c = 0; c < nb_classes; c++) {
+	if ((t = delta[c]))
+	    queue[tail++] = t;
+    }
+
+    while (head < tail) {
+	s = queue[head++];
+
+	out_state[s] = (out_first[s] != NO_RULE) ? s : out_state[fail[s]];
+	out_link[s] = out_state[fail[s]];
+
+	for (c = 0; c < nb_classes; c++) {
+	    t = delta[s * nb_classes + c];
+	    if (t) {
+		fail[t] = delta[fail[s] * nb_classes + c];
+		queue[tail++] = t;
+	    } else {
+		delta[s * nb_classes + c] = delta[fail[s] * nb_classes + c];
+	    }
+	}
+    }
+
+    free(fail);
+    free(queue);
+
+    return 0;
+}
+
+/*
+ * Load the rule file and open the alert output: alert_path is appended
+ * to when given, RULES_SOCKET_PATH gets a datagram per alert otherwise.
+ */
+int rules_load(const char *path, const char *alert_path) {
+    FILE *fp = NULL;
+    char line[1024];
+    int n = 0, ret = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+	rules_err("Rule file %s open failed: %d\n", path, errno);
+	return -1;
+    }
+
+    if ((rules = calloc(RULES_MAX, sizeof (Rule_t))) == NULL ||
+	    (always = calloc(RULES_MAX, sizeof (uint32_t))) == NULL) {
+	rules_err("Memory allocation error\n");
+	exit(1);
+    }
+
+    while (fgets(line, sizeof (line), fp)) {
+	n++;
+	line[strcspn(line, "\r\n")] = '\0';
+
+	if ((ret = parse_rule(line, &rules[nb_rules])) < 0) {
+	    rules_err("%s:%d: invalid rule\n", path, n);
+	    fclose(fp);
+	    return -1;
+	}
+	if (ret == 0)
+	    continue;
+
+	if (rules[nb_rules].literal == NULL)
+	    always[nb_always++] = nb_rules;
+
+	if (++nb_rules == RULES_MAX) {
+	    rules_err("%s: more than %d rules\n", path, RULES_MAX);
+	    break;
+	}
+    }
+
+    fclose(fp);
+
+    if (build_automaton())
+	return -1;
+
+    if (alert_path) {
+	alert_fd = open(alert_path, O_WRONLY | O_CREAT | O_APPEND,
+		S_IRUSR | S_IWUSR);
+    } else {
+	memset(&alert_addr, 0, sizeof (alert_addr));
+	alert_addr.sun_family = AF_UNIX;
+	strncpy(alert_addr.sun_path, RULES_SOCKET_PATH,
+		sizeof (alert_addr.sun_path) - 1);
+	alert_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    }
+
+    if (alert_fd < 0) {
+	rules_err("Alert output open failed: %d\n", errno);
+	return -1;
+    }
+
+    return 0;
+}
+
+Rules_Worker_t *rules_worker(Metrics_Worker_t *m) {
+    Rules_Worker_t *w = NULL;
+
+    if (nb_rules == 0)
+	return NULL;
+
+    if ((w = calloc(1, sizeof (Rules_Worker_t))) == NULL ||
+	    (w->seen = calloc(nb_rules, sizeof (uint32_t))) == NULL) {
+	rules_err("Memory allocation error\n");
+	exit(1);
+    }
+
+    w->metrics = m;
+
+    return w;
+}
+
+static Rules_Session_t *find_session(Rules_Worker_t *w, uint32_t ip,
+	uint32_t sid) {
+    uint32_t h = (ip * 2654435761U ^ sid) * 2246822519U;
+    uint32_t set = h >> (32 - RULES_SET_BITS);
+    Rules_Set_t *s = &w->sets[set];
+    Rules_Session_t *rs = NULL;
+    int i = 0, victim = 0;
+
+    if (++w->clock == 0)
+	w->clock = 1;
+
+    for (i = 0; i < RULES_WAYS; i++) {
+	if (s->stamp[i] && s->ip[i] == ip && s->sid[i] == sid) {
+	    s->stamp[i] = w->clock;
+	    return &w->sessions[set * RULES_WAYS + i];
+	}
+    }
+
+    /* a free way, or the one idle the longest */
+
+    for (i = 0; i < RULES_WAYS; i++) {
+	if (s->stamp[i] == 0) {
+	    victim = i;
+	    break;
+	}
+	if (w->clock - s->stamp[i] > w->clock - s->stamp[victim])
+	    victim = i;
+    }
+
+    s->ip[victim] = ip;
+    s->sid[victim] = sid;
+    s->stamp[victim] = w->clock;
+
+    rs = &w->sessions[set * RULES_WAYS + victim];
+    rs->uid = rs->pid = (uint32_t) -1;
+    rs->base_us = 0;
+    rs->ed.len = 0;
+    rs->ed.esc = 0;
+    reorder_init(&rs->reorder);
+
+    return rs;
+}
+
+static void alert(Rules_Worker_t *w, const Rule_t *r, uint32_t ip,
+	const Rules_Session_t *rs, uint64_t time_us) {
+    char out[COMMAND_MAX_SZ + 256];
+    struct in_addr addr;
+    time_t t = time_us / 1000000;
+    struct tm tm;
+    int n = 0, ret = 0;
+
+    addr.s_addr = ip;
+
+    n = strftime(out, sizeof (out), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+    n += snprintf(&out[n], sizeof (out) - n, " %s %s uid %d pid %d: %s\n",
+	    r->name, inet_ntoa(addr), (int) rs->uid, (int) rs->pid, w->text);
+    if (n > (int) sizeof (out) - 1)
+	n = sizeof (out) - 1;
+
+    if (alert_addr.sun_family)
+	ret = sendto(alert_fd, out, n, MSG_DONTWAIT,
+		(struct sockaddr *) &alert_addr, sizeof (alert_addr));
+    else
+	ret = write(alert_fd, out, n);
+
+    metrics_add(w->metrics, ret == n ? MET_RULE_MATCHES : MET_ALERT_DROPS, 1);
+}
+
+static void check_rule(Rules_Worker_t *w, uint32_t id, uint32_t ip,
+	const Rules_Session_t *rs, uint64_t time_us) {
+    const Rule_t *r = &rules[id];
+
+    if (w->seen[id] == w->gen)
+	return;
+    w->seen[id] = w->gen;
+
+    if (r->is_regex && regexec(&r->re, w->text, 0, NULL, 0))
+	return;
+
+    alert(w, r, ip, rs, time_us);
+}
+
+/* one pass of the DFA over the command, then the regexes it let through */
+static void match_command(Rules_Worker_t *w, uint32_t ip,
+	const Rules_Session_t *rs, uint64_t time_us, uint32_t len) {
+    const uint8_t *p = (const uint8_t *) w->text;
+    uint32_t s = 0, o = 0, id = 0, i = 0;
+
+    if (++w->gen == 0) {
+	memset(w->seen, 0, nb_rules * sizeof (uint32_t));
+	w->gen = 1;
+    }
+
+    for (i = 0; i < len; i++) {
+	s = delta[s * nb_classes + byte_class[p[i]]];
+
+	for (o = out_state[s]; o; o = out_link[o]) {
+	    for (id = out_first[o]; id != NO_RULE; id = rules[id].next)
+		check_rule(w, id, ip, rs, time_us);
+	}
+    }
+
+    for (i = 0; i < nb_always; i++)
+	check_rule(w, always[i], ip, rs, time_us);
+}
+
+static void on_open(void *ctx, uint32_t ip, const Record_Open_t *ro) {
+    Rules_Session_t *rs = find_session(ctx, ip, ro->sid);
+
+    /* a reused session id starts over */
+
+    if (rs->pid != (uint32_t) -1 && rs->base_us != ro->base_us) {
+	rs->ed.len = 0;
+	rs->ed.esc = 0;
+	reorder_init(&rs->reorder);
+    }
+
+    rs->uid = ro->uid;
+    rs->pid = ro->pid;
+    rs->base_us = ro->base_us;
+}
+
+/* A record of w->cur, in order, out of the reorder window */
+static void session_data(void *ctx, const Record_Data_t *rd, uint64_t tag) {
+    Rules_Worker_t *w = ctx;
+    Rules_Session_t *rs = w->cur;
+    uint32_t pos = 0, len = 0;
+
+    (void) tag;
+
+    if (rd->dir != INPUT_DIR)
+	return;
+
+    while ((len = line_feed(&rs->ed, rd->data, rd->len, &pos, 0)) > 0) {
+	memcpy(w->text, rs->ed.line, len);
+	w->text[len] = '\0';
+	match_command(w, w->cur_ip, rs, rs->base_us + rd->delta_us, len);
+    }
+}
+
+static void session_gap(void *ctx, uint32_t sid, uint32_t first,
+	uint32_t last) {
+    Rules_Worker_t *w = ctx;
+
+    (void) sid;
+
+    metrics_add(w->metrics, MET_LOST_RECORDS, last - first + 1);
+}
+
+static void on_data(void *ctx, uint32_t ip, const Record_Data_t *rd) {
+    Rules_Worker_t *w = ctx;
+    Reorder_Handler_t h = { session_data, session_gap, w };
+    Reorder_t *r = NULL;
+    uint32_t dups = 0, late = 0, i = 0;
+
+    w->cur = find_session(w, ip, rd->sid);
+    w->cur_ip = ip;
+
+    r = &w->cur->reorder;
+    dups = r->dups;
+    late = r->late;
+
+    reorder_push(r, rd, 0, w->now_us, &h);
+
+    if (r->nb_held) {
+	i = w->cur - w->sessions;
+	w->holding[i / 64] |= 1ULL << (i % 64);
+    }
+
+    if (r->dups != dups)
+	metrics_add(w->metrics, MET_DUP_RECORDS, 1);
+    if (r->late != late)
+	metrics_add(w->metrics, MET_LATE_RECORDS, 1);
+}
+
+/*
+ * Give up the gaps that held records have waited REORDER_HOLD_US for,
+ * in sessions that went quiet since. Cheap to call often: it looks at
+ * the sessions every REORDER_HOLD_US / 2 at most.
+ */
+void rules_expire(Rules_Worker_t *w) {
+    Reorder_Handler_t h = { session_data, session_gap, w };
+    uint64_t bits = 0;
+    uint32_t i = 0, j = 0;
+
+    w->now_us = metrics_now() / 1000;
+
+    if (w->now_us < w->expire_us)
+	return;
+
+    w->expire_us = w->now_us + REORDER_HOLD_US / 2;
+
+    for (i = 0; i < SZARR(w->holding); i++) {
+	for (bits = w->holding[i]; bits; bits &= bits - 1) {
+	    j = i * 64 + __builtin_ctzll(bits);
+
+	    w->cur = &w->sessions[j];
+	    w->cur_ip = w->sets[j / RULES_WAYS].ip[j % RULES_WAYS];
+
+	    if (w->cur->reorder.nb_held)
+		reorder_expire(&w->cur->reorder, w->now_us, &h);
+
+	    if (w->cur->reorder.nb_held == 0)
+		w->holding[i] &= ~(1ULL << (j % 64));
+	}
+    }
+}
+
+/* Records of a plaintext frame or v1 record, as queued on the ring */
+void rules_frame(Rules_Worker_t *w, uint32_t ip, const uint8_t *plain,
+	uint32_t len) {
+    Log_Handler_t h = { on_open, on_data, w, NULL };
+    uint64_t start = metrics_now();
+
+    w->now_us = start / 1000;
+
+    log_decode(plain, len, ip, &h);
+
+    metrics_time(w->metrics, STAGE_RULES, start);
+}
+
+/* A transfer packet the caller already verified */
+void rules_packet(Rules_Worker_t *w, uint32_t ip, const uint8_t *pkt,
+	uint32_t len) {
+    Log_Handler_t h = { on_open, on_data, w, &w->frag };
+    uint64_t start = metrics_now();
+    int n = 0;
+
+    w->now_us = start / 1000;
+
+    if (len > PKT_OVERHEAD + sizeof (w->plain) ||
+	    (n = packet_decrypt(pkt, len, w->plain)) < 0)
+	return;
+
+    log_decode(w->plain, n, ip, &h);
+
+    metrics_time(w->metrics, STAGE_RULES, start);
+}
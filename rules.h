@@ -0,0 +1,75 @@
+#ifndef _RULES_H
+#define _RULES_H
+
+#include <stdint.h>
+
+/*
+ * Streaming command alerts on the collector. Rules come from a text
+ * file, one per line, '#' starting a comment:
+ *
+ *     name  text        the command contains text
+ *     name  /regex/     the command matches the extended regex
+ *
+ * Every literal, and the longest literal run of every regex, goes into a
+ * single Aho-Corasick automaton compiled to a DFA over byte classes, so
+ * a command is scanned once whatever the number of rules; a regex only
+ * runs when its literal was seen, or on every command when it has none.
+ * Matches are written as text lines to a file, or sent as datagrams to
+ * RULES_SOCKET_PATH.
+ *
+ * Every worker thread owns a Rules_Worker_t holding the line being typed
+ * in each of its sessions, in a 4-way set associative table: a session
+ * lookup touches one cache line, and the least recently active session
+ * of a full set makes room for a new one. Records go through a reorder
+ * window per session first, see reorder.h. Records held there would
+ * wait for the next one of their session, so the thread also calls
+ * rules_expire() as time goes by, even without traffic. Include
+ * config.h, logread.h, metrics.h and reorder.h first.
+ */
+
+#define RULES_MAX       4096
+#define RULES_NAME_SZ   32
+#define RULES_SET_BITS  10   /* 1024 sets of RULES_WAYS sessions */
+#define RULES_WAYS      4
+#define RULES_SESSIONS  ((1 << RULES_SET_BITS) * RULES_WAYS)
+
+typedef struct {
+    uint32_t ip[RULES_WAYS];
+    uint32_t sid[RULES_WAYS];
+    uint32_t stamp[RULES_WAYS]; /* last activity, 0 for a free way */
+} __attribute__((aligned(64))) Rules_Set_t;
+
+typedef struct {
+    uint32_t uid;
+    uint32_t pid;
+    uint64_t base_us;
+    Reorder_t reorder;
+    Line_Editor_t ed;
+} Rules_Session_t;
+
+typedef struct {
+    Metrics_Worker_t *metrics;
+    uint32_t clock;
+    uint32_t gen;             /* command being matched */
+    uint32_t *seen;           /* per rule: last gen it fired in */
+    uint64_t now_us;          /* CLOCK_MONOTONIC, for the reorder windows */
+    uint64_t expire_us;       /* next rules_expire() pass */
+    uint64_t holding[RULES_SESSIONS / 64]; /* sessions with held records */
+    Rules_Session_t *cur;     /* session of the record being decoded */
+    uint32_t cur_ip;
+    Frag_Table_t frag;        /* fragments of the frames of rules_packet() */
+    Rules_Set_t sets[1 << RULES_SET_BITS];
+    Rules_Session_t sessions[RULES_SESSIONS];
+    uint8_t plain[MAX_TRANSFER_PKT_SZ];
+    char text[COMMAND_MAX_SZ + 1];
+} Rules_Worker_t;
+
+int rules_load(const char *path, const char *alert_path);
+Rules_Worker_t *rules_worker(Metrics_Worker_t *m);
+void rules_packet(Rules_Worker_t *w, uint32_t ip, const uint8_t *pkt,
+	uint32_t len);
+void rules_frame(Rules_Worker_t *w, uint32_t ip, const uint8_t *plain,
+	uint32_t len);
+void rules_expire(Rules_Worker_t *w);
+
+#endif /* _RULES_H */
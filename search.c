@@ -0,0 +1,586 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <regex.h>
+
+#include "config.h"
+#include "logread.h"
+
+#define search_err(format, arg...) DBG_PRINT_FUNC(format, "SEARCH_ERR", ##arg)
+
+/*
+ * Command search over the .cmds files the parser leaves next to each
+ * segment. "search -b" merges any number of them into one index:
+ *
+ *   [ header ][ segment names ][ docs ][ command text ]
+ *   [ trigram terms ][ token terms ][ postings ]
+ *
+ * Every command is a doc. Terms are sorted by key and point at a list
+ * of doc ids, delta and varint encoded. Queries only read the postings
+ * of their terms and check the few candidate docs against the text
+ * kept in the index, so the logs themselves are never touched.
+ */
+
+#define SEARCH_MAGIC 0x58434853 /* "SHCX" */
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t nb_segments;
+    uint32_t nb_docs;
+    uint32_t nb_trigrams;
+    uint32_t nb_tokens;
+    uint64_t segments_off;
+    uint64_t docs_off;
+    uint64_t text_off;
+    uint64_t trigrams_off;
+    uint64_t tokens_off;
+    uint64_t postings_off;
+} Search_Header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t segment;
+    uint32_t ip;
+    uint32_t sid;
+    uint32_t uid;
+    uint32_t pid;
+    uint64_t time_us;
+    uint64_t offset;
+    uint64_t text;
+    uint16_t len;
+} Search_Doc_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t key;      /* trigram, or hash64() of the token */
+    uint64_t postings;
+    uint32_t nb_docs;
+} Search_Term_t;
+
+typedef struct {
+    uint64_t key;
+    uint32_t doc;
+} Term_Pair_t;
+
+typedef struct {
+    uint32_t *ids;
+    uint32_t nb;
+} Doc_List_t;
+
+/* growable buffer for the sections being built */
+typedef struct {
+    uint8_t *buf;
+    uint64_t len;
+    uint64_t size;
+} Blob_t;
+
+static void *blob_grow(Blob_t *b, uint64_t len) {
+
+    if (b->len + len > b->size) {
+	b->size = (b->size ? b->size * 2 : 65536) + len;
+	if ((b->buf = realloc(b->buf, b->size)) == NULL) {
+	    search_err("Memory allocation error\n");
+	    exit(1);
+	}
+    }
+
+    b->len += len;
+
+    return &b->buf[b->len - len];
+}
+
+static void blob_put(Blob_t *b, const void *data, uint64_t len) {
+    memcpy(blob_grow(b, len), data, len);
+}
+
+/* shell words: split on blanks and operators, keep paths and flags whole */
+static int is_token_char(uint8_t c) {
+    return c > ' ' && c < 0x7F && strchr("|&;<>()`$'\"{}", c) == NULL;
+}
+
+static uint64_t trigram(const char *s) {
+    return (uint64_t) (uint8_t) s[0] << 16 | (uint8_t) s[1] << 8 | (uint8_t) s[2];
+}
+
+static int cmp_pair(const void *a, const void *b) {
+    const Term_Pair_t *x = a, *y = b;
+
+    if (x->key != y->key)
+	return x->key < y->key ? -1 : 1;
+
+    return (x->doc > y->doc) - (x->doc < y->doc);
+}
+
+static void add_pair(Blob_t *pairs, uint64_t key, uint32_t doc) {
+    Term_Pair_t *p = blob_grow(pairs, sizeof (Term_Pair_t));
+
+    p->key = key;
+    p->doc = doc;
+}
+
+/* Sort the pairs and write one term plus its postings per distinct key */
+static uint32_t build_terms(Blob_t *pairs, Blob_t *terms, Blob_t *postings) {
+    Term_Pair_t *p = (Term_Pair_t *) pairs->buf;
+    uint64_t nb = pairs->len / sizeof (Term_Pair_t), i = 0;
+    Search_Term_t *t = NULL;
+    uint32_t nb_terms = 0, prev = 0;
+    uint8_t varint[VARINT_MAX_SZ];
+
+    qsort(p, nb, sizeof (Term_Pair_t), cmp_pair);
+
+    for (i = 0; i < nb; i++) {
+	if (t == NULL || p[i].key != t->key) {
+	    t = blob_grow(terms, sizeof (Search_Term_t));
+	    t->key = p[i].key;
+	    t->postings = postings->len;
+	    t->nb_docs = 0;
+	    prev = 0;
+	    nb_terms++;
+	} else if (p[i].doc == prev) {
+	    continue;
+	}
+
+	blob_put(postings, varint, varint_put(varint, p[i].doc - prev));
+	prev = p[i].doc;
+	t->nb_docs++;
+    }
+
+    return nb_terms;
+}
+
+static int build_index(const char *index, int nb_files, char *files[]) {
+    Blob_t segments = { 0 }, docs = { 0 }, text = { 0 };
+    Blob_t trigrams = { 0 }, tokens = { 0 }, postings = { 0 };
+    Blob_t tri_pairs = { 0 }, tok_pairs = { 0 };
+    Search_Header_t hdr;
+    Command_Header_t ch;
+    Command_Record_t cr;
+    Search_Doc_t *doc = NULL;
+    char line[COMMAND_MAX_SZ];
+    const char *name = NULL;
+    FILE *fp = NULL;
+    uint32_t i = 0, j = 0, k = 0, nb_docs = 0;
+    int f = 0;
+
+    memset(&hdr, 0, sizeof (hdr));
+
+    for (f = 0; f < nb_files; f++) {
+	if ((fp = fopen(files[f], "r")) == NULL) {
+	    search_err("Opening of file %s is failed: %d\n", files[f], errno);
+	    continue;
+	}
+
+	if (fread(&ch, sizeof (ch), 1, fp) != 1 || ch.magic != COMMAND_MAGIC) {
+	    search_err("%s is not a commands file\n", files[f]);
+	    fclose(fp);
+	    continue;
+	}
+
+	/* the segment is named after its log, without .cmds */
+
+	name = strrchr(files[f], '/') ? strrchr(files[f], '/') + 1 : files[f];
+	i = strlen(name);
+	if (i > 5 && strcmp(&name[i - 5], ".cmds") == 0)
+	    i -= 5;
+	blob_put(&segments, name, i);
+	blob_put(&segments, "", 1);
+
+	while (fread(&cr, sizeof (cr), 1, fp) == 1) {
+	    if (cr.len > COMMAND_MAX_SZ || fread(line, cr.len, 1, fp) != 1)
+		break;
+
+	    doc = blob_grow(&docs, sizeof (Search_Doc_t));
+	    doc->segment = hdr.nb_segments;
+	    doc->ip = cr.ip;
+	    doc->sid = cr.sid;
+	    doc->uid = cr.uid;
+	    doc->pid = cr.pid;
+	    doc->time_us = cr.time_us;
+	    doc->offset = cr.offset;
+	    doc->text = text.len;
+	    doc->len = cr.len;
+	    blob_put(&text, line, cr.len);
+
+	    for (j = 0; j + 3 <= cr.len; j++)
+		add_pair(&tri_pairs, trigram(&line[j]), nb_docs);
+
+	    for (j = 0; j < cr.len; j = k) {
+		while (j < cr.len && !is_token_char(line[j]))
+		    j++;
+		for (k = j; k < cr.len && is_token_char(line[k]); k++)
+		    ;
+		if (k > j)
+		    add_pair(&tok_pairs, hash64(&line[j], k - j), nb_docs);
+	    }
+
+	    nb_docs++;
+	}
+
+	fclose(fp);
+	hdr.nb_segments++;
+    }
+
+    hdr.nb_trigrams = build_terms(&tri_pairs, &trigrams, &postings);
+    hdr.nb_tokens = build_terms(&tok_pairs, &tokens, &postings);
+
+    hdr.magic = SEARCH_MAGIC;
+    hdr.nb_docs = nb_docs;
+    hdr.segments_off = sizeof (hdr);
+    hdr.docs_off = hdr.segments_off + segments.len;
+    hdr.text_off = hdr.docs_off + docs.len;
+    hdr.trigrams_off = hdr.text_off + text.len;
+    hdr.tokens_off = hdr.trigrams_off + trigrams.len;
+    hdr.postings_off = hdr.tokens_off + tokens.len;
+
+    if ((fp = fopen(index, "w")) == NULL) {
+	search_err("Opening of file %s is failed: %d\n", index, errno);
+	return -1;
+    }
+
+    fwrite(&hdr, sizeof (hdr), 1, fp);
+    fwrite(segments.buf, segments.len, 1, fp);
+    fwrite(docs.buf, docs.len, 1, fp);
+    fwrite(text.buf, text.len, 1, fp);
+    fwrite(trigrams.buf, trigrams.len, 1, fp);
+    fwrite(tokens.buf, tokens.len, 1, fp);
+    fwrite(postings.buf, postings.len, 1, fp);
+
+    if (fclose(fp)) {
+	search_err("Writing of file %s is failed: %d\n", index, errno);
+	return -1;
+    }
+
+    printf("%u segments, %u commands, %u trigrams, %u tokens, %llu bytes of postings\n",
+	    hdr.nb_segments, hdr.nb_docs, hdr.nb_trigrams, hdr.nb_tokens,
+	    (unsigned long long) postings.len);
+
+    return 0;
+}
+
+/* ---- queries ---- */
+
+static const uint8_t *idx = NULL;
+static const Search_Header_t *ih = NULL;
+static uint64_t idx_sz = 0;
+
+/* Whether len bytes at off are inside the mapped index */
+static int in_index(uint64_t off, uint64_t len) {
+    return off <= idx_sz && len <= idx_sz - off;
+}
+
+/* The sections the header points at have to fit the file */
+static int check_index(void) {
+    return in_index(ih->segments_off, 0) &&
+	    in_index(ih->docs_off, (uint64_t) ih->nb_docs *
+	    sizeof (Search_Doc_t)) &&
+	    in_index(ih->text_off, 0) &&
+	    in_index(ih->trigrams_off, (uint64_t) ih->nb_trigrams *
+	    sizeof (Search_Term_t)) &&
+	    in_index(ih->tokens_off, (uint64_t) ih->nb_tokens *
+	    sizeof (Search_Term_t)) &&
+	    in_index(ih->postings_off, 0);
+}
+
+static const Search_Term_t *find_term(uint64_t off, uint32_t nb, uint64_t key) {
+    const Search_Term_t *terms = (const Search_Term_t *) &idx[off];
+    uint32_t lo = 0, hi = nb, mid = 0;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (terms[mid].key < key)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return (lo < nb && terms[lo].key == key) ? &terms[lo] : NULL;
+}
+
+/* An empty list, which unlike NULL ids matches nothing */
+static void no_docs(Doc_List_t *l) {
+    if ((l->ids = malloc(sizeof (uint32_t))) == NULL) {
+	search_err("Candidates allocation failed\n");
+	exit(1);
+    }
+    l->nb = 0;
+}
+
+/* A corrupt or truncated index ends the query, it would not be right */
+static void load_postings(const Search_Term_t *t, Doc_List_t *l) {
+    const uint8_t *p = NULL;
+    uint64_t v = 0, left = 0, doc = 0;
+    uint32_t i = 0;
+    int n = 0;
+
+    /* every doc id takes at least a byte */
+
+    if (t->postings > idx_sz - ih->postings_off ||
+	    t->nb_docs > idx_sz - ih->postings_off - t->postings ||
+	    t->nb_docs > ih->nb_docs) {
+	search_err("Corrupt index, postings out of bounds\n");
+	exit(1);
+    }
+
+    p = &idx[ih->postings_off + t->postings];
+    left = idx_sz - ih->postings_off - t->postings;
+
+    if ((l->ids = malloc((t->nb_docs + 1) * sizeof (uint32_t))) == NULL) {
+	search_err("Postings allocation failed\n");
+	exit(1);
+    }
+    l->nb = 0;
+
+    for (i = 0; i < t->nb_docs; i++) {
+	if ((n = varint_get(p, (left > VARINT_MAX_SZ) ? VARINT_MAX_SZ : left,
+		&v)) <= 0 || (doc += v) >= ih->nb_docs) {
+	    search_err("Corrupt index, bad postings\n");
+	    exit(1);
+	}
+	p += n;
+	left -= n;
+	l->ids[l->nb++] = doc;
+    }
+}
+
+/* narrow the candidates (NULL ids: every doc) down to those in l */
+static void intersect(Doc_List_t *cand, const Doc_List_t *l) {
+    uint32_t i = 0, j = 0, n = 0;
+
+    if (cand->ids == NULL) {
+	if ((cand->ids = malloc((l->nb + 1) * sizeof (uint32_t))) == NULL) {
+	    search_err("Candidates allocation failed\n");
+	    exit(1);
+	}
+	memcpy(cand->ids, l->ids, l->nb * sizeof (uint32_t));
+	cand->nb = l->nb;
+	return;
+    }
+
+    while (i < cand->nb && j < l->nb) {
+	if (cand->ids[i] < l->ids[j])
+	    i++;
+	else if (cand->ids[i] > l->ids[j])
+	    j++;
+	else {
+	    cand->ids[n++] = cand->ids[i];
+	    i++;
+	    j++;
+	}
+    }
+
+    cand->nb = n;
+}
+
+/* every trigram of s must be in the doc; returns -1 when one is missing */
+static int require_literal(Doc_List_t *cand, const char *s, uint32_t len) {
+    const Search_Term_t *t = NULL;
+    Doc_List_t l;
+    uint32_t i = 0;
+
+    for (i = 0; i + 3 <= len; i++) {
+	if ((t = find_term(ih->trigrams_off, ih->nb_trigrams, trigram(&s[i]))) == NULL) {
+	    free(cand->ids);
+	    no_docs(cand);
+	    return -1;
+	}
+	load_postings(t, &l);
+	intersect(cand, &l);
+	free(l.ids);
+    }
+
+    return 0;
+}
+
+static void require_run(void *ctx, const char *s, uint32_t len) {
+    if (len >= 3)
+	require_literal(ctx, s, len);
+}
+
+/* trigrams of the literal runs every match has to contain */
+static void require_regex(Doc_List_t *cand, const char *re) {
+    regex_runs(re, require_run, cand);
+}
+
+static int match_word(const Search_Doc_t *d, const char *word, uint32_t wlen) {
+    const char *s = (const char *) &idx[ih->text_off + d->text];
+    uint32_t j = 0, k = 0;
+
+    for (j = 0; j < d->len; j = k) {
+	while (j < d->len && !is_token_char(s[j]))
+	    j++;
+	for (k = j; k < d->len && is_token_char(s[k]); k++)
+	    ;
+	if (k - j == wlen && memcmp(&s[j], word, wlen) == 0)
+	    return 1;
+    }
+
+    return 0;
+}
+
+static void print_doc(const Search_Doc_t *d) {
+    const char *seg = (const char *) &idx[ih->segments_off];
+    uint64_t left = ih->docs_off - ih->segments_off, n = 0;
+    time_t t = d->time_us / 1000000;
+    struct tm *lt = localtime(&t);
+    uint32_t i = 0;
+    char date[32];
+
+    /* names are NUL terminated, up to the docs */
+
+    if (ih->docs_off < ih->segments_off)
+	left = 0;
+
+    for (i = 0; i < d->segment && left; i++) {
+	n = strnlen(seg, left);
+	n += (n < left);
+	seg += n;
+	left -= n;
+    }
+
+    if (left == 0 || strnlen(seg, left) == left)
+	seg = "?";
+
+    strftime(date, sizeof (date), "%Y-%m-%d %H:%M:%S", lt);
+
+    printf("%s uid %u pid %u ip %u.%u.%u.%u %s@%llu: %.*s\n", date,
+	    d->uid, d->pid, d->ip & 0xFF, (d->ip >> 8) & 0xFF,
+	    (d->ip >> 16) & 0xFF, (d->ip >> 24) & 0xFF, seg,
+	    (unsigned long long) d->offset, d->len,
+	    (const char *) &idx[ih->text_off + d->text]);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s -b <index> <file.cmds>...\n"
+	    "       %s [-r | -w] [-d days] <index> <pattern>\n\n", name, name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const Search_Doc_t *docs = NULL, *d = NULL;
+    const Search_Term_t *t = NULL;
+    Doc_List_t cand = { NULL, 0 };
+    struct stat st;
+    regex_t re;
+    uint64_t since_us = 0, start = 0;
+    uint32_t i = 0, nb_match = 0, plen = 0;
+    const char *pattern = NULL;
+    char text[COMMAND_MAX_SZ + 1];
+    int opt = 0, build = 0, regex = 0, word = 0, fd = -1;
+
+    while ((opt = getopt(argc, argv, "brwd:")) != -1) {
+	switch (opt) {
+	case 'b':
+	    build = 1;
+	    break;
+	case 'r':
+	    regex = 1;
+	    break;
+	case 'w':
+	    word = 1;
+	    break;
+	case 'd':
+	    since_us = clock_us(CLOCK_REALTIME) -
+		    strtoull(optarg, NULL, 0) * 86400 * 1000000ULL;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (build) {
+	if (argc - optind < 1)
+	    usage(argv[0]);
+	return build_index(argv[optind], argc - optind - 1, &argv[optind + 1]) ? 1 : 0;
+    }
+
+    if (argc - optind != 2)
+	usage(argv[0]);
+
+    pattern = argv[optind + 1];
+    plen = strlen(pattern);
+
+    if (regex && regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB)) {
+	search_err("Invalid regular expression %s\n", pattern);
+	exit(1);
+    }
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0 ||
+	    (idx = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	search_err("Index %s open failed: %d\n", argv[optind], errno);
+	exit(1);
+    }
+
+    ih = (const Search_Header_t *) idx;
+    idx_sz = st.st_size;
+    if (idx_sz < sizeof (*ih) || ih->magic != SEARCH_MAGIC) {
+	search_err("%s is not a search index\n", argv[optind]);
+	exit(1);
+    }
+
+    if (!check_index()) {
+	search_err("%s is corrupt or truncated\n", argv[optind]);
+	exit(1);
+    }
+
+    docs = (const Search_Doc_t *) &idx[ih->docs_off];
+
+    start = clock_us(CLOCK_MONOTONIC);
+
+    /* candidates from the postings, NULL means no term to go on */
+
+    if (word) {
+	no_docs(&cand);
+	if ((t = find_term(ih->tokens_off, ih->nb_tokens,
+		hash64(pattern, plen))) != NULL) {
+	    free(cand.ids);
+	    load_postings(t, &cand);
+	}
+    } else if (regex) {
+	require_regex(&cand, pattern);
+    } else {
+	require_literal(&cand, pattern, plen);
+    }
+
+    for (i = 0; i < (cand.ids ? cand.nb : ih->nb_docs); i++) {
+	d = &docs[cand.ids ? cand.ids[i] : i];
+
+	if (d->time_us < since_us)
+	    continue;
+
+	if (ih->text_off + d->text < ih->text_off ||
+		!in_index(ih->text_off + d->text, d->len)) {
+	    search_err("Corrupt index, doc text out of bounds\n");
+	    exit(1);
+	}
+
+	if (word) {
+	    if (!match_word(d, pattern, plen))
+		continue;
+	} else if (regex) {
+	    memcpy(text, &idx[ih->text_off + d->text], d->len);
+	    text[d->len] = '\0';
+	    if (regexec(&re, text, 0, NULL, 0))
+		continue;
+	} else if (memmem(&idx[ih->text_off + d->text], d->len, pattern, plen) == NULL) {
+	    continue;
+	}
+
+	print_doc(d);
+	nb_match++;
+    }
+
+    fprintf(stderr, "%u matches out of %u commands (%u candidates) in %.3f ms\n",
+	    nb_match, ih->nb_docs, cand.ids ? cand.nb : ih->nb_docs,
+	    (clock_us(CLOCK_MONOTONIC) - start) / 1000.0);
+
+    return 0;
+}
@@ -0,0 +1,573 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "settings.h"
+#include "codec.h"
+#include "logread.h"
+#include "segment.h"
+
+#define SEGMENT_NEXT_NAME ".shellog-next.bin"
+#define SEGMENT_NAME_TRIES 1000
+
+typedef struct Segment_s {
+    int fd;
+    char name[64];
+    uint64_t size;
+    uint64_t opened_us;
+    uint64_t next_index_us;
+    Segment_Index_Entry_t *index;
+    uint32_t nb_index;
+    uint32_t max_index;
+    Segment_Session_Entry_t *sessions; /* open addressing, see .uidx */
+    uint32_t nb_sessions;
+    uint32_t max_sessions;
+    struct Segment_s *next; /* seal queue */
+} Segment_t;
+
+/*
+ * Durable mode: records are appended to one of two block aligned
+ * buffers and a flusher thread writes the other one with O_DIRECT and
+ * O_DSYNC. Whatever arrives during a flush goes out with the next one,
+ * so a burst costs one synchronous write, not one per record. The last
+ * partial block is zero padded on disk and rewritten by the next flush.
+ */
+typedef struct {
+    uint8_t *data;
+    uint32_t fill;
+    uint32_t clean; /* leading bytes already on disk */
+    uint64_t base;  /* file offset of data[0], block aligned */
+    Segment_t *seg;
+    int last;       /* seal seg once this is written */
+} Direct_Buf_t;
+
+static Segment_t *live = NULL;
+static Segment_t *to_seal = NULL;
+static int next_fd = -1; /* preallocated SEGMENT_NEXT_NAME */
+static int seg_flags = O_WRONLY | O_APPEND;
+
+static int durable = 0;
+static int index_sessions = 0;
+static Direct_Buf_t dbuf[2];
+static Direct_Buf_t *active = NULL;
+static Direct_Buf_t *flushing = NULL;
+
+volatile uint64_t segment_errors = 0;
+
+static pthread_mutex_t seg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t seg_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t free_cond = PTHREAD_COND_INITIALIZER;
+
+/* O_DIRECT is refused by some filesystems (tmpfs), O_DSYNC alone will do */
+static int segment_create(const char *name) {
+    int fd = -1;
+
+    fd = open(name, seg_flags | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+
+    if (fd < 0 && errno == EINVAL && (seg_flags & O_DIRECT)) {
+	seg_flags &= ~O_DIRECT;
+	fd = open(name, seg_flags | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    }
+
+    return fd;
+}
+
+static void segment_name(char *name, uint64_t now_us) {
+    time_t sec = now_us / 1000000;
+    struct tm *lt = localtime(&sec);
+
+    sprintf(name, "shellog-%04d%02d%02d-%02d%02d%02d.%06u.bin",
+	    1900 + lt->tm_year, 1 + lt->tm_mon,
+	    lt->tm_mday, lt->tm_hour, lt->tm_min, lt->tm_sec,
+	    (unsigned) (now_us % 1000000));
+}
+
+/*
+ * Give the live segment its final name. The preallocated file is linked
+ * in when there is one, otherwise a fresh file is created; either way an
+ * existing name makes us try the next microsecond.
+ */
+static Segment_t *segment_open(uint64_t now_us) {
+    Segment_t *s = calloc(1, sizeof (Segment_t));
+    int i = 0;
+
+    if (s == NULL)
+	return NULL;
+
+    s->fd = -1;
+
+    for (i = 0; i < SEGMENT_NAME_TRIES; i++) {
+	segment_name(s->name, now_us + i);
+
+	if (next_fd >= 0) {
+	    if (link(SEGMENT_NEXT_NAME, s->name) == 0) {
+		unlink(SEGMENT_NEXT_NAME);
+		s->fd = next_fd;
+		next_fd = -1;
+		break;
+	    }
+	    if (errno == EEXIST)
+		continue;
+
+	    /* no luck with the spare file, leave it to the thread */
+	    close(next_fd);
+	    next_fd = -1;
+	    unlink(SEGMENT_NEXT_NAME);
+	}
+
+	if ((s->fd = segment_create(s->name)) >= 0 || errno != EEXIST)
+	    break;
+    }
+
+    if (s->fd < 0) {
+	free(s);
+	return NULL;
+    }
+
+    s->opened_us = s->next_index_us = now_us;
+
+    return s;
+}
+
+static void segment_index(Segment_t *s, uint64_t now_us) {
+    Segment_Index_Entry_t *index = NULL;
+    uint32_t max = 0;
+
+    if (s->nb_index == s->max_index) {
+	max = s->max_index ? s->max_index * 2 : 256;
+	if ((index = realloc(s->index,
+		max * sizeof (Segment_Index_Entry_t))) == NULL) {
+	    segment_errors++;
+	    return;
+	}
+	s->index = index;
+	s->max_index = max;
+    }
+
+    s->index[s->nb_index].time_us = now_us;
+    s->index[s->nb_index].offset = s->size;
+    s->nb_index++;
+
+    s->next_index_us = now_us + SEGMENT_INDEX_US;
+}
+
+/* A pid may be reused: sessions are told apart by their start too */
+static uint32_t session_slot(const Segment_Session_Entry_t *table,
+	uint32_t max, uint32_t ip, uint32_t uid, uint32_t pid,
+	uint64_t base_us) {
+    uint32_t key[5] = { ip, uid, pid, (uint32_t) base_us,
+	(uint32_t) (base_us >> 32) };
+    uint32_t h = hash64(key, sizeof (key)) & (max - 1);
+
+    while (table[h].packets && (table[h].ip != ip || table[h].uid != uid ||
+	    table[h].pid != pid || table[h].base_us != base_us))
+	h = (h + 1) & (max - 1);
+
+    return h;
+}
+
+/*
+ * Account a stored packet of the session ro to the segment, see .uidx.
+ * When the table cannot grow the packet is left out and counted.
+ */
+static void segment_session(Segment_t *s, uint32_t ip,
+	const Record_Open_t *ro, uint32_t len) {
+    Segment_Session_Entry_t *table = NULL, *e = NULL;
+    uint32_t max = 0, i = 0;
+
+    if (4 * (s->nb_sessions + 1) > 3 * s->max_sessions) {
+	max = s->max_sessions ? s->max_sessions * 2 : 256;
+	if ((table = calloc(max, sizeof (Segment_Session_Entry_t))) == NULL) {
+	    segment_errors++;
+	    return;
+	}
+
+	for (i = 0; i < s->max_sessions; i++) {
+	    e = &s->sessions[i];
+	    if (e->packets)
+		table[session_slot(table, max, e->ip, e->uid, e->pid,
+			e->base_us)] = *e;
+	}
+
+	free(s->sessions);
+	s->sessions = table;
+	s->max_sessions = max;
+    }
+
+    e = &s->sessions[session_slot(s->sessions, s->max_sessions, ip,
+	    ro->uid, ro->pid, ro->base_us)];
+
+    if (e->packets == 0) {
+	e->ip = ip;
+	e->uid = ro->uid;
+	e->pid = ro->pid;
+	e->base_us = ro->base_us;
+	e->first_offset = s->size;
+	s->nb_sessions++;
+    }
+
+    e->last_offset = s->size;
+    e->packets++;
+    e->bytes += len;
+}
+
+static int session_cmp(const void *a, const void *b) {
+    const Segment_Session_Entry_t *x = a, *y = b;
+
+    if (x->uid != y->uid)
+	return x->uid < y->uid ? -1 : 1;
+    if (x->base_us != y->base_us)
+	return x->base_us < y->base_us ? -1 : 1;
+    return (x->first_offset > y->first_offset) - (x->first_offset < y->first_offset);
+}
+
+/* Write an index file next to the segment: name.bin -> name.ext */
+static void segment_write_index(const Segment_t *s, const char *ext,
+	uint32_t magic, const void *entries, size_t size, uint32_t nb) {
+    Segment_Index_Header_t hdr;
+    char name[64];
+    FILE *fp = NULL;
+    int fd = -1;
+
+    strcpy(name, s->name);
+    strcpy(strrchr(name, '.'), ext);
+
+    if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) >= 0 &&
+	    (fp = fdopen(fd, "w")) != NULL) {
+	hdr.magic = magic;
+	hdr.nb_entries = nb;
+	hdr.opened_us = s->opened_us;
+	hdr.size = s->size;
+
+	fwrite(&hdr, sizeof (hdr), 1, fp);
+	fwrite(entries, size, nb, fp);
+	fflush(fp);
+	fdatasync(fd);
+	fclose(fp);
+    } else if (fd >= 0) {
+	close(fd);
+    }
+}
+
+/* Trim the preallocated tail, sync, write the .sidx (.uidx) and let it go */
+static void segment_seal(Segment_t *s) {
+    uint32_t i = 0, n = 0;
+
+    ftruncate(s->fd, s->size);
+    fdatasync(s->fd);
+    close(s->fd);
+
+    if (index_sessions) {
+	for (i = 0; i < s->max_sessions; i++) {
+	    if (s->sessions[i].packets)
+		s->sessions[n++] = s->sessions[i];
+	}
+	qsort(s->sessions, n, sizeof (Segment_Session_Entry_t), session_cmp);
+
+	segment_write_index(s, ".uidx", SEGMENT_SESSION_MAGIC, s->sessions,
+		sizeof (Segment_Session_Entry_t), n);
+    }
+
+    /* the .sidx goes last, followers take it as the end of the segment */
+    segment_write_index(s, ".sidx", SEGMENT_INDEX_MAGIC, s->index,
+	    sizeof (Segment_Index_Entry_t), s->nb_index);
+
+    free(s->sessions);
+    free(s->index);
+    free(s);
+}
+
+/*
+ * Reserve the blocks of the next segment now; KEEP_SIZE leaves it empty
+ * to readers, and sealing gives back whatever was not used. A file
+ * system without fallocate() just gets no reservation.
+ */
+static int segment_prepare(void) {
+    int fd = -1;
+
+    unlink(SEGMENT_NEXT_NAME);
+
+    if ((fd = segment_create(SEGMENT_NEXT_NAME)) < 0)
+	return -1;
+
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, settings.max_log_size) < 0 &&
+	    errno != EOPNOTSUPP) {
+	close(fd);
+	unlink(SEGMENT_NEXT_NAME);
+	return -1;
+    }
+
+    return fd;
+}
+
+static void *segment_thread(void *arg) {
+    Segment_t *sealing = NULL, *s = NULL;
+    struct timespec ts;
+    int fd = -1, sync_fd = -1, need_next = 0, prepare_failed = 0;
+
+    (void) arg;
+
+    while (1) {
+	pthread_mutex_lock(&seg_lock);
+
+	/* a failed preparation is retried on the next sync, not at once */
+
+	if (to_seal == NULL && (next_fd >= 0 || prepare_failed)) {
+	    clock_gettime(CLOCK_REALTIME, &ts);
+	    ts.tv_sec += SEGMENT_SYNC_MS / 1000;
+	    ts.tv_nsec += (SEGMENT_SYNC_MS % 1000) * 1000000;
+	    if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	    }
+	    pthread_cond_timedwait(&seg_cond, &seg_lock, &ts);
+	}
+
+	sealing = to_seal;
+	to_seal = NULL;
+	sync_fd = durable ? -1 : dup(live->fd);
+	need_next = (next_fd < 0);
+
+	pthread_mutex_unlock(&seg_lock);
+
+	prepare_failed = 0;
+
+	if (need_next && (fd = segment_prepare()) >= 0) {
+	    pthread_mutex_lock(&seg_lock);
+	    next_fd = fd;
+	    pthread_mutex_unlock(&seg_lock);
+	} else if (need_next) {
+	    segment_errors++;
+	    prepare_failed = 1;
+	}
+
+	while ((s = sealing) != NULL) {
+	    sealing = s->next;
+	    segment_seal(s);
+	}
+
+	if (sync_fd >= 0) {
+	    fdatasync(sync_fd);
+	    close(sync_fd);
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand the active buffer to the flusher and start the other one, either
+ * on a new segment or carrying over the partial last block. Called with
+ * seg_lock held; waits if the flusher is still busy with the other one.
+ */
+static void direct_swap(Segment_t *next_seg) {
+    Direct_Buf_t *b = active;
+    Direct_Buf_t *o = (b == &dbuf[0]) ? &dbuf[1] : &dbuf[0];
+    uint32_t keep = b->fill % SEGMENT_BLOCK_SZ;
+
+    while (flushing != NULL)
+	pthread_cond_wait(&free_cond, &seg_lock);
+
+    o->last = 0;
+
+    if (next_seg) {
+	o->seg = next_seg;
+	o->base = 0;
+	o->fill = o->clean = 0;
+	b->last = 1;
+    } else {
+	memcpy(o->data, &b->data[b->fill - keep], keep);
+	o->seg = b->seg;
+	o->base = b->base + b->fill - keep;
+	o->fill = o->clean = keep;
+	b->last = 0;
+    }
+
+    flushing = b;
+    active = o;
+
+    pthread_cond_signal(&flush_cond);
+}
+
+static void direct_write(Direct_Buf_t *b) {
+    uint32_t len = (b->fill + SEGMENT_BLOCK_SZ - 1) & ~(SEGMENT_BLOCK_SZ - 1);
+    uint32_t done = 0;
+    int n = 0;
+
+    memset(&b->data[b->fill], 0, len - b->fill);
+
+    while (done < len) {
+	if ((n = pwrite(b->seg->fd, &b->data[done], len - done,
+		b->base + done)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    segment_errors++;
+	    break;
+	}
+	done += n;
+    }
+}
+
+static void *flush_thread(void *arg) {
+    Direct_Buf_t *b = NULL;
+
+    (void) arg;
+
+    pthread_mutex_lock(&seg_lock);
+
+    while (1) {
+	/* group commit: take whatever piled up while we were writing */
+
+	if (flushing == NULL) {
+	    if (active->fill == active->clean) {
+		pthread_cond_wait(&flush_cond, &seg_lock);
+		continue;
+	    }
+	    direct_swap(NULL);
+	}
+
+	b = flushing;
+	pthread_mutex_unlock(&seg_lock);
+
+	direct_write(b);
+
+	pthread_mutex_lock(&seg_lock);
+
+	if (b->last) {
+	    b->seg->next = to_seal;
+	    to_seal = b->seg;
+	    pthread_cond_signal(&seg_cond);
+	}
+
+	flushing = NULL;
+	pthread_cond_broadcast(&free_cond);
+    }
+
+    return NULL;
+}
+
+/*
+ * Open the first segment, before the server detaches. With durable set,
+ * segments are written through the aligned buffers above.
+ */
+int segment_init(int durable_mode, int session_index) {
+    int i = 0;
+
+    index_sessions = session_index;
+
+    if ((durable = durable_mode)) {
+	seg_flags = O_WRONLY | O_DIRECT | O_DSYNC;
+
+	for (i = 0; i < (int) SZARR(dbuf); i++) {
+	    if (posix_memalign((void **) &dbuf[i].data, SEGMENT_BLOCK_SZ,
+		    SEGMENT_DIRECT_BUF_SZ))
+		return -1;
+	}
+    }
+
+    if ((live = segment_open(clock_us(CLOCK_REALTIME))) == NULL)
+	return -1;
+
+    if (durable) {
+	active = &dbuf[0];
+	active->seg = live;
+    }
+
+    return 0;
+}
+
+/* Start preallocating, sealing, syncing and flushing in the background */
+int segment_start(void) {
+    pthread_t thread;
+    int ret = 0;
+
+    if ((ret = pthread_create(&thread, NULL, segment_thread, NULL)))
+	return ret;
+
+    if (durable)
+	ret = pthread_create(&thread, NULL, flush_thread, NULL);
+
+    return ret;
+}
+
+static int direct_append(const uint8_t *buf, uint32_t len) {
+
+    if (active->fill + len > SEGMENT_DIRECT_BUF_SZ)
+	direct_swap(NULL);
+
+    memcpy(&active->data[active->fill], buf, len);
+    active->fill += len;
+
+    if (flushing == NULL)
+	pthread_cond_signal(&flush_cond);
+
+    return len;
+}
+
+/*
+ * Append len bytes to the live segment, rotating first if it is full or
+ * too old; buf is a stored packet and ro, when known, the session it
+ * belongs to. Returns 1 if it rotated, 0 if not and -1 on a failed
+ * write.
+ */
+int segment_write(const uint8_t *buf, uint32_t len, const Record_Open_t *ro) {
+    Segment_t *s = NULL;
+    uint64_t now_us = clock_us(CLOCK_REALTIME);
+    uint32_t ip = 0;
+    int rotated = 0, n = 0;
+
+    pthread_mutex_lock(&seg_lock);
+
+    if (live->size && (live->size + len > settings.max_log_size ||
+	    now_us - live->opened_us >=
+	    settings.segment_max_age_s * 1000000ULL)) {
+	if ((s = segment_open(now_us)) != NULL) {
+	    if (durable) {
+		direct_swap(s);
+	    } else {
+		live->next = to_seal;
+		to_seal = live;
+		pthread_cond_signal(&seg_cond);
+	    }
+	    live = s;
+	    rotated = 1;
+	} else {
+	    /* keep going on the old one, retry later */
+	    live->opened_us = now_us;
+	}
+    }
+
+    if (now_us >= live->next_index_us)
+	segment_index(live, now_us);
+
+    if (ro && index_sessions) {
+	stored_get_hdr(buf, &ip);
+	segment_session(live, ip, ro, len);
+    }
+
+    if (durable)
+	n = direct_append(buf, len);
+    else
+	n = write(live->fd, buf, len);
+
+    if (n > 0)
+	live->size += n;
+
+    pthread_mutex_unlock(&seg_lock);
+
+    return n < 0 ? -1 : rotated;
+}
@@ -0,0 +1,35 @@
+#ifndef _SEGMENT_H
+#define _SEGMENT_H
+
+#include <stdint.h>
+
+/*
+ * Server log segments. Records are appended to the live segment; once it
+ * reaches the max_log_size or segment_max_age_s setting it is swapped for
+ * a file the background thread has already created and preallocated, so
+ * ingest only pays for a rename. The old segment is then sealed off the hot path:
+ * trimmed to its size, synced and given its .sidx index. Names carry the
+ * open time down to the microsecond and never overwrite an existing file.
+ *
+ * With a session index, each stored packet whose session is known is
+ * also accounted to its session and the sealed segment gets a .uidx,
+ * see logread.h.
+ *
+ * In durable mode every write reaches the disk with O_DIRECT / O_DSYNC
+ * through block aligned, group committed buffers; the live segment may
+ * then end in zero padding up to the next block, which readers take as
+ * its end and sealing trims off.
+ *
+ * Include config.h first.
+ */
+
+#define SEGMENT_BLOCK_SZ 4096
+#define SEGMENT_DIRECT_BUF_SZ (1048576 * 1)
+
+extern volatile uint64_t segment_errors;
+
+int segment_init(int durable_mode, int session_index);
+int segment_start(void);
+int segment_write(const uint8_t *buf, uint32_t len, const Record_Open_t *ro);
+
+#endif /* _SEGMENT_H */
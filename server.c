@@ -10,52 +10,270 @@
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "config.h"
+#include "settings.h"
 #include "rc4.h"
-#include "sha1.h"
+#include "packet.h"
+#include "codec.h"
+#include "ring.h"
+#include "batch.h"
+#include "metrics.h"
+#include "segment.h"
+#include "logread.h"
+#include "reorder.h"
+#include "rules.h"
 
-#if SERVER_DBG
-#define server_dbg(format, arg...) DBG_PRINT_FUNC(format, "SERVER_DBG", ##arg)
-#else
-#define  server_dbg(x...)
-#endif
+#define server_dbg(format, arg...) \
+    SETTINGS_DBG(SETTINGS_DBG_SERVER, format, "SERVER_DBG", ##arg)
 
 #define server_err(format, arg...) DBG_PRINT_FUNC(format, "SERVER_ERR", ##arg)
 
-void create_log(int *fd_log) {
-    char logfile[64];
-    struct timeval tv;
-    struct tm *lt;
+static Metrics_Worker_t udp_metrics;
+static Metrics_Worker_t ring_metrics;
+static Rules_Worker_t *udp_rules = NULL;
+static Rules_Worker_t *ring_rules = NULL;
+static Frag_Table_t ring_frag;
 
-    gettimeofday(&tv, NULL);
-    lt = localtime(&tv.tv_sec);
+#define SLOWDOWN_PEERS 1024
 
-    sprintf(logfile, "shellog-%04d%02d%02d-%02d%02d%02d.bin",
-	    1900 + lt->tm_year, 1 + lt->tm_mon,
-	    lt->tm_mday, lt->tm_hour, lt->tm_min, lt->tm_sec);
+/*
+ * Append one stored record. logbuf starts with the stored_hdr_sz(len)
+ * prefix, len is the size of the transfer packet that follows it and ro
+ * its session when known.
+ */
+static void write_log(Metrics_Worker_t *m, unsigned char *logbuf,
+	uint32_t ip, int len, const Record_Open_t *ro) {
+    uint64_t start = metrics_now();
+    int ret = 0;
 
-    *fd_log = open(logfile, O_WRONLY | O_CREAT | O_APPEND,
-	    S_IRUSR | S_IWUSR);
+    len += stored_put_hdr(logbuf, ip, len);
 
-    if (*fd_log < 0) {
-	perror("open");
-	exit(1);
+    if ((ret = segment_write(logbuf, len, ro)) < 0) {
+	metrics_add(m, MET_WRITE_ERR, 1);
+    } else {
+	metrics_add(m, MET_BYTES_WRITTEN, len);
+	metrics_add(m, MET_ROTATIONS, ret);
+    }
+
+    metrics_time(m, STAGE_WRITE, start);
+}
+
+static void write_ring_batch(const uint8_t *frame, uint32_t len, void *ctx) {
+    static unsigned char logbuf[MAX_LOG_PKT_SZ + RAW_BATCH_SZ];
+
+    (void) ctx;
+
+    write_log(&ring_metrics, logbuf, htonl(INADDR_LOOPBACK),
+	    packet_seal(frame, len, STORED_PKT(logbuf)), NULL);
+}
+
+/*
+ * A fragment from the ring: once its frame is complete, it goes to the
+ * rules and into the log as one jumbo packet, after the batch being
+ * built so that records stay in order.
+ */
+static void ring_fragment(Frame_Batch_t *batch, const uint8_t *frag,
+	uint32_t len) {
+    static unsigned char logbuf[MAX_STORED_PKT_SZ];
+    const uint8_t *frame = NULL;
+    uint32_t frame_len = 0;
+    int ret = 0;
+
+    if ((ret = frag_add(&ring_frag, htonl(INADDR_LOOPBACK), frag, len,
+	    &frame, &frame_len)) <= 0) {
+	if (ret < 0) {
+	    server_err("Malformed fragment in ring\r\n");
+	    metrics_add(&ring_metrics, MET_BAD_FRAME, 1);
+	}
+	return;
     }
+
+    if (batch->nb_records)
+	batch_flush(batch);
+
+    if (ring_rules)
+	rules_frame(ring_rules, htonl(INADDR_LOOPBACK), frame, frame_len);
+
+    write_log(&ring_metrics, logbuf, htonl(INADDR_LOOPBACK),
+	    packet_seal(frame, frame_len,
+	    &logbuf[stored_hdr_sz(PKT_OVERHEAD + frame_len)]), NULL);
 }
 
-int main(void) {
+/*
+ * -i: decrypt only the session header of a verified packet, for the
+ * session index and the per user metrics; the payload stays sealed.
+ * Returns ro, NULL when the packet does not start with a session.
+ */
+static const Record_Open_t *peek_session(Metrics_Worker_t *m,
+	const uint8_t *pkt, int len, Record_Open_t *ro) {
+    uint8_t plain[LOG_PEEK_SZ];
+    uint64_t start = metrics_now();
+    int n = 0, dir = -1;
+
+    n = packet_decrypt_prefix(pkt, len, plain, sizeof (plain));
+
+    if (n < 0 || log_peek(plain, n, ro, &dir) < 0) {
+	metrics_add(m, MET_UNINDEXED, 1);
+	ro = NULL;
+    } else {
+	metrics_uid(m, ro->uid, len, dir);
+    }
+
+    metrics_time(m, STAGE_PEEK, start);
+
+    return ro;
+}
+
+/*
+ * Drain frames queued by local clients over shared memory. Whatever is
+ * in the ring when we wake up is merged into batch_size frames, so a burst
+ * costs one write per batch instead of one per record. Fragmented frames
+ * are put back together instead, see ring_fragment().
+ */
+static void *ring_consumer(void *arg) {
+    Ring_t *ring = arg;
+    static Frame_Batch_t batch;
+    static uint8_t frame[FRAME_MAX_SZ];
+    int len = 0;
+
+    batch_init(&batch, settings.batch_size, write_ring_batch, NULL);
+
+    while (1) {
+	while ((len = ring_pop(ring, frame)) > 0) {
+	    metrics_add(&ring_metrics, MET_PACKETS, 1);
+	    metrics_add(&ring_metrics, MET_BYTES_RECV, len);
+
+	    if (log_codec(frame, len) == CODEC_V2_FRAG) {
+		ring_fragment(&batch, frame, len);
+		continue;
+	    }
+
+	    if (ring_rules)
+		rules_frame(ring_rules, htonl(INADDR_LOOPBACK), frame, len);
+
+	    if (batch_add_frame(&batch, frame, len, 0, NULL) < 0) {
+		server_err("Malformed frame in ring\r\n");
+		metrics_add(&ring_metrics, MET_BAD_FRAME, 1);
+	    }
+	}
+
+	if (ring_rules)
+	    rules_expire(ring_rules);
+
+	if (batch.nb_records) {
+	    batch_flush(&batch);
+	    ring_heartbeat(ring);
+	    continue;
+	}
+
+	ring_wait(ring, ring_rules ? REORDER_HOLD_US / 2000 :
+		RING_STALE_MS / 2);
+    }
+
+    return NULL;
+}
+
+/*
+ * The kernel dropped datagrams lately: tell the client we just heard from
+ * to coalesce harder, at most once per SLOWDOWN_HOLD_MS. Peers share a
+ * small direct-mapped table, a collision only means an extra slowdown.
+ */
+static void send_slowdown(int fd, struct sockaddr_in *addr, uint64_t now_ms) {
+    static struct {
+	uint32_t ip;
+	uint16_t port;
+	uint64_t sent_ms;
+    } peers[SLOWDOWN_PEERS];
+    uint8_t frame[FRAME_HDR_SZ + 2 * VARINT_MAX_SZ];
+    uint8_t pkt[PKT_OVERHEAD + sizeof (frame)];
+    uint32_t h = (addr->sin_addr.s_addr ^ addr->sin_port) * 2654435761U;
+    int len = 0;
+
+    h %= SLOWDOWN_PEERS;
+
+    if (peers[h].ip == addr->sin_addr.s_addr &&
+	    peers[h].port == addr->sin_port &&
+	    peers[h].sent_ms + SLOWDOWN_HOLD_MS > now_ms)
+	return;
+
+    peers[h].ip = addr->sin_addr.s_addr;
+    peers[h].port = addr->sin_port;
+    peers[h].sent_ms = now_ms;
+
+    len = frame_put_slowdown(frame, SLOWDOWN_HOLD_MS,
+	    clock_us(CLOCK_REALTIME) / 1000);
+    len = packet_seal(frame, len, pkt);
+
+    if (sendto(fd, pkt, len, MSG_DONTWAIT, (struct sockaddr *) addr,
+	    sizeof (*addr)) == len)
+	metrics_add(&udp_metrics, MET_SLOWDOWNS, 1);
+}
+
+int main(int argc, char *argv[]) {
     socklen_t fromlen;
-    int len, n, server_socket, fd_log;
-    unsigned long int nb_written;
+    int len, n, server_socket, durable = 0, index = 0;
+    const char *rules_path = NULL, *alert_path = NULL;
     struct sockaddr_in client_addr;
     struct sockaddr_in server_addr;
     unsigned char logbuf[MAX_LOG_PKT_SZ];
-    unsigned char sha1sum[SHA1_SZ];
-    sha1_context sha1;
+    Record_Open_t ro;
+    const Record_Open_t *session = NULL;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct timespec now_ts, *rx_ts;
+    struct timeval tv;
+    uint8_t control[CMSG_SPACE(sizeof (uint32_t)) +
+	    CMSG_SPACE(sizeof (struct timespec))];
+    uint64_t start, now_ms, congested_until_ms = 0;
+    uint32_t drops = 0;
+
+    Ring_t *ring = NULL;
+    pthread_t ring_thread;
+    pthread_t metrics_thread;
 
-    create_log(&fd_log);
-    nb_written = 0;
+    /*
+     * -D: every record goes to disk synchronously, see segment.h
+     * -i: index the sessions of each segment and count packets per user
+     *     from the decrypted session headers, see segment.h
+     * -r: match commands against a rule file, alerts to -a or a socket,
+     *     see rules.h
+     */
+
+    if (settings_load(1))
+	exit(1);
+
+    while ((n = getopt(argc, argv, "Dir:a:")) != -1) {
+	switch (n) {
+	case 'D':
+	    durable = 1;
+	    break;
+	case 'i':
+	    index = 1;
+	    break;
+	case 'r':
+	    rules_path = optarg;
+	    break;
+	case 'a':
+	    alert_path = optarg;
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-D] [-i] [-r rules [-a alerts]]\n\n",
+		    argv[0]);
+	    exit(1);
+	}
+    }
+
+    if (rules_path && rules_load(rules_path, alert_path))
+	exit(1);
+
+    if (segment_init(durable, index)) {
+	perror("open");
+	exit(1);
+    }
 
     /* start the UDP listening server */
 
@@ -72,8 +290,44 @@ int main(void) {
 	exit(1);
     }
 
+    /* kernel drop counter and receive time ride along with each datagram */
+
+    if (setsockopt(server_socket, SOL_SOCKET, SO_RXQ_OVFL,
+	    (void *) &n, sizeof ( n)) < 0 ||
+	    setsockopt(server_socket, SOL_SOCKET, SO_TIMESTAMPNS,
+	    (void *) &n, sizeof ( n)) < 0) {
+	server_err("Set socket options failed: %d\r\n", errno);
+    }
+
+    /* room for a login storm, over rmem_max if we are allowed to */
+
+    n = settings.rcvbuf_size;
+
+    if (setsockopt(server_socket, SOL_SOCKET, SO_RCVBUFFORCE,
+	    (void *) &n, sizeof ( n)) < 0 &&
+	    setsockopt(server_socket, SOL_SOCKET, SO_RCVBUF,
+	    (void *) &n, sizeof ( n)) < 0) {
+	server_err("Set receive buffer failed: %d\r\n", errno);
+    }
+
+    /* wake up now and then to let go of records the rules hold */
+
+    tv.tv_sec = 0;
+    tv.tv_usec = REORDER_HOLD_US / 2;
+
+    if (setsockopt(server_socket, SOL_SOCKET, SO_RCVTIMEO, &tv,
+	    sizeof (tv)) < 0) {
+	server_err("Set receive timeout failed: %d\r\n", errno);
+    }
+
+    fromlen = sizeof (n);
+    if (getsockopt(server_socket, SOL_SOCKET, SO_RCVBUF, (void *) &n,
+	    &fromlen) == 0) {
+	server_dbg("Receive buffer: %d\r\n", n);
+    }
+
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SHELL_LOG_SERVER_PORT);
+    server_addr.sin_port = htons(settings.server_port);
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     if (bind(server_socket, (struct sockaddr *) &server_addr,
@@ -87,30 +341,107 @@ int main(void) {
 
     setsid();
 
+    if ((errno = segment_start()))
+	server_err("Segment thread start failed: %d\r\n", errno);
+
+    metrics_register(&udp_metrics, "udp");
+    metrics_register(&ring_metrics, "ring");
+    metrics_gauge("segment_errors_total", &segment_errors);
+
+    udp_rules = rules_worker(&udp_metrics);
+    ring_rules = rules_worker(&ring_metrics);
+
+    /* local clients may bypass the socket entirely */
+
+    if ((ring = ring_create()) == NULL) {
+	server_err("Shared memory ring creation failed, group %s: %d\r\n",
+		RING_GROUP, errno);
+    } else if ((errno = pthread_create(&ring_thread, NULL, ring_consumer, ring))) {
+	server_err("Ring consumer start failed: %d\r\n", errno);
+    } else {
+	metrics_gauge("ring_drops_total", &ring->drops);
+	metrics_gauge("ring_skips_total", &ring->skips);
+	metrics_gauge("ring_fragment_drops_total", &ring_frag.drops);
+    }
+
+    if (udp_rules)
+	metrics_gauge("udp_fragment_drops_total", &udp_rules->frag.drops);
+
+    /* a metrics reader hanging up early must not take the server down */
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((errno = pthread_create(&metrics_thread, NULL, metrics_serve, NULL)))
+	server_err("Metrics endpoint start failed: %d\r\n", errno);
+
     while (1) {
 	fromlen = sizeof (client_addr);
 
-	if ((len = recvfrom(server_socket, &logbuf[IP_SZ + LENGTH_SZ], BUF_SZ, 0,
-		(struct sockaddr *) &client_addr,
-		&fromlen)) < MIN_TRANSFER_PKT_SZ) {
-	    //	    sleep(1);
+	iov.iov_base = STORED_PKT(logbuf);
+	iov.iov_len = MAX_TRANSFER_PKT_SZ;
+	memset(&msg, 0, sizeof (msg));
+	msg.msg_name = &client_addr;
+	msg.msg_namelen = fromlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof (control);
+
+	if ((len = recvmsg(server_socket, &msg, 0)) < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		if (udp_rules)
+		    rules_expire(udp_rules);
+	    } else if (errno != EINTR) {
+		metrics_add(&udp_metrics, MET_RECV_ERR, 1);
+	    }
+	    continue;
+	}
+
+	rx_ts = NULL;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	    if (cmsg->cmsg_level != SOL_SOCKET)
+		continue;
+	    if (cmsg->cmsg_type == SO_RXQ_OVFL &&
+		    *(uint32_t *) CMSG_DATA(cmsg) != drops) {
+		drops = *(uint32_t *) CMSG_DATA(cmsg);
+		metrics_set(&udp_metrics, MET_SOCKET_DROPS, drops);
+		congested_until_ms = clock_us(CLOCK_MONOTONIC) / 1000 +
+			SLOWDOWN_HOLD_MS;
+	    } else if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		rx_ts = (struct timespec *) CMSG_DATA(cmsg);
+	}
+
+	if (rx_ts) {
+	    clock_gettime(CLOCK_REALTIME, &now_ts);
+	    metrics_record(&udp_metrics, STAGE_RECV,
+		    (now_ts.tv_sec - rx_ts->tv_sec) * 1000000000LL +
+		    now_ts.tv_nsec - rx_ts->tv_nsec);
+	}
+
+	if (len < MIN_PKT_SZ) {
+	    metrics_add(&udp_metrics, MET_SHORT_PKT, 1);
+	    continue;
+	}
+
+	if (msg.msg_flags & MSG_TRUNC) {
+	    metrics_add(&udp_metrics, MET_LONG_PKT, 1);
 	    continue;
 	}
 
 	server_dbg("Received packet: %d\r\n", len);
 
-	sha1_starts(&sha1);
-	sha1_update(&sha1, logbuf + IP_SZ + LENGTH_SZ + RC4_SZ, len - RC4_SZ - SHA1_SZ);
-	sha1_finish(&sha1, sha1sum);
+	start = metrics_now();
+
+	n = packet_verify(STORED_PKT(logbuf), len);
+
+	metrics_time(&udp_metrics, STAGE_VERIFY, start);
 
-	if (memcmp(logbuf + IP_SZ + LENGTH_SZ + len - SHA1_SZ, sha1sum, SHA1_SZ) != 0) {
+	if (n < 0) {
 	    server_err("SHA-1 checksum verification failed\r\n");
+	    metrics_add(&udp_metrics, MET_BAD_SHA1, 1);
 	    continue;
 	}
 
-	memcpy(logbuf, &client_addr.sin_addr.s_addr, IP_SZ);
-	memcpy(&logbuf[IP_SZ], &len, LENGTH_SZ);
-
 	server_dbg("From : %d.%d.%d.%d\r\n",
 		(client_addr.sin_addr.s_addr) & 0xFF,
 		(client_addr.sin_addr.s_addr >> 8) & 0xFF,
@@ -118,15 +449,25 @@ int main(void) {
 		(client_addr.sin_addr.s_addr >> 24) & 0xFF
 		);
 
-	write(fd_log, logbuf, IP_SZ + LENGTH_SZ + len);
+	metrics_add(&udp_metrics, MET_PACKETS, 1);
+	metrics_add(&udp_metrics, MET_BYTES_RECV, len);
+	metrics_ip(&udp_metrics, client_addr.sin_addr.s_addr, len);
+
+	session = index ? peek_session(&udp_metrics,
+		STORED_PKT(logbuf), len, &ro) : NULL;
 
-	nb_written += (IP_SZ + LENGTH_SZ + len);
+	write_log(&udp_metrics, logbuf, client_addr.sin_addr.s_addr, len,
+		session);
 
-	if (nb_written > MAX_LOG_SIZE) {
-	    nb_written = 0;
-	    close(fd_log);
-	    create_log(&fd_log);
+	if (udp_rules) {
+	    rules_packet(udp_rules, client_addr.sin_addr.s_addr,
+		    STORED_PKT(logbuf), len);
+	    rules_expire(udp_rules);
 	}
+
+	if (congested_until_ms &&
+		(now_ms = clock_us(CLOCK_MONOTONIC) / 1000) < congested_until_ms)
+	    send_slowdown(server_socket, &client_addr, now_ms);
     }
 
     return ( 0);
@@ -0,0 +1,439 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "config.h"
+#include "settings.h"
+
+#define settings_err(format, arg...) DBG_PRINT_FUNC(format, "SETTINGS_ERR", ##arg)
+
+#define SET_NUM   0
+#define SET_IP    1
+#define SET_DEBUG 2
+
+typedef struct {
+    const char *name;
+    uint32_t off;
+    uint32_t width;
+    int type;
+    uint64_t min;
+    uint64_t max;
+} Settings_Key_t;
+
+#define KEY(field, type, min, max)                                      \
+    { #field, offsetof(Settings_t, field),                              \
+      sizeof (((Settings_t *) 0)->field), type, min, max }
+
+static const Settings_Key_t keys[] = {
+    KEY(server_ip,         SET_IP,    0,         UINT32_MAX),
+    KEY(server_port,       SET_NUM,   1,         UINT16_MAX),
+    KEY(log_output,        SET_NUM,   0,         1),
+    KEY(debug,             SET_DEBUG, 0,         0x0F),
+    KEY(read_size,         SET_NUM,   64,        BUF_SZ),
+    KEY(bulk_size,         SET_NUM,   64,        BULK_SZ),
+    KEY(open_every,        SET_NUM,   1,         UINT16_MAX),
+    KEY(coalesce_min_ms,   SET_NUM,   1,         60000),
+    KEY(coalesce_max_ms,   SET_NUM,   1,         60000),
+    KEY(batch_size,        SET_NUM,   256,       BATCH_SZ),
+    KEY(relay_flush_ms,    SET_NUM,   1,         60000),
+    KEY(rcvbuf_size,       SET_NUM,   0,         1 << 30),
+    KEY(segment_max_age_s, SET_NUM,   1,         UINT32_MAX),
+    KEY(max_log_size,      SET_NUM,   1 << 20,   1ULL << 40),
+};
+
+#define NB_KEYS (sizeof (keys) / sizeof (keys[0]))
+
+static const char *debug_names[] = { "client", "server", "parser", "relay" };
+
+Settings_t settings;
+
+static void settings_defaults(Settings_t *s) {
+    memset(s, 0, sizeof (*s));
+
+    s->magic = SETTINGS_MAGIC;
+    s->version = SETTINGS_VERSION;
+    s->size = sizeof (Settings_t);
+    s->server_ip = inet_addr(CONNECT_IP);
+    s->server_port = SHELL_LOG_SERVER_PORT;
+    s->log_output = LOG_OUTPUT;
+    s->debug = (CLIENT_DBG ? SETTINGS_DBG_CLIENT : 0) |
+	    (SERVER_DBG ? SETTINGS_DBG_SERVER : 0) |
+	    (PARSER_DBG ? SETTINGS_DBG_PARSER : 0) |
+	    (RELAY_DBG ? SETTINGS_DBG_RELAY : 0);
+    s->read_size = BUF_SZ;
+    s->bulk_size = BULK_SZ;
+    s->open_every = SESSION_OPEN_EVERY;
+    s->coalesce_min_ms = COALESCE_MIN_MS;
+    s->coalesce_max_ms = COALESCE_MAX_MS;
+    s->batch_size = BATCH_SZ;
+    s->relay_flush_ms = RELAY_FLUSH_MS;
+    s->rcvbuf_size = SERVER_RCVBUF_SZ;
+    s->segment_max_age_s = SEGMENT_MAX_AGE_S;
+    s->max_log_size = MAX_LOG_SIZE;
+}
+
+static uint64_t get_field(const Settings_t *s, const Settings_Key_t *k) {
+    const uint8_t *p = (const uint8_t *) s + k->off;
+    uint8_t v8 = 0;
+    uint16_t v16 = 0;
+    uint32_t v32 = 0;
+    uint64_t v64 = 0;
+
+    switch (k->width) {
+    case 1:
+	memcpy(&v8, p, 1);
+	return v8;
+    case 2:
+	memcpy(&v16, p, 2);
+	return v16;
+    case 4:
+	memcpy(&v32, p, 4);
+	return v32;
+    default:
+	memcpy(&v64, p, 8);
+	return v64;
+    }
+}
+
+static void set_field(Settings_t *s, const Settings_Key_t *k, uint64_t v) {
+    uint8_t *p = (uint8_t *) s + k->off;
+    uint8_t v8 = v;
+    uint16_t v16 = v;
+    uint32_t v32 = v;
+
+    switch (k->width) {
+    case 1:
+	memcpy(p, &v8, 1);
+	break;
+    case 2:
+	memcpy(p, &v16, 2);
+	break;
+    case 4:
+	memcpy(p, &v32, 4);
+	break;
+    default:
+	memcpy(p, &v, 8);
+    }
+}
+
+/* "client,parser", "none" or a number */
+static int parse_debug(const char *str, uint64_t *v) {
+    char buf[64], *tok = NULL, *save = NULL, *end = NULL;
+    uint32_t i = 0;
+
+    *v = strtoull(str, &end, 0);
+    if (end != str && *end == '\0')
+	return 0;
+
+    snprintf(buf, SZARR(buf), "%s", str);
+    *v = 0;
+
+    for (tok = strtok_r(buf, ", ", &save); tok;
+	    tok = strtok_r(NULL, ", ", &save)) {
+	if (strcmp(tok, "none") == 0)
+	    continue;
+
+	for (i = 0; i < SZARR(debug_names); i++) {
+	    if (strcmp(tok, debug_names[i]) == 0)
+		break;
+	}
+
+	if (i == SZARR(debug_names))
+	    return -1;
+
+	*v |= 1 << i;
+    }
+
+    return 0;
+}
+
+/* Sizes take a k, m or g suffix */
+static int parse_value(const Settings_Key_t *k, const char *str, uint64_t *v) {
+    struct in_addr addr;
+    char *end = NULL;
+    int shift = 0;
+
+    switch (k->type) {
+    case SET_IP:
+	if (inet_aton(str, &addr) == 0)
+	    return -1;
+	*v = addr.s_addr;
+	return 0;
+    case SET_DEBUG:
+	if (parse_debug(str, v))
+	    return -1;
+	break;
+    default:
+	if (!isdigit((unsigned char) *str))
+	    return -1;
+
+	errno = 0;
+	*v = strtoull(str, &end, 0);
+
+	switch (tolower((unsigned char) *end)) {
+	case 'k':
+	    shift = 10;
+	    break;
+	case 'm':
+	    shift = 20;
+	    break;
+	case 'g':
+	    shift = 30;
+	    break;
+	}
+
+	if (shift && *v <= (UINT64_MAX >> shift)) {
+	    *v <<= shift;
+	    end++;
+	}
+
+	if (errno || *end != '\0')
+	    return -1;
+    }
+
+    return (*v < k->min || *v > k->max) ? -1 : 0;
+}
+
+static const Settings_Key_t *find_key(const char *name) {
+    uint32_t i = 0;
+
+    for (i = 0; i < NB_KEYS; i++) {
+	if (strcmp(keys[i].name, name) == 0)
+	    return &keys[i];
+    }
+
+    return NULL;
+}
+
+/* Values out of range in a compiled file, which could be anyone's */
+static int settings_check(const Settings_t *s, const char *path) {
+    uint64_t v = 0;
+    uint32_t i = 0;
+
+    if (s->magic != SETTINGS_MAGIC || s->version != SETTINGS_VERSION ||
+	    s->size != sizeof (Settings_t)) {
+	settings_err("%s: not a settings file of this version\n", path);
+	return -1;
+    }
+
+    for (i = 0; i < NB_KEYS; i++) {
+	v = get_field(s, &keys[i]);
+	if (v < keys[i].min || v > keys[i].max) {
+	    settings_err("%s: %s out of range\n", path, keys[i].name);
+	    return -1;
+	}
+    }
+
+    if (s->coalesce_min_ms > s->coalesce_max_ms) {
+	settings_err("%s: coalesce_min_ms over coalesce_max_ms\n", path);
+	return -1;
+    }
+
+    return 0;
+}
+
+/* SHELLOG_<KEY> overrides */
+static int settings_env(void) {
+    char name[64];
+    const char *value = NULL;
+    uint64_t v = 0;
+    uint32_t i = 0, j = 0;
+    int ret = 0;
+
+    for (i = 0; i < NB_KEYS; i++) {
+	j = snprintf(name, SZARR(name), "SHELLOG_%s", keys[i].name);
+	while (j-- > strlen("SHELLOG_"))
+	    name[j] = toupper((unsigned char) name[j]);
+
+	if ((value = getenv(name)) == NULL)
+	    continue;
+
+	if (parse_value(&keys[i], value, &v)) {
+	    settings_err("%s=%s ignored\n", name, value);
+	    ret = -1;
+	    continue;
+	}
+
+	set_field(&settings, &keys[i], v);
+    }
+
+    if (settings.coalesce_min_ms > settings.coalesce_max_ms) {
+	settings_err("coalesce_min_ms over coalesce_max_ms, raised to it\n");
+	settings.coalesce_max_ms = settings.coalesce_min_ms;
+	ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Fill the global settings: defaults, then the compiled file, then with
+ * env set the environment. Returns -1 if something was ignored, the
+ * settings are usable either way.
+ */
+int settings_load(int env) {
+    const char *path = SETTINGS_PATH;
+    Settings_t *map = NULL;
+    struct stat st;
+    int fd = -1, ret = 0;
+
+    settings_defaults(&settings);
+
+    if (env && getenv("SHELLOG_SETTINGS"))
+	path = getenv("SHELLOG_SETTINGS");
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+	if (errno != ENOENT) {
+	    settings_err("%s open failed: %d\n", path, errno);
+	    ret = -1;
+	}
+    } else if (fstat(fd, &st) < 0 || st.st_size != sizeof (Settings_t) ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH))) {
+	settings_err("%s ignored, wrong size or writable by others\n", path);
+	ret = -1;
+    } else if ((map = mmap(NULL, sizeof (Settings_t), PROT_READ, MAP_PRIVATE,
+	    fd, 0)) == MAP_FAILED) {
+	settings_err("%s mapping failed: %d\n", path, errno);
+	ret = -1;
+    } else {
+	if (settings_check(map, path) == 0)
+	    memcpy(&settings, map, sizeof (Settings_t));
+	else
+	    ret = -1;
+	munmap(map, sizeof (Settings_t));
+    }
+
+    if (fd >= 0)
+	close(fd);
+
+    if (env && settings_env())
+	ret = -1;
+
+    return ret;
+}
+
+/* Read a text settings file over the defaults */
+int settings_parse(const char *path, Settings_t *s) {
+    const Settings_Key_t *k = NULL;
+    char line[256], *key = NULL, *value = NULL, *end = NULL;
+    uint64_t v = 0;
+    FILE *fp = NULL;
+    int n = 0, ret = 0;
+
+    settings_defaults(s);
+
+    if ((fp = fopen(path, "r")) == NULL) {
+	settings_err("%s open failed: %d\n", path, errno);
+	return -1;
+    }
+
+    while (fgets(line, sizeof (line), fp)) {
+	n++;
+	line[strcspn(line, "#\r\n")] = '\0';
+
+	for (key = line; isspace((unsigned char) *key); key++)
+	    ;
+	if (*key == '\0')
+	    continue;
+
+	if ((value = strchr(key, '=')) == NULL) {
+	    settings_err("%s:%d: no value\n", path, n);
+	    ret = -1;
+	    continue;
+	}
+
+	for (end = value; end > key && isspace((unsigned char) end[-1]); end--)
+	    ;
+	*end = '\0';
+
+	for (value++; isspace((unsigned char) *value); value++)
+	    ;
+	for (end = value + strlen(value);
+		end > value && isspace((unsigned char) end[-1]); end--)
+	    ;
+	*end = '\0';
+
+	if ((k = find_key(key)) == NULL) {
+	    settings_err("%s:%d: unknown setting %s\n", path, n, key);
+	    ret = -1;
+	} else if (parse_value(k, value, &v)) {
+	    settings_err("%s:%d: invalid %s\n", path, n, key);
+	    ret = -1;
+	} else {
+	    set_field(s, k, v);
+	}
+    }
+
+    fclose(fp);
+
+    if (ret == 0)
+	ret = settings_check(s, path);
+
+    return ret;
+}
+
+/* Write a compiled settings file, replacing the old one in one go */
+int settings_write(const char *path, const Settings_t *s) {
+    char tmp[PATH_MAX];
+    int fd = -1;
+
+    snprintf(tmp, SZARR(tmp), "%s.tmp", path);
+
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+	return -1;
+
+    if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0 ||
+	    write(fd, s, sizeof (*s)) != sizeof (*s) || fsync(fd) < 0) {
+	close(fd);
+	unlink(tmp);
+	return -1;
+    }
+
+    close(fd);
+
+    return rename(tmp, path);
+}
+
+/* As a text settings file */
+void settings_print(FILE *fp, const Settings_t *s) {
+    struct in_addr addr;
+    uint64_t v = 0;
+    uint32_t i = 0, j = 0;
+
+    for (i = 0; i < NB_KEYS; i++) {
+	v = get_field(s, &keys[i]);
+	fprintf(fp, "%-18s = ", keys[i].name);
+
+	switch (keys[i].type) {
+	case SET_IP:
+	    addr.s_addr = v;
+	    fprintf(fp, "%s\n", inet_ntoa(addr));
+	    break;
+	case SET_DEBUG:
+	    if (v == 0)
+		fprintf(fp, "none");
+	    for (j = 0; j < SZARR(debug_names); j++) {
+		if (v & (1 << j))
+		    fprintf(fp, "%s%s", debug_names[j],
+			    (v >> (j + 1)) ? "," : "");
+	    }
+	    fprintf(fp, "\n");
+	    break;
+	default:
+	    fprintf(fp, "%llu\n", (unsigned long long) v);
+	}
+    }
+}
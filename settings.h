@@ -0,0 +1,71 @@
+#ifndef _SETTINGS_H
+#define _SETTINGS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Runtime settings, so a host can be tuned without rebuilding. The
+ * config.h values are the defaults; buffer sizes there stay the upper
+ * bounds, the settings only go lower.
+ *
+ * They are written as text in SETTINGS_CONF_PATH, one "key = value" per
+ * line, '#' starting a comment, and compiled by conf into SETTINGS_PATH:
+ * a Settings_t image that settings_load() maps and checks, so a login
+ * costs an open() and an mmap() and nothing is parsed on the way. No
+ * file means the defaults.
+ *
+ * Every program but the client then takes SHELLOG_<KEY> environment
+ * overrides (SHELLOG_SERVER_PORT=40120) and SHELLOG_SETTINGS for another
+ * compiled file. The client runs as the user being logged and only
+ * trusts SETTINGS_PATH. A compiled file that group or others can write
+ * is ignored.
+ *
+ * The *_DBG flags of config.h are the default of the debug setting,
+ * which picks the programs whose debug output prints. Include config.h
+ * first.
+ */
+
+#define SETTINGS_MAGIC   0x47464853 /* "SHFG" */
+#define SETTINGS_VERSION 1
+
+/* debug setting bits */
+#define SETTINGS_DBG_CLIENT 0x01
+#define SETTINGS_DBG_SERVER 0x02
+#define SETTINGS_DBG_PARSER 0x04
+#define SETTINGS_DBG_RELAY  0x08
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;            /* sizeof (Settings_t) */
+    uint32_t server_ip;       /* collector, network order */
+    uint16_t server_port;
+    uint8_t log_output;       /* send terminal output too */
+    uint8_t debug;            /* SETTINGS_DBG_* */
+    uint32_t read_size;       /* client reads, up to BUF_SZ */
+    uint32_t bulk_size;       /* output gathered in a record, to BULK_SZ */
+    uint32_t open_every;      /* SESSION_OPEN_EVERY */
+    uint32_t coalesce_min_ms;
+    uint32_t coalesce_max_ms;
+    uint32_t batch_size;      /* ring and relay batches, up to BATCH_SZ */
+    uint32_t relay_flush_ms;
+    uint32_t rcvbuf_size;     /* collector socket */
+    uint32_t segment_max_age_s;
+    uint64_t max_log_size;    /* segment rotation */
+} Settings_t;
+
+extern Settings_t settings;
+
+#define SETTINGS_DBG(bit, format, mod, arg...)                          \
+    do {                                                                \
+        if (settings.debug & (bit))                                     \
+            DBG_PRINT_FUNC(format, mod, ##arg);                         \
+    } while (0)
+
+int settings_load(int env);
+int settings_parse(const char *path, Settings_t *s);
+int settings_write(const char *path, const Settings_t *s);
+void settings_print(FILE *fp, const Settings_t *s);
+
+#endif /* _SETTINGS_H */
@@ -4,54 +4,21 @@
 
 #define GET_UINT32(n,b,i)                       \
 {                                               \
-    (n) = ( (uint32) (b)[(i)    ] << 24 )       \
-        | ( (uint32) (b)[(i) + 1] << 16 )       \
-        | ( (uint32) (b)[(i) + 2] <<  8 )       \
-        | ( (uint32) (b)[(i) + 3]       );      \
+    (n) = ( (uint32_t) (b)[(i)    ] << 24 )     \
+        | ( (uint32_t) (b)[(i) + 1] << 16 )     \
+        | ( (uint32_t) (b)[(i) + 2] <<  8 )     \
+        | ( (uint32_t) (b)[(i) + 3]       );    \
 }
 
 #define PUT_UINT32(n,b,i)                       \
 {                                               \
-    (b)[(i)    ] = (uint8) ( (n) >> 24 );       \
-    (b)[(i) + 1] = (uint8) ( (n) >> 16 );       \
-    (b)[(i) + 2] = (uint8) ( (n) >>  8 );       \
-    (b)[(i) + 3] = (uint8) ( (n)       );       \
+    (b)[(i)    ] = (uint8_t) ( (n) >> 24 );     \
+    (b)[(i) + 1] = (uint8_t) ( (n) >> 16 );     \
+    (b)[(i) + 2] = (uint8_t) ( (n) >>  8 );     \
+    (b)[(i) + 3] = (uint8_t) ( (n)       );     \
 }
 
-void sha1_starts( sha1_context *ctx )
-{
-    ctx->total[0] = 0;
-    ctx->total[1] = 0;
-
-    ctx->state[0] = 0x67452301;
-    ctx->state[1] = 0xEFCDAB89;
-    ctx->state[2] = 0x98BADCFE;
-    ctx->state[3] = 0x10325476;
-    ctx->state[4] = 0xC3D2E1F0;
-}
-
-void sha1_process( sha1_context *ctx, uint8 data[64] )
-{
-    uint32 temp, W[16], A, B, C, D, E;
-
-    GET_UINT32( W[0],  data,  0 );
-    GET_UINT32( W[1],  data,  4 );
-    GET_UINT32( W[2],  data,  8 );
-    GET_UINT32( W[3],  data, 12 );
-    GET_UINT32( W[4],  data, 16 );
-    GET_UINT32( W[5],  data, 20 );
-    GET_UINT32( W[6],  data, 24 );
-    GET_UINT32( W[7],  data, 28 );
-    GET_UINT32( W[8],  data, 32 );
-    GET_UINT32( W[9],  data, 36 );
-    GET_UINT32( W[10], data, 40 );
-    GET_UINT32( W[11], data, 44 );
-    GET_UINT32( W[12], data, 48 );
-    GET_UINT32( W[13], data, 52 );
-    GET_UINT32( W[14], data, 56 );
-    GET_UINT32( W[15], data, 60 );
-
-#define S(x,n) ((x << n) | ((x & 0xFFFFFFFF) >> (32 - n)))
+#define S(x,n) ((x << n) | (x >> (32 - n)))
 
 #define R(t)                                            \
 (                                                       \
@@ -65,19 +32,24 @@ void sha1_process( sha1_context *ctx, uint8 data[64] )
     e += S(a,5) + F(b,c,d) + K + x; b = S(b,30);        \
 }
 
-    A = ctx->state[0];
-    B = ctx->state[1];
-    C = ctx->state[2];
-    D = ctx->state[3];
-    E = ctx->state[4];
+static const uint32_t sha1_h0[5] =
+{
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+/*
+ * Rounds 4 to 79 of a block, with A to E the working variables after
+ * round 3 and W[0..3] already consumed, then the final addition.
+ */
+static inline void sha1_rounds( uint32_t state[5], uint32_t W[16],
+                                uint32_t A, uint32_t B, uint32_t C,
+                                uint32_t D, uint32_t E )
+{
+    uint32_t temp;
 
 #define F(x,y,z) (z ^ (x & (y ^ z)))
 #define K 0x5A827999
 
-    P( A, B, C, D, E, W[0]  );
-    P( E, A, B, C, D, W[1]  );
-    P( D, E, A, B, C, W[2]  );
-    P( C, D, E, A, B, W[3]  );
     P( B, C, D, E, A, W[4]  );
     P( A, B, C, D, E, W[5]  );
     P( E, A, B, C, D, W[6]  );
@@ -179,16 +151,69 @@ void sha1_process( sha1_context *ctx, uint8 data[64] )
 #undef K
 #undef F
 
-    ctx->state[0] += A;
-    ctx->state[1] += B;
-    ctx->state[2] += C;
-    ctx->state[3] += D;
-    ctx->state[4] += E;
+    state[0] += A;
+    state[1] += B;
+    state[2] += C;
+    state[3] += D;
+    state[4] += E;
+}
+
+/*
+ * Compress one block. The 80 rounds are unrolled and the message
+ * schedule is computed on the fly in a 16 word window.
+ */
+static void sha1_process( uint32_t state[5], const uint8_t data[64] )
+{
+    uint32_t W[16], A, B, C, D, E;
+
+    GET_UINT32( W[0],  data,  0 );
+    GET_UINT32( W[1],  data,  4 );
+    GET_UINT32( W[2],  data,  8 );
+    GET_UINT32( W[3],  data, 12 );
+    GET_UINT32( W[4],  data, 16 );
+    GET_UINT32( W[5],  data, 20 );
+    GET_UINT32( W[6],  data, 24 );
+    GET_UINT32( W[7],  data, 28 );
+    GET_UINT32( W[8],  data, 32 );
+    GET_UINT32( W[9],  data, 36 );
+    GET_UINT32( W[10], data, 40 );
+    GET_UINT32( W[11], data, 44 );
+    GET_UINT32( W[12], data, 48 );
+    GET_UINT32( W[13], data, 52 );
+    GET_UINT32( W[14], data, 56 );
+    GET_UINT32( W[15], data, 60 );
+
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+    E = state[4];
+
+#define F(x,y,z) (z ^ (x & (y ^ z)))
+#define K 0x5A827999
+
+    P( A, B, C, D, E, W[0]  );
+    P( E, A, B, C, D, W[1]  );
+    P( D, E, A, B, C, W[2]  );
+    P( C, D, E, A, B, W[3]  );
+
+#undef K
+#undef F
+
+    sha1_rounds( state, W, A, B, C, D, E );
+}
+
+void sha1_starts( sha1_context *ctx )
+{
+    ctx->total[0] = 0;
+    ctx->total[1] = 0;
+
+    memcpy( ctx->state, sha1_h0, sizeof( sha1_h0 ) );
 }
 
-void sha1_update( sha1_context *ctx, uint8 *input, uint32 length )
+void sha1_update( sha1_context *ctx, const uint8_t *input, uint32_t length )
 {
-    uint32 left, fill;
+    uint32_t left, fill;
 
     if( ! length ) return;
 
@@ -196,7 +221,6 @@ void sha1_update( sha1_context *ctx, uint8 *input, uint32 length )
     fill = 64 - left;
 
     ctx->total[0] += length;
-    ctx->total[0] &= 0xFFFFFFFF;
 
     if( ctx->total[0] < length )
         ctx->total[1]++;
@@ -205,7 +229,7 @@ void sha1_update( sha1_context *ctx, uint8 *input, uint32 length )
     {
         memcpy( (void *) (ctx->buffer + left),
                 (void *) input, fill );
-        sha1_process( ctx, ctx->buffer );
+        sha1_process( ctx->state, ctx->buffer );
         length -= fill;
         input  += fill;
         left = 0;
@@ -213,7 +237,7 @@ void sha1_update( sha1_context *ctx, uint8 *input, uint32 length )
 
     while( length >= 64 )
     {
-        sha1_process( ctx, input );
+        sha1_process( ctx->state, input );
         length -= 64;
         input  += 64;
     }
@@ -225,7 +249,7 @@ void sha1_update( sha1_context *ctx, uint8 *input, uint32 length )
     }
 }
 
-static uint8 sha1_padding[64] =
+static const uint8_t sha1_padding[64] =
 {
  0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -233,11 +257,11 @@ static uint8 sha1_padding[64] =
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
-void sha1_finish( sha1_context *ctx, uint8 digest[20] )
+void sha1_finish( sha1_context *ctx, uint8_t digest[20] )
 {
-    uint32 last, padn;
-    uint32 high, low;
-    uint8 msglen[8];
+    uint32_t last, padn;
+    uint32_t high, low;
+    uint8_t msglen[8];
 
     high = ( ctx->total[0] >> 29 )
          | ( ctx->total[1] <<  3 );
@@ -258,3 +282,98 @@ void sha1_finish( sha1_context *ctx, uint8 digest[20] )
     PUT_UINT32( ctx->state[3], digest, 12 );
     PUT_UINT32( ctx->state[4], digest, 16 );
 }
+
+void sha1_digest( const uint8_t *input, uint32_t length, uint8_t digest[20] )
+{
+    uint32_t state[5];
+    uint8_t tail[128];
+    uint32_t left, padn;
+
+    memcpy( state, sha1_h0, sizeof( sha1_h0 ) );
+
+    for( left = length; left >= 64; left -= 64, input += 64 )
+        sha1_process( state, input );
+
+    padn = ( left < 56 ) ? 64 : 128;
+
+    memcpy( tail, input, left );
+    tail[left] = 0x80;
+    memset( tail + left + 1, 0, padn - left - 9 );
+
+    PUT_UINT32( length >> 29, tail, padn - 8 );
+    PUT_UINT32( length <<  3, tail, padn - 4 );
+
+    sha1_process( state, tail );
+    if( padn == 128 )
+        sha1_process( state, tail + 64 );
+
+    PUT_UINT32( state[0], digest,  0 );
+    PUT_UINT32( state[1], digest,  4 );
+    PUT_UINT32( state[2], digest,  8 );
+    PUT_UINT32( state[3], digest, 12 );
+    PUT_UINT32( state[4], digest, 16 );
+}
+
+void sha1_midstate_init( sha1_midstate *ms, const uint8_t prefix[16] )
+{
+    uint32_t *W = ms->W, A, B, C, D, E;
+
+    GET_UINT32( W[0], prefix,  0 );
+    GET_UINT32( W[1], prefix,  4 );
+    GET_UINT32( W[2], prefix,  8 );
+    GET_UINT32( W[3], prefix, 12 );
+
+    A = sha1_h0[0];
+    B = sha1_h0[1];
+    C = sha1_h0[2];
+    D = sha1_h0[3];
+    E = sha1_h0[4];
+
+#define F(x,y,z) (z ^ (x & (y ^ z)))
+#define K 0x5A827999
+
+    P( A, B, C, D, E, W[0]  );
+    P( E, A, B, C, D, W[1]  );
+    P( D, E, A, B, C, W[2]  );
+    P( C, D, E, A, B, W[3]  );
+
+#undef K
+#undef F
+
+    ms->v[0] = A;
+    ms->v[1] = B;
+    ms->v[2] = C;
+    ms->v[3] = D;
+    ms->v[4] = E;
+}
+
+void sha1_midstate_digest( const sha1_midstate *ms, const uint8_t suffix[16],
+                           uint8_t digest[20] )
+{
+    uint32_t state[5], W[16];
+
+    W[0] = ms->W[0];
+    W[1] = ms->W[1];
+    W[2] = ms->W[2];
+    W[3] = ms->W[3];
+
+    GET_UINT32( W[4], suffix,  0 );
+    GET_UINT32( W[5], suffix,  4 );
+    GET_UINT32( W[6], suffix,  8 );
+    GET_UINT32( W[7], suffix, 12 );
+
+    /* padding of a 32 byte message, constant */
+    W[8]  = 0x80000000;
+    W[9]  = W[10] = W[11] = W[12] = W[13] = W[14] = 0;
+    W[15] = 32 << 3;
+
+    memcpy( state, sha1_h0, sizeof( sha1_h0 ) );
+
+    sha1_rounds( state, W, ms->v[0], ms->v[1], ms->v[2], ms->v[3], ms->v[4] );
+
+    PUT_UINT32( state[0], digest,  0 );
+    PUT_UINT32( state[1], digest,  4 );
+    PUT_UINT32( state[2], digest,  8 );
+    PUT_UINT32( state[3], digest, 12 );
+    PUT_UINT32( state[4], digest, 16 );
+}
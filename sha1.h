@@ -1,24 +1,40 @@
 #ifndef _SHA1_H
 #define _SHA1_H
 
-#ifndef uint8
-#define uint8  unsigned char
-#endif
-
-#ifndef uint32
-#define uint32 unsigned long int
-#endif
+#include <stdint.h>
 
 typedef struct
 {
-    uint32 total[2];
-    uint32 state[5];
-    uint8 buffer[64];
+    uint32_t total[2];
+    uint32_t state[5];
+    uint8_t buffer[64];
 }
 sha1_context;
 
 void sha1_starts( sha1_context *ctx );
-void sha1_update( sha1_context *ctx, uint8 *input, uint32 length );
-void sha1_finish( sha1_context *ctx, uint8 digest[20] );
+void sha1_update( sha1_context *ctx, const uint8_t *input, uint32_t length );
+void sha1_finish( sha1_context *ctx, uint8_t digest[20] );
+
+/*
+ * One-shot digest of a buffer already in memory: whole blocks are
+ * hashed in place and only the padded tail is copied.
+ */
+void sha1_digest( const uint8_t *input, uint32_t length, uint8_t digest[20] );
+
+/*
+ * Digest of a 32 byte message whose first 16 bytes are fixed: the
+ * rounds that only depend on the prefix are run once in
+ * sha1_midstate_init(), each digest only finishes the suffix.
+ */
+typedef struct
+{
+    uint32_t W[4];
+    uint32_t v[5];
+}
+sha1_midstate;
+
+void sha1_midstate_init( sha1_midstate *ms, const uint8_t prefix[16] );
+void sha1_midstate_digest( const sha1_midstate *ms, const uint8_t suffix[16],
+                           uint8_t digest[20] );
 
 #endif /* sha1.h */
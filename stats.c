@@ -0,0 +1,391 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+
+#include "config.h"
+#include "utils.h"
+#include "column.h"
+
+#define stats_err(format, arg...) DBG_PRINT_FUNC(format, "STATS_ERR", ##arg)
+
+/*
+ * Aggregates over the column store the parser writes next to each log
+ * (logfile.cols/, see column.h), without touching the logs themselves:
+ *
+ *   stats -t cmd -g uid,day *.cols          commands per user per day
+ *   stats -g session -a duration *.cols     session durations
+ *   stats -g ip -n 10 *.cols                top source IPs
+ *
+ * Columns are decoded a block at a time and every step (filter, group
+ * key, aggregate) runs over the whole block before the next one.
+ */
+
+enum { COL_TIME, COL_UID, COL_PID, COL_IP, COL_DIR, COL_LEN, COL_HASH, COL_NB };
+
+static const char *col_names[COL_NB] = {
+    "time", "uid", "pid", "ip", "dir", "len", "hash"
+};
+
+enum { KEY_NONE, KEY_UID, KEY_PID, KEY_IP, KEY_DIR, KEY_DAY, KEY_HOUR,
+    KEY_SESSION, KEY_HASH, KEY_NB };
+
+static const char *key_names[KEY_NB] = {
+    "all", "uid", "pid", "ip", "dir", "day", "hour", "session", "hash"
+};
+
+enum { AGG_COUNT, AGG_BYTES, AGG_DURATION };
+
+typedef struct {
+    uint64_t k[2];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    int used;
+} Group_t;
+
+static Group_t *groups = NULL;
+static uint64_t nb_groups = 0, groups_size = 0;
+static int agg = AGG_COUNT;
+
+static int key_columns(int key) {
+    switch (key) {
+    case KEY_UID:
+	return 1 << COL_UID;
+    case KEY_PID:
+	return 1 << COL_PID;
+    case KEY_IP:
+	return 1 << COL_IP;
+    case KEY_DIR:
+	return 1 << COL_DIR;
+    case KEY_DAY:
+    case KEY_HOUR:
+	return 1 << COL_TIME;
+    case KEY_SESSION:
+	return 1 << COL_IP | 1 << COL_PID;
+    case KEY_HASH:
+	return 1 << COL_HASH;
+    }
+
+    return 0;
+}
+
+static int parse_key(const char *s, int len) {
+    int i = 0;
+
+    for (i = 0; i < KEY_NB; i++) {
+	if ((int) strlen(key_names[i]) == len && strncmp(s, key_names[i], len) == 0)
+	    return i;
+    }
+
+    return -1;
+}
+
+/* group key of every row of the block */
+static void compute_key(int key, uint64_t vals[COL_NB][COL_BLOCK],
+	uint64_t *out, int nb) {
+    int i = 0;
+
+    switch (key) {
+    case KEY_NONE:
+	memset(out, 0, nb * sizeof (uint64_t));
+	break;
+    case KEY_UID:
+	memcpy(out, vals[COL_UID], nb * sizeof (uint64_t));
+	break;
+    case KEY_PID:
+	memcpy(out, vals[COL_PID], nb * sizeof (uint64_t));
+	break;
+    case KEY_IP:
+	memcpy(out, vals[COL_IP], nb * sizeof (uint64_t));
+	break;
+    case KEY_DIR:
+	memcpy(out, vals[COL_DIR], nb * sizeof (uint64_t));
+	break;
+    case KEY_DAY:
+	for (i = 0; i < nb; i++)
+	    out[i] = vals[COL_TIME][i] / (86400 * 1000000ULL);
+	break;
+    case KEY_HOUR:
+	for (i = 0; i < nb; i++)
+	    out[i] = vals[COL_TIME][i] / (3600 * 1000000ULL);
+	break;
+    case KEY_SESSION:
+	for (i = 0; i < nb; i++)
+	    out[i] = vals[COL_IP][i] << 32 | vals[COL_PID][i];
+	break;
+    case KEY_HASH:
+	memcpy(out, vals[COL_HASH], nb * sizeof (uint64_t));
+	break;
+    }
+}
+
+static Group_t *find_group(uint64_t k0, uint64_t k1) {
+    Group_t *old = groups;
+    uint64_t old_size = groups_size, i = 0, h = 0;
+
+    if (2 * (nb_groups + 1) > groups_size) {
+	groups_size = groups_size ? groups_size * 2 : 1024;
+	if ((groups = calloc(groups_size, sizeof (Group_t))) == NULL) {
+	    stats_err("Memory allocation error\n");
+	    exit(1);
+	}
+	nb_groups = 0;
+	for (i = 0; i < old_size; i++) {
+	    if (old[i].used)
+		*find_group(old[i].k[0], old[i].k[1]) = old[i];
+	}
+	free(old);
+    }
+
+    h = (k0 * 0x9E3779B97F4A7C15ULL) ^ (k1 * 0xC2B2AE3D27D4EB4FULL);
+
+    for (i = h & (groups_size - 1); groups[i].used;
+	    i = (i + 1) & (groups_size - 1)) {
+	if (groups[i].k[0] == k0 && groups[i].k[1] == k1)
+	    return &groups[i];
+    }
+
+    groups[i].used = 1;
+    groups[i].k[0] = k0;
+    groups[i].k[1] = k1;
+    groups[i].min = ~0ULL;
+    nb_groups++;
+
+    return &groups[i];
+}
+
+static uint64_t group_value(const Group_t *g) {
+    switch (agg) {
+    case AGG_BYTES:
+	return g->sum;
+    case AGG_DURATION:
+	return g->max - g->min;
+    }
+
+    return g->count;
+}
+
+static int cmp_group(const void *a, const void *b) {
+    uint64_t x = group_value(a), y = group_value(b);
+
+    return (x < y) - (x > y);
+}
+
+static void print_key(int key, uint64_t v) {
+    time_t t = 0;
+    char date[32];
+
+    switch (key) {
+    case KEY_NONE:
+	printf("%-20s", "all");
+	break;
+    case KEY_IP:
+	snprintf(date, sizeof (date), "%u.%u.%u.%u", (unsigned) (v & 0xFF),
+		(unsigned) ((v >> 8) & 0xFF), (unsigned) ((v >> 16) & 0xFF),
+		(unsigned) ((v >> 24) & 0xFF));
+	printf("%-20s", date);
+	break;
+    case KEY_DAY:
+	t = v * 86400;
+	strftime(date, sizeof (date), "%Y-%m-%d", gmtime(&t));
+	printf("%-20s", date);
+	break;
+    case KEY_HOUR:
+	t = v * 3600;
+	strftime(date, sizeof (date), "%Y-%m-%d %H:00", gmtime(&t));
+	printf("%-20s", date);
+	break;
+    case KEY_SESSION:
+	snprintf(date, sizeof (date), "%u.%u.%u.%u:%u",
+		(unsigned) ((v >> 32) & 0xFF), (unsigned) ((v >> 40) & 0xFF),
+		(unsigned) ((v >> 48) & 0xFF), (unsigned) ((v >> 56) & 0xFF),
+		(unsigned) (v & 0xFFFFFFFF));
+	printf("%-20s", date);
+	break;
+    case KEY_HASH:
+	printf("%016llx    ", (unsigned long long) v);
+	break;
+    default:
+	printf("%-20llu", (unsigned long long) v);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-t rec|cmd] [-g key[,key]] [-a count|bytes|duration]\n"
+	    "          [-f key=value] [-n top] <logfile.cols>...\n"
+	    "keys: uid pid ip dir day hour session hash (cmd only)\n\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    static uint64_t vals[COL_NB][COL_BLOCK];
+    static uint64_t keys[2][COL_BLOCK];
+    static uint64_t fkey[COL_BLOCK];
+    static uint8_t keep[COL_BLOCK];
+    Col_Reader_t readers[COL_NB];
+    Group_t *g = NULL;
+    const char *table = "rec";
+    char *comma = NULL, *eq = NULL;
+    char path[512];
+    int group[2] = { KEY_NONE, KEY_NONE };
+    int filter = -1, need = 0, opt = 0, c = 0, nb = 0, n = 0, d = 0, i = 0;
+    uint64_t filter_val = 0, nb_rows = 0, top = 20, start = 0;
+
+    while ((opt = getopt(argc, argv, "t:g:a:f:n:")) != -1) {
+	switch (opt) {
+	case 't':
+	    table = optarg;
+	    if (strcmp(table, "rec") && strcmp(table, "cmd"))
+		usage(argv[0]);
+	    break;
+	case 'g':
+	    comma = strchr(optarg, ',');
+	    group[0] = parse_key(optarg, comma ? comma - optarg : (int) strlen(optarg));
+	    if (comma)
+		group[1] = parse_key(comma + 1, strlen(comma + 1));
+	    if (group[0] < 0 || group[1] < 0)
+		usage(argv[0]);
+	    break;
+	case 'a':
+	    if (strcmp(optarg, "count") == 0)
+		agg = AGG_COUNT;
+	    else if (strcmp(optarg, "bytes") == 0)
+		agg = AGG_BYTES;
+	    else if (strcmp(optarg, "duration") == 0)
+		agg = AGG_DURATION;
+	    else
+		usage(argv[0]);
+	    break;
+	case 'f':
+	    if ((eq = strchr(optarg, '=')) == NULL ||
+		    (filter = parse_key(optarg, eq - optarg)) <= KEY_NONE)
+		usage(argv[0]);
+	    filter_val = strtoull(eq + 1, NULL, 0);
+	    break;
+	case 'n':
+	    top = strtoull(optarg, NULL, 0);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (optind == argc)
+	usage(argv[0]);
+
+    need = key_columns(group[0]) | key_columns(group[1]);
+    if (filter > KEY_NONE)
+	need |= key_columns(filter);
+    if (agg == AGG_BYTES)
+	need |= 1 << COL_LEN;
+    if (agg == AGG_DURATION)
+	need |= 1 << COL_TIME;
+
+    if (strcmp(table, "cmd") == 0 && (need & (1 << COL_DIR | 1 << COL_LEN))) {
+	stats_err("Commands have no dir or len\n");
+	exit(1);
+    }
+    if (strcmp(table, "rec") == 0 && (need & 1 << COL_HASH)) {
+	stats_err("Records have no hash, use -t cmd\n");
+	exit(1);
+    }
+
+    /* always read one column, so plain counts know the row numbers */
+
+    if (need == 0)
+	need = 1 << COL_UID;
+
+    start = clock_us(CLOCK_MONOTONIC);
+
+    for (d = optind; d < argc; d++) {
+	for (c = 0; c < COL_NB; c++) {
+	    if (!(need & 1 << c))
+		continue;
+	    snprintf(path, sizeof (path), "%s/%s.%s", argv[d], table, col_names[c]);
+	    if (col_open(&readers[c], path)) {
+		stats_err("Column %s open failed: %d\n", path, errno);
+		exit(1);
+	    }
+	}
+
+	while (1) {
+	    nb = -1;
+	    for (c = 0; c < COL_NB; c++) {
+		if (!(need & 1 << c))
+		    continue;
+		n = col_next(&readers[c], vals[c]);
+		if (nb >= 0 && n != nb) {
+		    stats_err("Columns of %s do not line up\n", argv[d]);
+		    exit(1);
+		}
+		nb = n;
+	    }
+	    if (nb <= 0)
+		break;
+
+	    nb_rows += nb;
+
+	    compute_key(group[0], vals, keys[0], nb);
+	    compute_key(group[1], vals, keys[1], nb);
+
+	    memset(keep, 1, nb);
+	    if (filter > KEY_NONE) {
+		compute_key(filter, vals, fkey, nb);
+		for (i = 0; i < nb; i++)
+		    keep[i] = (fkey[i] == filter_val);
+	    }
+
+	    for (i = 0; i < nb; i++) {
+		if (!keep[i])
+		    continue;
+		g = find_group(keys[0][i], keys[1][i]);
+		g->count++;
+		if (agg == AGG_BYTES)
+		    g->sum += vals[COL_LEN][i];
+		if (agg == AGG_DURATION) {
+		    if (vals[COL_TIME][i] < g->min)
+			g->min = vals[COL_TIME][i];
+		    if (vals[COL_TIME][i] > g->max)
+			g->max = vals[COL_TIME][i];
+		}
+	    }
+	}
+
+	for (c = 0; c < COL_NB; c++) {
+	    if (need & 1 << c)
+		col_release(&readers[c]);
+	}
+    }
+
+    /* pack the used groups to the front and rank them */
+
+    for (i = 0, n = 0; (uint64_t) i < groups_size; i++) {
+	if (groups[i].used)
+	    groups[n++] = groups[i];
+    }
+    qsort(groups, n, sizeof (Group_t), cmp_group);
+
+    for (i = 0; i < n && (uint64_t) i < top; i++) {
+	print_key(group[0], groups[i].k[0]);
+	if (group[1] != KEY_NONE)
+	    print_key(group[1], groups[i].k[1]);
+	if (agg == AGG_DURATION)
+	    printf(" %12.1f s\n", group_value(&groups[i]) / 1e6);
+	else
+	    printf(" %12llu\n", (unsigned long long) group_value(&groups[i]));
+    }
+
+    fprintf(stderr, "%llu rows, %llu groups in %.3f ms\n",
+	    (unsigned long long) nb_rows, (unsigned long long) nb_groups,
+	    (clock_us(CLOCK_MONOTONIC) - start) / 1000.0);
+
+    return 0;
+}
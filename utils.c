@@ -43,3 +43,121 @@ void pretty_time(char *str) {
     snprintf(str, 9, "%02d:%02d:%02d", now_tm.tm_hour, now_tm.tm_min, now_tm.tm_sec);
 }
 
+
+/*
+ * Microseconds on the given clock. CLOCK_REALTIME and CLOCK_MONOTONIC are
+ * served from the vDSO on Linux, so this stays off the syscall path.
+ */
+uint64_t clock_us(clockid_t clk) {
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* FNV-1a, for the command and token hashes of the side indexes */
+uint64_t hash64(const void *data, uint32_t len) {
+    const uint8_t *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t i = 0;
+
+    for (i = 0; i < len; i++)
+	h = (h ^ p[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+/*
+ * Hand run() the literal runs every match of an extended regex has to
+ * contain, for use as a prefilter. Only the simple cases are handled:
+ * groups are skipped whole and a regex with alternation gets no run at
+ * all; returns -1 then.
+ */
+int regex_runs(const char *re, regex_run_cb run_cb, void *ctx) {
+    char run[1024];
+    uint32_t len = 0;
+    const char *p = NULL;
+    int depth = 0;
+    char delim = 0;
+
+    if (strchr(re, '|'))
+	return -1;
+
+    for (p = re; ; p++) {
+	switch (*p) {
+	case '\\':
+	    /* an escaped punctuation char is just that char */
+	    if (p[1] && !((p[1] >= 'a' && p[1] <= 'z') ||
+		    (p[1] >= 'A' && p[1] <= 'Z') || (p[1] >= '0' && p[1] <= '9'))) {
+		if (len < sizeof (run))
+		    run[len++] = *++p;
+		break;
+	    }
+	    goto flush;
+	case '*':
+	case '?':
+	case '{':
+	    /* the atom before is optional */
+	    if (len)
+		len--;
+	    /* fall through */
+	case '\0':
+	case '.':
+	case '[':
+	case '(':
+	case '^':
+	case '$':
+	case '+':
+flush:
+	    if (len)
+		run_cb(ctx, run, len);
+	    len = 0;
+
+	    if (*p == '\0')
+		return 0;
+
+	    if (*p == '\\' && p[1]) {
+		p++;
+	    } else if (*p == '[') {
+		/* a class matches one unknown char, skip it */
+		if (p[1] == '^')
+		    p++;
+		if (p[1] == ']')
+		    p++;
+		while (p[1] && p[1] != ']') {
+		    /* [:alpha:], [=e=] and [.-.] end in a ']' of their own */
+		    if (p[1] == '[' && p[2] && strchr(":=.", p[2])) {
+			delim = p[2];
+			p += 2;
+			while (p[1] && !(p[1] == delim && p[2] == ']'))
+			    p++;
+			if (p[1])
+			    p += 2;
+		    } else {
+			p++;
+		    }
+		}
+		if (p[1])
+		    p++;
+	    } else if (*p == '{') {
+		while (p[1] && *p != '}')
+		    p++;
+	    } else if (*p == '(') {
+		/* the group may be optional or repeated, skip it */
+		for (depth = 1; p[1] && depth; p++) {
+		    if (p[1] == '\\' && p[2])
+			p++;
+		    else if (p[1] == '(')
+			depth++;
+		    else if (p[1] == ')')
+			depth--;
+		}
+	    }
+	    break;
+	default:
+	    if (len < sizeof (run))
+		run[len++] = *p;
+	}
+    }
+}
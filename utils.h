@@ -1,6 +1,9 @@
 #ifndef _UTILS_H
 #define _UTILS_H
 
+#include <stdint.h>
+#include <time.h>
+
 #define RETURN(s) {return_status = s; goto __return;}
 #define SZARR(a) (sizeof(a)/sizeof((a)[0]))
 #define _FREE(ptr)                                     \
@@ -10,6 +13,11 @@
     } while (0)
 
 void pretty_time(char *str);
+uint64_t clock_us(clockid_t clk);
+uint64_t hash64(const void *data, uint32_t len);
+typedef void (*regex_run_cb)(void *ctx, const char *s, uint32_t len);
+
+int regex_runs(const char *re, regex_run_cb run_cb, void *ctx);
 void __print_output(const unsigned char *str, size_t size);
 
 #endif /* _UTILS_H */